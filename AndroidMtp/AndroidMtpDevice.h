@@ -17,19 +17,27 @@
 #ifndef _MTP_DEVICE_H
 #define _MTP_DEVICE_H
 
+#include "MtpBufferPool.h"
+#include "MtpCapabilities.h"
 #include "MtpEventPacket.h"
 #include "MtpDataPacket.h"
+#include "MtpPropertyCache.h"
 #include "MtpRequestPacket.h"
 #include "MtpResponsePacket.h"
+#include "MtpStringPool.h"
 #include "MtpTypes.h"
 
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <thread>
 
 struct libusb_device_handle;
 struct libusb_transfer;
 struct libusb_device;
 struct libusb_request;
 struct libusb_endpoint_descriptor;
+struct libusb_transfer_queue;
 
 namespace android {
 
@@ -39,6 +47,18 @@ class MtpObjectInfo;
 class MtpStorageInfo;
 
 class AndroidMtpDevice {
+public:
+    // Running totals for sendObject(), so the upload paths can be compared.
+    struct TransferStats {
+        uint64_t            bytes = 0;
+        uint64_t            microseconds = 0;
+        uint32_t            transfers = 0;
+
+        double              bytesPerSecond() const {
+            return microseconds ? bytes * 1000000.0 / microseconds : 0;
+        }
+    };
+
 private:
     struct libusb_device*   mDevice;
     struct libusb_device_handle*mDeviceHandle;
@@ -54,17 +74,27 @@ private:
     struct libusb_request*  mRequestIntr;
     MtpDeviceInfo*          mDeviceInfo;
     MtpPropertyList         mDeviceProperties;
+    // mDeviceInfo as bitsets, filled in by initialize()
+    MtpCapabilities         mCapabilities;
 
     // current session ID
     MtpSessionID            mSessionID;
     // current transaction ID
     MtpTransactionID        mTransactionID;
 
+    // packet buffers for mRequest, mData and mResponse. declared first so it outlives them.
+    MtpBufferPool           mBufferPool;
     MtpRequestPacket        mRequest;
     MtpDataPacket           mData;
     MtpResponsePacket       mResponse;
     MtpEventPacket          mEventPacket;
 
+    // where the strings of the object infos we return are kept, see setStringPool()
+    MtpStringPool           mOwnStrings;
+    MtpStringPool*          mStrings;
+    // object property values read so far, strings in *mStrings. see getObjectPropValues()
+    MtpPropertyCache        mPropertyCache;
+
     // set to true if we received a response packet instead of a data packet
     bool                    mReceivedResponse;
     bool                    mProcessingEvent;
@@ -79,8 +109,27 @@ private:
     std::mutex              mEventMutex;
     std::mutex              mEventMutexForInterrupt;
 
+    // background thread keeping an event request armed, see startEventListener()
+    std::thread             mEventListener;
+    std::atomic<bool>       mEventListenerStop;
+    std::atomic<int>        mEventListenerHandle;
+
     // Remember the device's packet division mode.
     UrbPacketDivisionMode   mPacketDivisionMode;
+
+    // bulk-IN transfers kept in flight while streaming a data phase.
+    // a depth of 0 selects the old two-buffer ping-pong instead.
+    int                     mReadQueueDepth;
+    uint32_t                mReadTransferSize;
+    struct libusb_transfer_queue* mReadQueue;
+    // bulk-OUT transfers kept in flight by sendObject(). 0 or 1 selects the serial path.
+    int                     mWriteQueueDepth;
+    TransferStats           mUploadStats;
+    // moving average of data phase throughput, bytes per second. sizes the stream timeouts.
+    double                  mThroughput;
+    // progress of a data phase read with readDataStart()
+    std::chrono::steady_clock::time_point mDataStart;
+    uint64_t                mDataBytes;
     bool                    mNotificationIsReleased = false;
     unsigned int            mNotification;
 public:
@@ -88,6 +137,13 @@ public:
 public:
     typedef bool (*ReadObjectCallback)
             (void* data, uint32_t offset, uint32_t length, void* clientData);
+    typedef void (*EventCallback)
+            (MtpEventCode code, const uint32_t (&parameters)[3], void* clientData);
+    // Called for each entry of a listing as its data phase is decoded, while the rest is still
+    // coming in. The device is locked meanwhile, so they mustn't call back into it. Object
+    // infos belong to the callback, which returns false to cancel the rest of the listing.
+    typedef void (*ObjectHandleCallback)(MtpObjectHandle handle, void* clientData);
+    typedef bool (*ObjectInfoCallback)(MtpObjectInfo* info, void* clientData);
 
     AndroidMtpDevice(struct libusb_device* device,
               struct libusb_device_handle* handle,
@@ -122,10 +178,32 @@ public:
     MtpObjectHandleList*    getObjectHandles(MtpStorageID storageID, MtpObjectFormat format,
                                     MtpObjectHandle parent);
     MtpObjectInfo*          getObjectInfo(MtpObjectHandle handle);
+    // Reads |property| (0xFFFFFFFF for all of them) of |handle|, or of the objects |depth|
+    // levels below it, in a single GetObjectPropList transaction. Only the fields the device
+    // reported are filled in, so mName is empty if the file name wasn't among them.
+    MtpObjectInfoList*      getObjectPropList(MtpObjectHandle handle, MtpObjectFormat format,
+                                              uint32_t property, uint32_t depth);
+    // Streaming versions of the two listings above: only a window of the data phase is held,
+    // and each entry goes to |callback| as soon as it's complete. An object is handed over
+    // once the device moves on to the next one, so the prop list fails if the device doesn't
+    // keep an object's properties together; what was handed over by then is partial and
+    // should be dropped in favour of the buffered call.
+    bool                    getObjectHandles(MtpStorageID storageID, MtpObjectFormat format,
+                                             MtpObjectHandle parent,
+                                             ObjectHandleCallback callback, void* clientData);
+    bool                    getObjectPropList(MtpObjectHandle handle, MtpObjectFormat format,
+                                              uint32_t property, uint32_t depth,
+                                              ObjectInfoCallback callback, void* clientData);
     void*                   getThumbnail(MtpObjectHandle handle, int& outLength);
     MtpObjectHandle         sendObjectInfo(MtpObjectInfo* info);
     bool                    sendObject(MtpObjectHandle handle, uint32_t size, int srcFD);
     bool                    deleteObject(MtpObjectHandle handle);
+    // Moves |handle| under |parent| on |storageID|, 0 being the storage's root.
+    bool                    moveObject(MtpObjectHandle handle, MtpStorageID storageID,
+                                       MtpObjectHandle parent);
+    // Copies |handle| under |parent| on |storageID| and returns the copy's handle, or 0.
+    MtpObjectHandle         copyObject(MtpObjectHandle handle, MtpStorageID storageID,
+                                       MtpObjectHandle parent);
     MtpObjectHandle         getParent(MtpObjectHandle handle);
     MtpStorageID            getStorageID(MtpObjectHandle handle);
 
@@ -138,6 +216,23 @@ public:
     // Reads value of |property| for |handle|. Returns true on success.
     bool                    setObjectPropValue(MtpObjectHandle handle, MtpProperty* property);
     bool                    getObjectPropValue(MtpObjectHandle handle, MtpProperty* property);
+    // Value of |property| for |handle| from the property cache, read from the device if it
+    // isn't there yet.
+    bool                    getObjectPropValue(MtpObjectHandle handle, MtpObjectProperty property,
+                                               MtpPropertyCache::Value& value);
+    // Brings |property| of |count| objects into the property cache. Objects it already holds
+    // are skipped. The others each take one GetObjectPropList for all their properties, or
+    // one GetObjectPropValue on devices without it, back to back under a single hold of the
+    // lock. Returns false if any of them failed. Events and changes made through this device
+    // drop an object's cached values.
+    bool                    getObjectPropValues(const MtpObjectHandle* handles, size_t count,
+                                                MtpObjectProperty property);
+    // The same for |count| children of |parent|, 0 for a storage root. Where the device has
+    // GetObjectPropList, the property comes for the whole directory in one depth 1 listing
+    // and all of it is cached; what that leaves out is asked for as above.
+    bool                    getChildPropValues(MtpObjectHandle parent,
+                                               const MtpObjectHandle* handles, size_t count,
+                                               MtpObjectProperty property);
 
     bool                    readObject(MtpObjectHandle handle, ReadObjectCallback callback,
                                     uint32_t objectSize, void* clientData);
@@ -156,6 +251,18 @@ public:
                                                 uint32_t *writtenSize,
                                                 ReadObjectCallback callback,
                                                 void* clientData);
+    // Same as above, but the data is read straight into |buffer|, which must hold |size| bytes.
+    // Only the first packet, which carries the container header, goes through the packet buffer.
+    bool                    readPartialObject(MtpObjectHandle handle,
+                                              uint32_t offset,
+                                              uint32_t size,
+                                              uint32_t *writtenSize,
+                                              void* buffer);
+    bool                    readPartialObject64(MtpObjectHandle handle,
+                                                uint64_t offset,
+                                                uint32_t size,
+                                                uint32_t *writtenSize,
+                                                void* buffer);
     // Starts a request to read MTP event from MTP device. It returns a request handle that
     // can be used for blocking read or cancel. If other thread has already been processing an
     // event returns -1.
@@ -169,6 +276,26 @@ public:
     // |submitEventRequest|. If there is a thread blocked by |reapEventRequest| with the same
     // |handle|, the thread will resume.
     void                    discardEventRequest(int handle);
+    // Keeps an event request armed on the interrupt endpoint and calls |callback| for every
+    // event from a background thread. The callback may issue transactions.
+    bool                    startEventListener(EventCallback callback, void* clientData);
+    void                    stopEventListener();
+
+    // Sets how many bulk-IN transfers of |transferSize| bytes readObject() and
+    // readPartialObject() keep queued. |depth| 0 falls back to double buffering.
+    void                    setReadQueue(int depth, uint32_t transferSize);
+    // Sets how many bulk-OUT transfers sendObject() keeps in flight while reading ahead
+    // from the source file. |depth| 0 sends one chunk at a time.
+    void                    setWriteQueue(int depth);
+    // Object infos returned from now on keep their strings in |pool|, which has to outlive
+    // them. NULL goes back to the device's own pool, which dies with the device.
+    void                    setStringPool(MtpStringPool* pool);
+    TransferStats           getUploadStats();
+    // What the device supports, as of initialize().
+    const MtpCapabilities&  getCapabilities() const { return mCapabilities; }
+    // Bytes moved per bulk transfer in each direction, negotiated from the endpoint descriptors.
+    uint32_t                getBulkInTransferSize();
+    uint32_t                getBulkOutTransferSize();
 
 private:
     // If |objectSize| is not NULL, it checks object size before reading data bytes.
@@ -181,11 +308,41 @@ private:
                                      const uint32_t* objectSize,
                                      uint32_t* writtenData,
                                      void* clientData);
+    // Streams the rest of a data phase, from |offset| up to |length|, into |callback|, or into
+    // |destination| + offset when it's not NULL.
+    bool                    readDataQueued(ReadObjectCallback callback,
+                                           uint32_t offset,
+                                           uint32_t length,
+                                           bool writingError,
+                                           void* clientData,
+                                           uint8_t* destination);
+    // Reads a data phase of at most |bufferSize| bytes into |buffer|.
+    bool                    readDataInto(void* buffer, uint32_t bufferSize, uint32_t* writtenSize);
+    // Discards the rest of a data phase of |length| bytes along with its response.
+    bool                    readDataDrain(uint32_t length);
+    struct libusb_transfer_queue* readQueue();
+    bool                    readDataDoubleBuffered(ReadObjectCallback callback,
+                                                   uint32_t offset,
+                                                   uint32_t length,
+                                                   bool writingError,
+                                                   void* clientData);
     bool                    sendRequest(MtpOperationCode operation);
     bool                    sendData();
     bool                    readData();
+    // Windowed readData() on top of MtpDataPacket::readStart(): readDataStart() gets the
+    // first transfer in, readDataContinue() each one after that.
+    bool                    readDataStart();
+    bool                    readDataContinue();
     bool                    writeDataHeader(MtpOperationCode operation, int dataLength);
     MtpResponseCode         readResponse();
+    // Timeout for one |bytes| transfer in a data phase that's already flowing.
+    unsigned int            streamTimeout(uint32_t bytes) const;
+    // Feeds a data phase into mThroughput and resizes the stream timeouts to match.
+    void                    recordThroughput(uint64_t bytes, uint64_t microseconds);
+    // Gets a failed transaction out of the way without reopening the session: cancels it,
+    // waits while the device reports busy, clears stalls and drains leftover data. |error| is
+    // the libusb error that gave it away.
+    void                    recoverTransaction(int error);
     
 public:
     // iokit methods
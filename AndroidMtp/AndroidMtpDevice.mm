@@ -16,16 +16,23 @@
 
 #define LOG_TAG "AndroidMtpDevice"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <signal.h>
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <IOKit/IOKitLib.h>
 
 #include "MtpDebug.h"
@@ -70,6 +77,31 @@ static bool isMtpDevice(uint16_t vendor, uint16_t product) {
 
 namespace {
 
+// bulk-IN transfers kept in flight by readData(). Four is enough to hide the
+// completion-to-resubmit gap without holding much memory per device.
+constexpr int kDefaultReadQueueDepth = 4;
+// bulk-OUT transfers kept in flight by sendObject(); one draining while the next is read.
+constexpr int kDefaultWriteQueueDepth = 3;
+
+// Once a data phase is flowing, each transfer gets this much on top of twice what the measured
+// throughput says it needs. The first transfer of a phase keeps the request's full timeout,
+// since that one also waits for the device to process the operation.
+constexpr unsigned kStreamTimeoutBaseMs = 200;
+// what's assumed before anything has been measured
+constexpr double kInitialThroughput = 1024 * 1024;
+// shorter data phases say more about latency than throughput
+constexpr uint64_t kMinThroughputSample = 256 * 1024;
+// cancelling, waiting out DEVICE_BUSY, clearing stalls and draining all fit in this
+constexpr int kRecoveryTimeoutMs = 300;
+constexpr int kDrainTimeoutMs = 20;
+// responses left behind by cancelled transactions that readResponse() will skip
+constexpr int kMaxStaleResponses = 2;
+
+// true if |container| belongs to a transaction issued before |current|
+bool isStale(MtpTransactionID container, MtpTransactionID current) {
+    return (int32_t)(current - container) > 0;
+}
+
 bool writeToFd(void* data, uint32_t /* unused_offset */, uint32_t length, void* clientData) {
     const int fd = *static_cast<int*>(clientData);
     const ssize_t result = write(fd, data, length);
@@ -341,39 +373,57 @@ AndroidMtpDevice::AndroidMtpDevice(struct libusb_device* device,
                      const libusb_endpoint_descriptor *ep_out,
                      const libusb_endpoint_descriptor *ep_intr)
     :   mDevice(device),
-        mNotification(0),
-        mNotificationIsReleased(false),
+        mDeviceHandle(handle),
         mInterface(interface),
+        mVendorId(vendorId),
+        mProductId(productId),
+        mDeviceName(deviceName),
+        mManufacturerName(manufacturerName),
+        mSerialNumber(serialNumber),
         mRequestIn1(NULL),
         mRequestIn2(NULL),
         mRequestOut(NULL),
         mRequestIntr(NULL),
         mDeviceInfo(NULL),
-        mDeviceHandle(handle),
         mSessionID(0),
-        mVendorId(vendorId),
-        mProductId(productId),
-        mDeviceName(deviceName),
-        mManufacturerName(manufacturerName),
-        mSerialNumber(serialNumber),
         mTransactionID(0),
+        mStrings(&mOwnStrings),
         mReceivedResponse(false),
         mProcessingEvent(false),
         mCurrentEventHandle(0),
         mLastSendObjectInfoTransactionID(0),
         mLastSendObjectInfoObjectHandle(0),
-        mPacketDivisionMode(FIRST_PACKET_HAS_PAYLOAD)
+        mEventListenerStop(false),
+        mEventListenerHandle(-1),
+        mPacketDivisionMode(FIRST_PACKET_HAS_PAYLOAD),
+        mReadQueueDepth(kDefaultReadQueueDepth),
+        mReadTransferSize(MTP_BUFFER_SIZE),
+        mReadQueue(NULL),
+        mWriteQueueDepth(kDefaultWriteQueueDepth),
+        mThroughput(kInitialThroughput),
+        mDataBytes(0),
+        mNotificationIsReleased(false),
+        mNotification(0)
 {
     mRequestIn1 = libusb_request_new(device, handle, ep_in);
     mRequestIn2 = libusb_request_new(device, handle, ep_in);
     mRequestOut = libusb_request_new(device, handle, ep_out);
     mRequestIntr = libusb_request_new(device, handle, ep_intr);
+    mReadTransferSize = mRequestIn1->max_transfer_size;
+    recordThroughput(0, 0);
+
+    mBufferPool.setDevice(handle);
+    mRequest.setBufferPool(&mBufferPool);
+    mData.setBufferPool(&mBufferPool);
+    mResponse.setBufferPool(&mBufferPool);
 }
 
 AndroidMtpDevice::~AndroidMtpDevice() {
+    stopEventListener();
     close();
     for (size_t i = 0; i < mDeviceProperties.size(); i++)
         delete mDeviceProperties[i];
+    libusb_transfer_queue_free(mReadQueue);
     liusb_request_free(mRequestIn1);
     liusb_request_free(mRequestIn2);
     liusb_request_free(mRequestOut);
@@ -404,6 +454,50 @@ AndroidMtpDevice::~AndroidMtpDevice() {
 //}
 
 
+void AndroidMtpDevice::setReadQueue(int depth, uint32_t transferSize)
+{
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    // every transfer but the last must end on a packet boundary, otherwise the
+    // device's next packet would overflow it.
+    const uint32_t packetSize = std::max(mRequestIn1->max_packet_size, 1);
+    mReadQueueDepth = std::max(depth, 0);
+    mReadTransferSize = std::max(transferSize - transferSize % packetSize, packetSize);
+    // rebuilt with the new geometry on next use
+    libusb_transfer_queue_free(mReadQueue);
+    mReadQueue = NULL;
+}
+
+void AndroidMtpDevice::setWriteQueue(int depth)
+{
+    std::lock_guard<std::mutex> lg(mMutex);
+    mWriteQueueDepth = std::max(depth, 0);
+}
+
+void AndroidMtpDevice::setStringPool(MtpStringPool* pool)
+{
+    std::lock_guard<std::mutex> lg(mMutex);
+    mStrings = pool ? pool : &mOwnStrings;
+    // cached strings point into the old pool
+    mPropertyCache.clear();
+}
+
+AndroidMtpDevice::TransferStats AndroidMtpDevice::getUploadStats()
+{
+    std::lock_guard<std::mutex> lg(mMutex);
+    return mUploadStats;
+}
+
+uint32_t AndroidMtpDevice::getBulkInTransferSize()
+{
+    return mReadTransferSize;
+}
+
+uint32_t AndroidMtpDevice::getBulkOutTransferSize()
+{
+    return mRequestOut->max_transfer_size;
+}
+
 uint32_t AndroidMtpDevice::getNotification()
 {
     return mNotification;
@@ -431,6 +525,7 @@ void AndroidMtpDevice::initialize() {
     openSession();
     mDeviceInfo = getDeviceInfo();
     if (mDeviceInfo) {
+        mCapabilities.setDeviceInfo(*mDeviceInfo);
         if (mDeviceInfo->mDeviceProperties) {
             int count = (int)mDeviceInfo->mDeviceProperties->size();
             for (int i = 0; i < count; i++) {
@@ -446,9 +541,13 @@ void AndroidMtpDevice::initialize() {
 void AndroidMtpDevice::close() {
     if (mDevice && mDeviceHandle) {
         libusb_clear_stall(mRequestIn1, mRequestOut, mRequestIntr);
+        mRequest.setBufferPool(NULL);
+        mData.setBufferPool(NULL);
+        mResponse.setBufferPool(NULL);
         libusb_release_interface(mDeviceHandle, (int)mInterface);
         libusb_reset_device (mDeviceHandle);
-        libusb_close(mDeviceHandle);
+        // the pool closes the handle, once packets elsewhere are done with its device memory
+        mBufferPool.closeDevice();
         libusb_unref_device(mDevice);
         mDevice = NULL;
         mDeviceHandle = NULL;
@@ -604,6 +703,43 @@ MtpObjectHandleList* AndroidMtpDevice::getObjectHandles(MtpStorageID storageID,
     return NULL;
 }
 
+bool AndroidMtpDevice::getObjectHandles(MtpStorageID storageID, MtpObjectFormat format,
+            MtpObjectHandle parent, ObjectHandleCallback callback, void* clientData) {
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    mRequest.reset();
+    mRequest.setParameter(1, storageID);
+    mRequest.setParameter(2, format);
+    mRequest.setParameter(3, parent);
+    if (!sendRequest(MTP_OPERATION_GET_OBJECT_HANDLES))
+        return false;
+    if (!readDataStart())
+        return false;
+
+    // the count may well arrive on its own, when the device sends the header separately
+    bool haveCount = false;
+    uint32_t count = 0, decoded = 0;
+    for (;;) {
+        if (!haveCount)
+            haveCount = mData.getUInt32(count);
+        MtpObjectHandle handle;
+        while (haveCount && decoded < count && mData.getUInt32(handle)) {
+            callback(handle, clientData);
+            decoded++;
+        }
+        if (mData.isReadComplete())
+            break;
+        if (!readDataContinue())
+            return false;
+    }
+    if (!haveCount || decoded < count) {
+        fprintf(stderr, "malformed object handle list from %s\n", mDeviceName.c_str());
+        readResponse();
+        return false;
+    }
+    return readResponse() == MTP_RESPONSE_OK;
+}
+
 MtpObjectInfo* AndroidMtpDevice::getObjectInfo(MtpObjectHandle handle) {
     std::lock_guard<std::mutex> lg(mMutex);
 
@@ -618,7 +754,7 @@ MtpObjectInfo* AndroidMtpDevice::getObjectInfo(MtpObjectHandle handle) {
     MtpResponseCode ret = readResponse();
     if (ret == MTP_RESPONSE_OK) {
         MtpObjectInfo* info = new MtpObjectInfo(handle);
-        if (info->read(mData))
+        if (info->read(mData, *mStrings))
             return info;
         else
             delete info;
@@ -626,6 +762,135 @@ MtpObjectInfo* AndroidMtpDevice::getObjectInfo(MtpObjectHandle handle) {
     return NULL;
 }
 
+MtpObjectInfoList* AndroidMtpDevice::getObjectPropList(MtpObjectHandle handle,
+            MtpObjectFormat format, uint32_t property, uint32_t depth) {
+    // decoding doesn't need the device, so the dataset is taken out of mData and the lock
+    // let go before any of it is looked at
+    MtpDataPacket dataset;
+    MtpStringPool* strings;
+    {
+        std::lock_guard<std::mutex> lg(mMutex);
+
+        mRequest.reset();
+        mRequest.setParameter(1, handle);
+        mRequest.setParameter(2, format);
+        mRequest.setParameter(3, property);
+        mRequest.setParameter(4, 0);    // group code, only used when |property| is 0
+        mRequest.setParameter(5, depth);
+        if (!sendRequest(MTP_OPERATION_GET_OBJECT_PROP_LIST))
+            return NULL;
+        if (!readData())
+            return NULL;
+        if (readResponse() != MTP_RESPONSE_OK)
+            return NULL;
+
+        dataset.setBufferPool(&mBufferPool);
+        dataset.swapBuffer(mData);
+        strings = mStrings;
+    }
+
+    MtpObjectInfoList* list = MtpObjectInfo::readPropertyList(dataset, *strings,
+                                                               std::thread::hardware_concurrency());
+    if (list == NULL)
+        fprintf(stderr, "malformed object property list from %s\n", mDeviceName.c_str());
+    return list;
+}
+
+bool AndroidMtpDevice::getObjectPropList(MtpObjectHandle handle, MtpObjectFormat format,
+            uint32_t property, uint32_t depth, ObjectInfoCallback callback, void* clientData) {
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    mRequest.reset();
+    mRequest.setParameter(1, handle);
+    mRequest.setParameter(2, format);
+    mRequest.setParameter(3, property);
+    mRequest.setParameter(4, 0);    // group code, only used when |property| is 0
+    mRequest.setParameter(5, depth);
+    if (!sendRequest(MTP_OPERATION_GET_OBJECT_PROP_LIST))
+        return false;
+    if (!readDataStart())
+        return false;
+
+    // handles already handed over. one coming back means the device interleaves objects;
+    // the rest of the data phase is still read, but nothing more is handed over.
+    std::unordered_set<MtpObjectHandle> passed;
+    bool interleaved = false;
+    // set once the callback has had enough; the rest of the transaction is cancelled
+    bool stopped = false;
+    MtpObjectInfo* info = NULL;
+    auto pass = [&](MtpObjectInfo* object) {
+        if (interleaved || stopped)
+            delete object;
+        else if (!callback(object, clientData))
+            stopped = true;
+    };
+
+    bool haveCount = false;
+    uint32_t count = 0, decoded = 0;
+    for (;;) {
+        if (!haveCount)
+            haveCount = mData.getUInt32(count);
+        while (haveCount && decoded < count) {
+            // a quadruple cut off by the end of the window is read again from here
+            const size_t start = mData.getOffset();
+            MtpObjectHandle objectHandle;
+            uint16_t code, type;
+            if (!mData.getUInt32(objectHandle) || !mData.getUInt16(code) ||
+                    !mData.getUInt16(type)) {
+                mData.setOffset(start);
+                break;
+            }
+            // readProperty() only stores a value once it has all of it
+            MtpObjectInfo* target = info;
+            if (target == NULL || target->mHandle != objectHandle)
+                target = new MtpObjectInfo(objectHandle);
+            if (!target->readProperty(code, type, mData, *mStrings)) {
+                if (target != info)
+                    delete target;
+                mData.setOffset(start);
+                break;
+            }
+            if (target != info) {
+                if (info != NULL)
+                    pass(info);
+                info = target;
+                if (!passed.insert(objectHandle).second)
+                    interleaved = true;
+            }
+            decoded++;
+            if (stopped)
+                break;
+        }
+        if (stopped) {
+            delete info;
+            recoverTransaction(LIBUSB_ERROR_INTERRUPTED);
+            return false;
+        }
+        if (mData.isReadComplete())
+            break;
+        if (!readDataContinue()) {
+            delete info;
+            return false;
+        }
+    }
+    if (info != NULL)
+        pass(info);
+    if (stopped) {
+        // the whole data phase is in, only the response is left
+        readResponse();
+        return false;
+    }
+
+    if (!haveCount || decoded < count) {
+        fprintf(stderr, "malformed object property list from %s\n", mDeviceName.c_str());
+        readResponse();
+        return false;
+    }
+    if (interleaved)
+        fprintf(stderr, "%s interleaves objects in its property lists\n", mDeviceName.c_str());
+    return readResponse() == MTP_RESPONSE_OK && !interleaved;
+}
+
 void* AndroidMtpDevice::getThumbnail(MtpObjectHandle handle, int& outLength) {
     std::lock_guard<std::mutex> lg(mMutex);
 
@@ -653,33 +918,7 @@ MtpObjectHandle AndroidMtpDevice::sendObjectInfo(MtpObjectInfo* info) {
     mRequest.setParameter(2, parent);
 
     mData.reset();
-    mData.putUInt32(info->mStorageID);
-    mData.putUInt16(info->mFormat);
-    mData.putUInt16(info->mProtectionStatus);
-    mData.putUInt32(info->mCompressedSize);
-    mData.putUInt16(info->mThumbFormat);
-    mData.putUInt32(info->mThumbCompressedSize);
-    mData.putUInt32(info->mThumbPixWidth);
-    mData.putUInt32(info->mThumbPixHeight);
-    mData.putUInt32(info->mImagePixWidth);
-    mData.putUInt32(info->mImagePixHeight);
-    mData.putUInt32(info->mImagePixDepth);
-    mData.putUInt32(info->mParent);
-    mData.putUInt16(info->mAssociationType);
-    mData.putUInt32(info->mAssociationDesc);
-    mData.putUInt32(info->mSequenceNumber);
-    mData.putString(info->mName);
-
-    char created[100], modified[100];
-    formatDateTime(info->mDateCreated, created, sizeof(created));
-    formatDateTime(info->mDateModified, modified, sizeof(modified));
-
-    mData.putString(created);
-    mData.putString(modified);
-    if (info->mKeywords)
-        mData.putString(info->mKeywords);
-    else
-        mData.putEmptyString();
+    info->write(mData);
 
    if (sendRequest(MTP_OPERATION_SEND_OBJECT_INFO) && sendData()) {
         MtpResponseCode ret = readResponse();
@@ -704,12 +943,29 @@ bool AndroidMtpDevice::sendObject(MtpObjectHandle handle, uint32_t size, int src
         return false;
     }
 
+    mPropertyCache.invalidate(handle);
     mRequest.reset();
     if (sendRequest(MTP_OPERATION_SEND_OBJECT)) {
         mData.setOperationCode(mRequest.getOperationCode());
         mData.setTransactionID(mRequest.getTransactionID());
-        const int64_t writeResult = mData.write(mRequestOut, mPacketDivisionMode, srcFD, size);
+        const auto start = std::chrono::steady_clock::now();
+        const int64_t writeResult = mWriteQueueDepth > 1 ?
+                mData.writeQueued(mRequestOut, mPacketDivisionMode, srcFD, size, mWriteQueueDepth) :
+                mData.write(mRequestOut, mPacketDivisionMode, srcFD, size);
+        if (writeResult < 0) {
+            // the response may never come, don't sit through its timeout
+            recoverTransaction(LIBUSB_ERROR_IO);
+            return false;
+        }
         const MtpResponseCode ret = readResponse();
+        if (writeResult > 0) {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            recordThroughput(size, elapsed);
+            mUploadStats.bytes += size;
+            mUploadStats.microseconds += elapsed;
+            mUploadStats.transfers++;
+        }
         return ret == MTP_RESPONSE_OK && writeResult > 0;
     }
     return false;
@@ -718,6 +974,7 @@ bool AndroidMtpDevice::sendObject(MtpObjectHandle handle, uint32_t size, int src
 bool AndroidMtpDevice::deleteObject(MtpObjectHandle handle) {
     std::lock_guard<std::mutex> lg(mMutex);
 
+    mPropertyCache.invalidate(handle);
     mRequest.reset();
     mRequest.setParameter(1, handle);
     if (sendRequest(MTP_OPERATION_DELETE_OBJECT)) {
@@ -728,6 +985,39 @@ bool AndroidMtpDevice::deleteObject(MtpObjectHandle handle) {
     return false;
 }
 
+bool AndroidMtpDevice::moveObject(MtpObjectHandle handle, MtpStorageID storageID,
+                                  MtpObjectHandle parent) {
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    mPropertyCache.invalidate(handle);
+    mRequest.reset();
+    mRequest.setParameter(1, handle);
+    mRequest.setParameter(2, storageID);
+    mRequest.setParameter(3, parent);
+    if (sendRequest(MTP_OPERATION_MOVE_OBJECT)) {
+        MtpResponseCode ret = readResponse();
+        if (ret == MTP_RESPONSE_OK)
+            return true;
+    }
+    return false;
+}
+
+MtpObjectHandle AndroidMtpDevice::copyObject(MtpObjectHandle handle, MtpStorageID storageID,
+                                             MtpObjectHandle parent) {
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    mRequest.reset();
+    mRequest.setParameter(1, handle);
+    mRequest.setParameter(2, storageID);
+    mRequest.setParameter(3, parent);
+    if (sendRequest(MTP_OPERATION_COPY_OBJECT)) {
+        MtpResponseCode ret = readResponse();
+        if (ret == MTP_RESPONSE_OK)
+            return mResponse.getParameter(1);
+    }
+    return 0;
+}
+
 MtpObjectHandle AndroidMtpDevice::getParent(MtpObjectHandle handle) {
     MtpObjectInfo* info = getObjectInfo(handle);
     if (info) {
@@ -840,6 +1130,7 @@ bool AndroidMtpDevice::setObjectPropValue(MtpObjectHandle handle, MtpProperty* p
 
     std::lock_guard<std::mutex> lg(mMutex);
 
+    mPropertyCache.invalidate(handle);
     mRequest.reset();
     mRequest.setParameter(1, handle);
     mRequest.setParameter(2, property->getPropertyCode());
@@ -877,6 +1168,83 @@ bool AndroidMtpDevice::getObjectPropValue(MtpObjectHandle handle, MtpProperty* p
     return true;
 }
 
+bool AndroidMtpDevice::getObjectPropValue(MtpObjectHandle handle, MtpObjectProperty property,
+                                          MtpPropertyCache::Value& value) {
+    if (mPropertyCache.lookup(handle, property, value))
+        return true;
+    return getObjectPropValues(&handle, 1, property) &&
+            mPropertyCache.lookup(handle, property, value);
+}
+
+bool AndroidMtpDevice::getObjectPropValues(const MtpObjectHandle* handles, size_t count,
+                                           MtpObjectProperty property) {
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    const bool propList = mCapabilities.hasOperation(MTP_OPERATION_GET_OBJECT_PROP_LIST);
+    // GetObjectPropValue sends the bare value, so its type has to be known up front
+    const MtpDataType type = MtpPropertyCache::standardType(property);
+    if (!propList && type == MTP_TYPE_UNDEFINED) {
+        fprintf(stderr, "no type known for property %04X\n", property);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < count; i++) {
+        MtpPropertyCache::Value value;
+        if (mPropertyCache.lookup(handles[i], property, value))
+            continue;
+
+        mRequest.reset();
+        mRequest.setParameter(1, handles[i]);
+        if (propList) {
+            // the rest of the object's properties come along for free
+            mRequest.setParameter(2, 0);
+            mRequest.setParameter(3, 0xFFFFFFFF);
+            mRequest.setParameter(4, 0);
+            mRequest.setParameter(5, 0);
+            if (!sendRequest(MTP_OPERATION_GET_OBJECT_PROP_LIST) || !readData() ||
+                    readResponse() != MTP_RESPONSE_OK ||
+                    !mPropertyCache.readPropertyList(mData, *mStrings))
+                ok = false;
+        } else {
+            mRequest.setParameter(2, property);
+            if (!sendRequest(MTP_OPERATION_GET_OBJECT_PROP_VALUE) || !readData() ||
+                    readResponse() != MTP_RESPONSE_OK ||
+                    !mPropertyCache.read(handles[i], property, type, mData, *mStrings))
+                ok = false;
+        }
+    }
+    return ok;
+}
+
+bool AndroidMtpDevice::getChildPropValues(MtpObjectHandle parent, const MtpObjectHandle* handles,
+                                          size_t count, MtpObjectProperty property) {
+    {
+        std::lock_guard<std::mutex> lg(mMutex);
+
+        size_t missing = 0;
+        for (size_t i = 0; i < count; i++) {
+            MtpPropertyCache::Value value;
+            if (!mPropertyCache.lookup(handles[i], property, value))
+                missing++;
+        }
+        if (missing > 1 && mCapabilities.hasOperation(MTP_OPERATION_GET_OBJECT_PROP_LIST)) {
+            mRequest.reset();
+            mRequest.setParameter(1, parent);
+            mRequest.setParameter(2, 0);
+            mRequest.setParameter(3, property);
+            mRequest.setParameter(4, 0);
+            mRequest.setParameter(5, 1);
+            if (!sendRequest(MTP_OPERATION_GET_OBJECT_PROP_LIST) || !readData() ||
+                    readResponse() != MTP_RESPONSE_OK ||
+                    !mPropertyCache.readPropertyList(mData, *mStrings))
+                fprintf(stderr, "no %04X for the children of %08X in one go\n", property, parent);
+        }
+    }
+    // only what the listing didn't bring is left
+    return getObjectPropValues(handles, count, property);
+}
+
 bool AndroidMtpDevice::readObject(MtpObjectHandle handle,
                            ReadObjectCallback callback,
                            uint32_t expectedLength,
@@ -929,8 +1297,10 @@ bool AndroidMtpDevice::readData(ReadObjectCallback callback,
                             const uint32_t* expectedLength,
                             uint32_t* writtenSize,
                             void* clientData) {
-    if (!mData.readDataHeader(mRequestIn1)) {
+    const int headerLength = mData.readDataHeader(mRequestIn1);
+    if (headerLength <= 0) {
         fprintf(stderr, "Failed to read header.\n");;
+        recoverTransaction(headerLength < 0 ? headerLength : LIBUSB_ERROR_IO);
         return false;
     }
 
@@ -978,7 +1348,102 @@ bool AndroidMtpDevice::readData(ReadObjectCallback callback,
         }
     }
 
-    // USB reads greater than 16K don't work.
+    const bool ok = mReadQueueDepth > 0 ?
+            readDataQueued(callback, offset, length, writingError, clientData, nullptr) :
+            readDataDoubleBuffered(callback, offset, length, writingError, clientData);
+    if (!ok) {
+        recoverTransaction(LIBUSB_ERROR_IO);
+        return false;
+    }
+
+    if (writtenSize) {
+        *writtenSize = length;
+    }
+
+    return readResponse() == MTP_RESPONSE_OK;
+}
+
+struct libusb_transfer_queue* AndroidMtpDevice::readQueue() {
+    if (!mReadQueue) {
+        mReadQueue = libusb_transfer_queue_new(mRequestIn1, std::max(mReadQueueDepth, 1),
+                                               (int)mReadTransferSize);
+        if (!mReadQueue)
+            fprintf(stderr, "Failed to allocate the bulk-IN queue.\n");
+    }
+    return mReadQueue;
+}
+
+bool AndroidMtpDevice::readDataQueued(ReadObjectCallback callback,
+                                      uint32_t offset,
+                                      uint32_t length,
+                                      bool writingError,
+                                      void* clientData,
+                                      uint8_t* destination) {
+    struct libusb_transfer_queue* queue = readQueue();
+    if (!queue)
+        return false;
+
+    bool result = true;
+    const uint32_t startOffset = offset;
+    const auto start = std::chrono::steady_clock::now();
+    uint32_t requested = offset;
+    while (offset < length) {
+        // Keep the queue full so the device always has somewhere to put the next packet.
+        while (requested < length &&
+               libusb_transfer_queue_pending(queue) < libusb_transfer_queue_depth(queue)) {
+            const uint32_t chunk = std::min(length - requested, mReadTransferSize);
+            const int ret = libusb_transfer_queue_submit(queue,
+                    destination ? destination + requested : nullptr, (int)chunk);
+            if (ret != LIBUSB_SUCCESS) {
+                fprintf(stderr, "libusb_transfer_queue_submit failed: %s\n", libusb_strerror(ret));
+                result = false;
+                break;
+            }
+            requested += chunk;
+        }
+        if (!result)
+            break;
+
+        // Transfers complete in order, so the oldest one always holds the data at |offset|.
+        u_char* data = nullptr;
+        const uint32_t expected = std::min(length - offset, mReadTransferSize);
+        const int read = libusb_transfer_queue_reap(queue, &data);
+        if (read < 0) {
+            fprintf(stderr, "bulk-IN transfer failed: %s\n", libusb_strerror(read));
+            result = false;
+            break;
+        }
+        if ((uint32_t)read != expected) {
+            // a short packet ended the data phase early; anything still queued would
+            // swallow the response.
+            fprintf(stderr, "short bulk-IN transfer: %d of %u bytes\n", read, expected);
+            result = false;
+            break;
+        }
+
+        if (!destination && !writingError && !callback(data, offset, read, clientData)) {
+            fprintf(stderr, "write failed\n");
+            writingError = true;
+        }
+        offset += read;
+    }
+
+    if (!result)
+        libusb_transfer_queue_cancel(queue);
+    else
+        recordThroughput(length - startOffset, std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    return result;
+}
+
+bool AndroidMtpDevice::readDataDoubleBuffered(ReadObjectCallback callback,
+                                              uint32_t offset,
+                                              uint32_t length,
+                                              bool writingError,
+                                              void* clientData) {
+    // The old usbfs limit of 16K per read, kept for devices that misbehave with larger transfers.
+    // The transfers point into this frame, so every way out has to cancel them first;
+    // libusb_request_cancel() waits for them to land.
     char buffer1[MTP_BUFFER_SIZE], buffer2[MTP_BUFFER_SIZE];
     mRequestIn1->buffer = (u_char*) buffer1;
     mRequestIn2->buffer = (u_char*) buffer2;
@@ -992,6 +1457,8 @@ bool AndroidMtpDevice::readData(ReadObjectCallback callback,
             const int read = mData.readDataWait(req);
             if (read < 0) {
                 fprintf(stderr, "readDataWait failed.\n");;
+                libusb_request_cancel(mRequestIn1);
+                libusb_request_cancel(mRequestIn2);
                 return false;
             }
             writeBuffer = req->buffer;
@@ -1008,6 +1475,8 @@ bool AndroidMtpDevice::readData(ReadObjectCallback callback,
                     static_cast<size_t>(MTP_BUFFER_SIZE) : (int)remaining;
             if (mData.readDataAsync(req) != 0) {
                 fprintf(stderr, "readDataAsync failed\n");;
+                libusb_request_cancel(mRequestIn1);
+                libusb_request_cancel(mRequestIn2);
                 return false;
             }
         }
@@ -1021,11 +1490,65 @@ bool AndroidMtpDevice::readData(ReadObjectCallback callback,
         }
         offset = nextOffset;
     }
+    return true;
+}
 
-    if (writtenSize) {
-        *writtenSize = length;
+bool AndroidMtpDevice::readDataInto(void* buffer, uint32_t bufferSize, uint32_t* writtenSize) {
+    const int headerLength = mData.readDataHeader(mRequestIn1);
+    if (headerLength <= 0) {
+        fprintf(stderr, "Failed to read header.\n");
+        recoverTransaction(headerLength < 0 ? headerLength : LIBUSB_ERROR_IO);
+        return false;
     }
 
+    if (mData.getContainerType() == MTP_CONTAINER_TYPE_RESPONSE) {
+        mResponse.copyFrom(mData);
+        if (writtenSize)
+            *writtenSize = 0;
+        return mResponse.getResponseCode() == MTP_RESPONSE_OK;
+    }
+
+    const uint32_t fullLength = mData.getContainerLength();
+    if (fullLength < MTP_CONTAINER_HEADER_SIZE) {
+        fprintf(stderr, "fullLength is too short: %d\n", fullLength);
+        return false;
+    }
+    const uint32_t length = fullLength - MTP_CONTAINER_HEADER_SIZE;
+    if (length > bufferSize) {
+        // the rest of the data phase is still on the wire, so drain it before giving up.
+        fprintf(stderr, "device returned %u bytes for a %u byte buffer\n", length, bufferSize);
+        readDataDrain(length);
+        return false;
+    }
+
+    // The first packet carries the header, so whatever payload came with it is the only part
+    // that has to be copied. Everything after it lands in |buffer| directly.
+    const uint32_t initialDataLength = (uint32_t)(mData.getPacketSize() - MTP_CONTAINER_HEADER_SIZE);
+    if (length > 0 && initialDataLength == 0)
+        mPacketDivisionMode = FIRST_PACKET_ONLY_HEADER;
+    memcpy(buffer, mData.getData(), std::min(initialDataLength, length));
+
+    if (!readDataQueued(nullptr, initialDataLength, length, false, nullptr,
+                        static_cast<uint8_t*>(buffer))) {
+        recoverTransaction(LIBUSB_ERROR_IO);
+        return false;
+    }
+
+    if (writtenSize)
+        *writtenSize = length;
+    return readResponse() == MTP_RESPONSE_OK;
+}
+
+bool AndroidMtpDevice::readDataDrain(uint32_t length) {
+    uint32_t offset = (uint32_t)(mData.getPacketSize() - MTP_CONTAINER_HEADER_SIZE);
+    while (offset < length) {
+        const int read = mData.readDataHeader(mRequestIn1);
+        if (read <= 0) {
+            recoverTransaction(read < 0 ? read : LIBUSB_ERROR_IO);
+            return false;
+        }
+        offset += read;
+    }
     return readResponse() == MTP_RESPONSE_OK;
 }
 
@@ -1074,6 +1597,43 @@ bool AndroidMtpDevice::readPartialObject64(MtpObjectHandle handle,
     return readData(callback, nullptr /* expected size */, writtenSize, clientData);
 }
 
+bool AndroidMtpDevice::readPartialObject(MtpObjectHandle handle,
+                                         uint32_t offset,
+                                         uint32_t size,
+                                         uint32_t *writtenSize,
+                                         void* buffer) {
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    mRequest.reset();
+    mRequest.setParameter(1, handle);
+    mRequest.setParameter(2, offset);
+    mRequest.setParameter(3, size);
+    if (!sendRequest(MTP_OPERATION_GET_PARTIAL_OBJECT)) {
+        fprintf(stderr, "Failed to send a read request.\n");
+        return false;
+    }
+    return readDataInto(buffer, size, writtenSize);
+}
+
+bool AndroidMtpDevice::readPartialObject64(MtpObjectHandle handle,
+                                           uint64_t offset,
+                                           uint32_t size,
+                                           uint32_t *writtenSize,
+                                           void* buffer) {
+    std::lock_guard<std::mutex> lg(mMutex);
+
+    mRequest.reset();
+    mRequest.setParameter(1, handle);
+    mRequest.setParameter(2, 0xffffffff & offset);
+    mRequest.setParameter(3, 0xffffffff & (offset >> 32));
+    mRequest.setParameter(4, size);
+    if (!sendRequest(MTP_OPERATION_GET_PARTIAL_OBJECT_64)) {
+        fprintf(stderr, "Failed to send a read request.\n");
+        return false;
+    }
+    return readDataInto(buffer, size, writtenSize);
+}
+
 bool AndroidMtpDevice::sendRequest(MtpOperationCode operation) {
     fprintf(stdout, "sendRequest: %s\n", MtpDebug::getOperationCodeName(operation));
     mReceivedResponse = false;
@@ -1082,6 +1642,8 @@ bool AndroidMtpDevice::sendRequest(MtpOperationCode operation) {
         mRequest.setTransactionID(mTransactionID++);
     int ret = mRequest.write(mRequestOut);
     mRequest.dump();
+    if (ret < 0)
+        recoverTransaction(ret);
     return (ret > 0);
 }
 
@@ -1091,14 +1653,28 @@ bool AndroidMtpDevice::sendData() {
     mData.setTransactionID(mRequest.getTransactionID());
     int ret = mData.write(mRequestOut, mPacketDivisionMode);
     mData.dump();
+    if (ret < 0)
+        recoverTransaction(LIBUSB_ERROR_IO);
     return (ret >= 0);
 }
 
 bool AndroidMtpDevice::readData() {
-    mData.reset();
-    int ret = mData.read(mRequestIn1);
-    fprintf(stdout, "readData returned %d\n", ret);
-    if (ret >= MTP_CONTAINER_HEADER_SIZE) {
+    for (int stale = 0; ; stale++) {
+        mData.reset();
+        const auto start = std::chrono::steady_clock::now();
+        int ret = mData.read(mRequestIn1);
+        fprintf(stdout, "readData returned %d\n", ret);
+        if (ret < MTP_CONTAINER_HEADER_SIZE) {
+            fprintf(stdout, "readResponse failed\n");
+            recoverTransaction(ret < 0 ? ret : LIBUSB_ERROR_IO);
+            return false;
+        }
+        if (isStale(mData.getTransactionID(), mRequest.getTransactionID()) &&
+                stale < kMaxStaleResponses) {
+            fprintf(stderr, "dropping container for transaction %u while in %u\n",
+                    mData.getTransactionID(), mRequest.getTransactionID());
+            continue;
+        }
         if (mData.getContainerType() == MTP_CONTAINER_TYPE_RESPONSE) {
             fprintf(stdout, "got response packet instead of data packet\n");
             // we got a response packet rather than data
@@ -1107,13 +1683,62 @@ bool AndroidMtpDevice::readData() {
             mReceivedResponse = true;
             return false;
         }
+        recordThroughput(ret, std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
         mData.dump();
         return true;
     }
-    else {
-        fprintf(stdout, "readResponse failed\n");
+}
+
+bool AndroidMtpDevice::readDataStart() {
+    for (int stale = 0; ; stale++) {
+        mData.reset();
+        mDataStart = std::chrono::steady_clock::now();
+        int ret = mData.readStart(mRequestIn1);
+        if (ret < MTP_CONTAINER_HEADER_SIZE) {
+            recoverTransaction(ret < 0 ? ret : LIBUSB_ERROR_IO);
+            return false;
+        }
+        if (isStale(mData.getTransactionID(), mRequest.getTransactionID()) &&
+                stale < kMaxStaleResponses) {
+            fprintf(stderr, "dropping container for transaction %u while in %u\n",
+                    mData.getTransactionID(), mRequest.getTransactionID());
+            // only its first transfer is in
+            while (!mData.isReadComplete()) {
+                mData.setOffset(mData.getPacketSize());
+                ret = mData.readContinue(mRequestIn1);
+                if (ret < 0) {
+                    recoverTransaction(ret);
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (mData.getContainerType() == MTP_CONTAINER_TYPE_RESPONSE) {
+            // the device turned the operation down without a data phase
+            mResponse.copyFrom(mData);
+            mReceivedResponse = true;
+            return false;
+        }
+        mDataBytes = ret;
+        if (mData.isReadComplete())
+            recordThroughput(mDataBytes, std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - mDataStart).count());
+        return true;
+    }
+}
+
+bool AndroidMtpDevice::readDataContinue() {
+    int ret = mData.readContinue(mRequestIn1);
+    if (ret < 0) {
+        recoverTransaction(ret);
         return false;
     }
+    mDataBytes += ret;
+    if (mData.isReadComplete())
+        recordThroughput(mDataBytes, std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - mDataStart).count());
+    return true;
 }
 
 MtpResponseCode AndroidMtpDevice::readResponse() {
@@ -1122,20 +1747,102 @@ MtpResponseCode AndroidMtpDevice::readResponse() {
         mReceivedResponse = false;
         return mResponse.getResponseCode();
     }
-    int ret = mResponse.read(mRequestIn1);
-    // handle zero length packets, which might occur if the data transfer
-    // ends on a packet boundary
-    if (ret == 0)
-        ret = mResponse.read(mRequestIn1);
-    if (ret >= MTP_CONTAINER_HEADER_SIZE) {
+    for (int stale = 0; ; stale++) {
+        int ret = mResponse.read(mRequestIn1);
+        // handle zero length packets, which might occur if the data transfer
+        // ends on a packet boundary
+        if (ret == 0)
+            ret = mResponse.read(mRequestIn1);
+        if (ret < MTP_CONTAINER_HEADER_SIZE) {
+            fprintf(stdout, "readResponse failed\n");
+            recoverTransaction(ret < 0 ? ret : LIBUSB_ERROR_IO);
+            return -1;
+        }
+        // a cancelled transaction may have left its response behind
+        if (isStale(mResponse.getTransactionID(), mRequest.getTransactionID()) &&
+                stale < kMaxStaleResponses) {
+            fprintf(stderr, "dropping response for transaction %u while in %u\n",
+                    mResponse.getTransactionID(), mRequest.getTransactionID());
+            continue;
+        }
         mResponse.dump();
         return mResponse.getResponseCode();
-    } else {
-        fprintf(stdout, "readResponse failed\n");
-        return -1;
     }
 }
 
+unsigned int AndroidMtpDevice::streamTimeout(uint32_t bytes) const {
+    const double expectedMs = bytes * 1000.0 / mThroughput;
+    return kStreamTimeoutBaseMs + (unsigned int)std::min<double>(2 * expectedMs, UINT_MAX / 2);
+}
+
+void AndroidMtpDevice::recordThroughput(uint64_t bytes, uint64_t microseconds) {
+    if (bytes >= kMinThroughputSample && microseconds > 0)
+        mThroughput = mThroughput * 0.75 + (bytes * 1000000.0 / microseconds) * 0.25;
+    // never longer than the request's own timeout
+    for (struct libusb_request* request : { mRequestIn1, mRequestIn2, mRequestOut }) {
+        request->stream_timeout = std::min(streamTimeout(request->max_transfer_size),
+                                           request->timeout);
+    }
+}
+
+void AndroidMtpDevice::recoverTransaction(int error) {
+    // nothing left to talk to
+    if (error == LIBUSB_ERROR_NO_DEVICE)
+        return;
+
+    const MtpTransactionID transactionID = mRequest.getTransactionID();
+    const auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(kRecoveryTimeoutMs);
+    fprintf(stderr, "transaction %u failed (%s), cancelling it\n", transactionID,
+            libusb_strerror(error));
+
+    // class-specific Cancel: the cancellation code (0x4001) and the transaction, little endian
+    uint8_t cancel[6] = { 0x01, 0x40,
+                          (uint8_t)transactionID, (uint8_t)(transactionID >> 8),
+                          (uint8_t)(transactionID >> 16), (uint8_t)(transactionID >> 24) };
+    int ret = libusb_control_transfer(mDeviceHandle,
+                                      LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
+                                      LIBUSB_RECIPIENT_INTERFACE,
+                                      MTP_REQ_CANCEL, 0, (uint16_t)mInterface,
+                                      cancel, sizeof(cancel), USB_CONTROL_TRANSFER_TIMEOUT_MS);
+    if (ret < 0)
+        fprintf(stderr, "MTP cancel request failed: %s\n", libusb_strerror(ret));
+
+    // Get Device Status answers DEVICE_BUSY until the device has let go of the transaction
+    while (std::chrono::steady_clock::now() < deadline) {
+        uint8_t status[32];
+        ret = libusb_control_transfer(mDeviceHandle,
+                                      LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
+                                      LIBUSB_RECIPIENT_INTERFACE,
+                                      MTP_REQ_GET_DEVICE_STATUS, 0, (uint16_t)mInterface,
+                                      status, sizeof(status), USB_CONTROL_TRANSFER_TIMEOUT_MS);
+        if (ret < 4)
+            break;
+        if ((status[2] | status[3] << 8) != MTP_RESPONSE_DEVICE_BUSY)
+            break;
+        usleep(10 * 1000);
+    }
+
+    // only clears the endpoints that report a halt
+    libusb_clear_stall(mRequestIn1, mRequestOut, mRequestIntr);
+
+    // whatever the device had queued for the cancelled transaction goes, so the next
+    // transaction starts on an empty pipe
+    std::vector<u_char> junk(std::max(mRequestIn1->max_transfer_size, MTP_BUFFER_SIZE));
+    int drained = 0;
+    while (std::chrono::steady_clock::now() < deadline) {
+        int length = 0;
+        ret = libusb_bulk_transfer(mDeviceHandle, mRequestIn1->endpoint, junk.data(),
+                                   (int)junk.size(), &length, kDrainTimeoutMs);
+        drained += length;
+        if (ret != LIBUSB_SUCCESS)
+            break;
+    }
+    if (drained > 0)
+        fprintf(stderr, "dropped %d bytes left over from transaction %u\n", drained, transactionID);
+    mReceivedResponse = false;
+}
+
 int AndroidMtpDevice::submitEventRequest() {
     if (!mEventMutex.try_lock()) {
         // An event is being reaped on another thread.
@@ -1160,12 +1867,17 @@ int AndroidMtpDevice::reapEventRequest(int handle, uint32_t (*parameters)[3]) {
     }
     mProcessingEvent = false;
     const int readSize = mEventPacket.readResponse(mRequestIntr);
+    if (readSize == LIBUSB_ERROR_INTERRUPTED)
+        return 0;   // discarded
+    if (readSize < MTP_CONTAINER_HEADER_SIZE ||
+        mEventPacket.getContainerType() != MTP_CONTAINER_TYPE_EVENT)
+        return -1;
     const int result = mEventPacket.getEventCode();
     // MTP event has three parameters.
     (*parameters)[0] = mEventPacket.getParameter(1);
     (*parameters)[1] = mEventPacket.getParameter(2);
     (*parameters)[2] = mEventPacket.getParameter(3);
-    return readSize != 0 ? result : 0;
+    return result;
 }
 
 void AndroidMtpDevice::discardEventRequest(int handle) {
@@ -1173,6 +1885,56 @@ void AndroidMtpDevice::discardEventRequest(int handle) {
     if (mCurrentEventHandle != handle) {
         return;
     }
+    libusb_request_abort(mRequestIntr);
+}
+
+bool AndroidMtpDevice::startEventListener(EventCallback callback, void* clientData) {
+    if (mEventListener.joinable())
+        return false;
+
+    mEventListenerStop = false;
+    mEventListener = std::thread([this, callback, clientData] {
+        while (!mEventListenerStop) {
+            const int handle = submitEventRequest();
+            if (handle < 0) {
+                // somebody else is reaping events right now
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            mEventListenerHandle = handle;
+            // a stop request may have come in before the handle was published
+            if (mEventListenerStop)
+                discardEventRequest(handle);
+
+            uint32_t parameters[3];
+            const int code = reapEventRequest(handle, &parameters);
+            mEventListenerHandle = -1;
+            if (code > 0) {
+                switch (code) {
+                    case MTP_EVENT_OBJECT_REMOVED:
+                    case MTP_EVENT_OBJECT_INFO_CHANGED:
+                    case MTP_EVENT_OBJECT_PROP_CHANGED:
+                        mPropertyCache.invalidate(parameters[0]);
+                        break;
+                }
+                callback(code, parameters, clientData);
+            } else if (code < 0 && !mEventListenerStop) {
+                // don't spin if the endpoint is gone
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            }
+        }
+    });
+    return true;
+}
+
+void AndroidMtpDevice::stopEventListener() {
+    if (!mEventListener.joinable())
+        return;
+    mEventListenerStop = true;
+    const int handle = mEventListenerHandle;
+    if (handle >= 0)
+        discardEventRequest(handle);
+    mEventListener.join();
 }
 
 }  // namespace android
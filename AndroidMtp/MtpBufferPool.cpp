@@ -0,0 +1,178 @@
+//
+//  MtpBufferPool.cpp
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#define LOG_TAG "MtpBufferPool"
+
+#include "MtpBufferPool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libusb/libusb.h>
+
+namespace android {
+
+MtpBufferPool::MtpBufferPool(size_t cacheLimit)
+    :   mDeviceHandle(NULL),
+        mDeviceBuffers(0),
+        mClosing(false),
+        mCacheLimit(cacheLimit),
+        mCachedBytes(0)
+{
+}
+
+MtpBufferPool::~MtpBufferPool() {
+    purge();
+    // device memory still out can't come back to a pool that's gone
+    if (mDeviceHandle)
+        libusb_close(mDeviceHandle);
+}
+
+void MtpBufferPool::setDevice(libusb_device_handle* handle) {
+    purge();
+    std::lock_guard<std::mutex> lg(mMutex);
+    mDeviceHandle = handle;
+    mClosing = false;
+}
+
+void MtpBufferPool::closeDevice() {
+    {
+        std::lock_guard<std::mutex> lg(mMutex);
+        if (mDeviceHandle == NULL)
+            return;
+        mClosing = true;
+    }
+    // closes the handle too unless packets still hold device memory
+    purge();
+}
+
+size_t MtpBufferPool::sizeClass(size_t length) {
+    size_t capacity = (size_t)1 << kMinClassShift;
+    while (capacity < length && capacity < ((size_t)1 << kMaxClassShift))
+        capacity <<= 1;
+    // past the largest class, buffers are sized exactly
+    return capacity < length ? length : capacity;
+}
+
+size_t MtpBufferPool::classIndex(size_t capacity) {
+    size_t index = 0;
+    while (((size_t)1 << (kMinClassShift + index)) < capacity)
+        index++;
+    return index;
+}
+
+uint8_t* MtpBufferPool::acquire(size_t length, size_t& capacity, bool& deviceMemory) {
+    capacity = sizeClass(length);
+
+    std::unique_lock<std::mutex> lg(mMutex);
+    if (capacity <= ((size_t)1 << kMaxClassShift)) {
+        const size_t index = classIndex(capacity);
+        if (!mFree[index].empty()) {
+            Entry entry = mFree[index].back();
+            mFree[index].pop_back();
+            mCachedBytes -= capacity;
+            deviceMemory = entry.deviceMemory;
+            return entry.buffer;
+        }
+    }
+    libusb_device_handle* handle = mClosing ? NULL : mDeviceHandle;
+    // counted before it exists, so the handle can't be closed under the allocation
+    if (handle && capacity <= kMaxDeviceBuffer)
+        mDeviceBuffers++;
+    else
+        handle = NULL;
+    lg.unlock();
+
+    uint8_t* buffer = NULL;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    // returns NULL where the backend can't map device memory, malloc() covers that
+    if (handle)
+        buffer = libusb_dev_mem_alloc(handle, capacity);
+#endif
+    deviceMemory = buffer != NULL;
+    if (handle && !deviceMemory)
+        deviceBuffersFreed(1);
+    if (!buffer)
+        buffer = (uint8_t *)malloc(capacity);
+    if (!buffer) {
+        fprintf(stderr, "out of memory!\n");
+        abort();
+    }
+    return buffer;
+}
+
+void MtpBufferPool::release(uint8_t* buffer, size_t capacity, bool deviceMemory) {
+    if (!buffer)
+        return;
+
+    std::unique_lock<std::mutex> lg(mMutex);
+    const bool cacheable = capacity == sizeClass(capacity) &&
+            capacity <= ((size_t)1 << kMaxClassShift) &&
+            mCachedBytes + capacity <= mCacheLimit &&
+            // device memory of a handle that's being closed can't be handed out again
+            (!deviceMemory || !mClosing);
+    if (cacheable) {
+        mFree[classIndex(capacity)].push_back({ buffer, deviceMemory });
+        mCachedBytes += capacity;
+        return;
+    }
+    libusb_device_handle* handle = mDeviceHandle;
+    lg.unlock();
+    freeBuffer(handle, buffer, capacity, deviceMemory);
+    if (deviceMemory)
+        deviceBuffersFreed(1);
+}
+
+void MtpBufferPool::purge() {
+    std::vector<std::pair<Entry, size_t>> entries;
+    libusb_device_handle* handle;
+    size_t deviceBuffers = 0;
+    {
+        std::lock_guard<std::mutex> lg(mMutex);
+        for (size_t i = 0; i <= kMaxClassShift - kMinClassShift; i++) {
+            for (const Entry& entry : mFree[i])
+                entries.push_back({ entry, (size_t)1 << (kMinClassShift + i) });
+            mFree[i].clear();
+        }
+        mCachedBytes = 0;
+        handle = mDeviceHandle;
+    }
+    for (const auto& entry : entries) {
+        freeBuffer(handle, entry.first.buffer, entry.second, entry.first.deviceMemory);
+        if (entry.first.deviceMemory)
+            deviceBuffers++;
+    }
+    deviceBuffersFreed(deviceBuffers);
+}
+
+void MtpBufferPool::deviceBuffersFreed(size_t count) {
+    libusb_device_handle* handle = NULL;
+    {
+        std::lock_guard<std::mutex> lg(mMutex);
+        mDeviceBuffers -= count;
+        if (mClosing && mDeviceBuffers == 0) {
+            handle = mDeviceHandle;
+            mDeviceHandle = NULL;
+            mClosing = false;
+        }
+    }
+    if (handle)
+        libusb_close(handle);
+}
+
+void MtpBufferPool::freeBuffer(libusb_device_handle* handle, uint8_t* buffer, size_t capacity,
+                               bool deviceMemory) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if (deviceMemory) {
+        libusb_dev_mem_free(handle, buffer, capacity);
+        return;
+    }
+#endif
+    free(buffer);
+}
+
+}  // namespace android
@@ -0,0 +1,79 @@
+//
+//  MtpBufferPool.h
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#ifndef _MTP_BUFFER_POOL_H
+#define _MTP_BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+struct libusb_device_handle;
+
+namespace android {
+
+// Packet buffers in power-of-two size classes. Released buffers are kept for reuse until the
+// pool holds |cacheLimit| bytes; anything past that goes back to the system, so one huge data
+// phase doesn't stay pinned. With a device handle set, buffers up to kMaxDeviceBuffer come
+// from libusb_dev_mem_alloc() where the platform has it, so usbfs can DMA straight into them.
+// The handle then belongs to the pool, which closes it once the last of them is back.
+class MtpBufferPool {
+public:
+    static constexpr size_t kMinClassShift = 9;         // 512 bytes
+    static constexpr size_t kMaxClassShift = 26;        // 64MB, larger buffers aren't cached
+    static constexpr size_t kMaxDeviceBuffer = 1024 * 1024;
+    static constexpr size_t kDefaultCacheLimit = 4 * 1024 * 1024;
+
+private:
+    struct Entry {
+        uint8_t*            buffer;
+        bool                deviceMemory;
+    };
+
+    std::mutex              mMutex;
+    libusb_device_handle*   mDeviceHandle;
+    // device memory that hasn't gone back to libusb, handed out or cached
+    size_t                  mDeviceBuffers;
+    // closeDevice() was called, mDeviceHandle goes with the last device buffer
+    bool                    mClosing;
+    size_t                  mCacheLimit;
+    size_t                  mCachedBytes;
+    std::vector<Entry>      mFree[kMaxClassShift - kMinClassShift + 1];
+
+public:
+    explicit                MtpBufferPool(size_t cacheLimit = kDefaultCacheLimit);
+    virtual                 ~MtpBufferPool();
+
+    // Device to allocate DMA-able memory for, which the pool owns from then on.
+    void                    setDevice(libusb_device_handle* handle);
+    // Stops handing out device memory and libusb_close()s the device handle, right away or,
+    // while packets still hold device memory, as soon as the last of it is released.
+    void                    closeDevice();
+
+    // Returns a buffer of at least |length| bytes. Its real size is returned in |capacity|,
+    // and |deviceMemory| says how it has to be given back. Contents are undefined.
+    uint8_t*                acquire(size_t length, size_t& capacity, bool& deviceMemory);
+    void                    release(uint8_t* buffer, size_t capacity, bool deviceMemory);
+
+    // Frees every cached buffer.
+    void                    purge();
+
+    static size_t           sizeClass(size_t length);
+
+private:
+    static size_t           classIndex(size_t capacity);
+    // |count| device buffers went back to libusb; closes the handle after the last one
+    void                    deviceBuffersFreed(size_t count);
+    static void             freeBuffer(libusb_device_handle* handle, uint8_t* buffer,
+                                       size_t capacity, bool deviceMemory);
+};
+
+}; // namespace android
+
+#endif // _MTP_BUFFER_POOL_H
@@ -0,0 +1,55 @@
+//
+//  MtpCapabilities.cpp
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#define LOG_TAG "MtpCapabilities"
+
+#include "MtpCapabilities.h"
+#include "MtpDeviceInfo.h"
+
+namespace android {
+
+static void fillCodeSet(MtpCapabilities::CodeSet& set, const UInt16List* codes) {
+    set.reset();
+    if (codes == NULL)
+        return;
+    for (uint16_t code : *codes)
+        set.set(code);
+}
+
+void MtpCapabilities::setDeviceInfo(const MtpDeviceInfo& info) {
+    fillCodeSet(mOperations, info.mOperations);
+    fillCodeSet(mEvents, info.mEvents);
+    fillCodeSet(mDeviceProperties, info.mDeviceProperties);
+    fillCodeSet(mCaptureFormats, info.mCaptureFormats);
+    fillCodeSet(mPlaybackFormats, info.mPlaybackFormats);
+}
+
+void MtpCapabilities::setObjectProperties(MtpObjectFormat format,
+                                          const MtpObjectPropertyList& properties) {
+    ObjectPropertySet& set = mObjectProperties[format];
+    set.reset();
+    for (MtpObjectProperty property : properties) {
+        if (property >= kObjectPropertyBase && property < kObjectPropertyBase + set.size())
+            set.set(property - kObjectPropertyBase);
+    }
+}
+
+bool MtpCapabilities::hasObjectProperty(MtpObjectFormat format,
+                                        MtpObjectProperty property) const {
+    auto set = mObjectProperties.find(format);
+    if (set == mObjectProperties.end())
+        return false;
+    if (property < kObjectPropertyBase || property >= kObjectPropertyBase + set->second.size())
+        return false;
+    return set->second[property - kObjectPropertyBase];
+}
+
+bool MtpCapabilities::knowsObjectProperties(MtpObjectFormat format) const {
+    return mObjectProperties.find(format) != mObjectProperties.end();
+}
+
+}  // namespace android
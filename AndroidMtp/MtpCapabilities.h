@@ -0,0 +1,66 @@
+//
+//  MtpCapabilities.h
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#ifndef _MTP_CAPABILITIES_H
+#define _MTP_CAPABILITIES_H
+
+#include "MtpTypes.h"
+
+#include <bitset>
+#include <unordered_map>
+
+namespace android {
+
+class MtpDeviceInfo;
+
+// What a device says it can do, from its DeviceInfo and the properties it lists per object
+// format. Everything is a bitset over the 16-bit code space, so each question is one bit test
+// instead of a walk through the DeviceInfo lists.
+class MtpCapabilities {
+public:
+    typedef std::bitset<0x10000> CodeSet;
+
+private:
+    // object property codes all live in 0xD000-0xDFFF, which keeps a format's set at 512 bytes
+    enum { kObjectPropertyBase = 0xD000 };
+    typedef std::bitset<0x1000> ObjectPropertySet;
+
+    CodeSet                 mOperations;
+    CodeSet                 mEvents;
+    CodeSet                 mDeviceProperties;
+    CodeSet                 mCaptureFormats;
+    CodeSet                 mPlaybackFormats;
+    std::unordered_map<MtpObjectFormat, ObjectPropertySet> mObjectProperties;
+
+public:
+    // Replaces everything but the object properties with what |info| lists.
+    void                    setDeviceInfo(const MtpDeviceInfo& info);
+    // Records the GetObjectPropsSupported answer for |format|.
+    void                    setObjectProperties(MtpObjectFormat format,
+                                                const MtpObjectPropertyList& properties);
+
+    inline bool             hasOperation(MtpOperationCode code) const { return mOperations[code]; }
+    inline bool             hasEvent(MtpEventCode code) const { return mEvents[code]; }
+    inline bool             hasDeviceProperty(MtpDeviceProperty code) const {
+                                return mDeviceProperties[code];
+                            }
+    inline bool             hasCaptureFormat(MtpObjectFormat format) const {
+                                return mCaptureFormats[format];
+                            }
+    inline bool             hasPlaybackFormat(MtpObjectFormat format) const {
+                                return mPlaybackFormats[format];
+                            }
+    // Whether objects of |format| carry |property|. False for formats whose properties
+    // were never recorded, see knowsObjectProperties().
+    bool                    hasObjectProperty(MtpObjectFormat format,
+                                              MtpObjectProperty property) const;
+    bool                    knowsObjectProperties(MtpObjectFormat format) const;
+};
+
+}; // namespace android
+
+#endif // _MTP_CAPABILITIES_H
@@ -19,9 +19,13 @@
 #include "MtpDataPacket.h"
 
 #include <algorithm>
+#include <type_traits>
+#include <vector>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/types.h>
 
 #include "usbhost.h"
@@ -50,11 +54,69 @@ ssize_t readExactBytes(int fd, void* buf, size_t count) {
     }
     return read_count == count ? count : -1;
 }
+
+// Same as readExactBytes, but reads at |offset| without moving the file position.
+ssize_t preadExactBytes(int fd, void* buf, size_t count, off_t offset) {
+    if (count > SSIZE_MAX) {
+        return -1;
+    }
+    size_t read_count = 0;
+    while (read_count < count) {
+        const ssize_t result = pread(fd, static_cast<int8_t*>(buf) + read_count,
+                                     count - read_count, offset + read_count);
+        if (result < 0 && errno == EINTR)
+            continue;
+        // Assume that EOF is error.
+        if (result <= 0) {
+            return -1;
+        }
+        read_count += result;
+    }
+    return read_count;
+}
+
+// Tells the kernel we're about to read |count| bytes at |offset| so the disk stays ahead of us.
+void adviseSequentialRead(int fd, off_t offset, size_t count) {
+#if defined(F_RDADVISE)
+    struct radvisory advisory;
+    advisory.ra_offset = offset;
+    advisory.ra_count = (int)std::min(count, static_cast<size_t>(INT_MAX));
+    fcntl(fd, F_RDADVISE, &advisory);
+#elif defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, offset, count, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+// Converts |count| little-endian elements at |src| to host order. MTP is little-endian like
+// every host this builds for, where it's a plain copy; anywhere else the shift-and-or loop
+// is what compilers turn into vectorized byte swaps.
+template <class T>
+void copyLittleEndian(T* dst, const uint8_t* src, size_t count) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(dst, src, count * sizeof(T));
+#else
+    typedef typename std::make_unsigned<T>::type U;
+    for (size_t i = 0; i < count; i++) {
+        U value = 0;
+        for (size_t b = 0; b < sizeof(T); b++)
+            value |= (U)src[i * sizeof(T) + b] << (8 * b);
+        dst[i] = (T)value;
+    }
+#endif
+}
 }  // namespace
 
 MtpDataPacket::MtpDataPacket()
     :   MtpPacket(MTP_BUFFER_SIZE),   // MAX_USBFS_BUFFER_SIZE
-        mOffset(MTP_CONTAINER_HEADER_SIZE)
+        mOffset(MTP_CONTAINER_HEADER_SIZE),
+        mPendingLength(0)
+{
+}
+
+MtpDataPacket::MtpDataPacket(const MtpDataPacket& source, size_t begin, size_t end)
+    :   MtpPacket(source.mBuffer, end),
+        mOffset(begin),
+        mPendingLength(0)
 {
 }
 
@@ -64,6 +126,7 @@ MtpDataPacket::~MtpDataPacket() {
 void MtpDataPacket::reset() {
     MtpPacket::reset();
     mOffset = MTP_CONTAINER_HEADER_SIZE;
+    mPendingLength = 0;
 }
 
 void MtpDataPacket::setOperationCode(MtpOperationCode code) {
@@ -121,300 +184,208 @@ bool MtpDataPacket::getString(MtpStringBuffer& string)
     return string.readFromPacket(this);
 }
 
-Int8List* MtpDataPacket::getAInt8() {
-    uint32_t count;
-    if (!getUInt32(count))
+const uint8_t* MtpDataPacket::getBytes(size_t length) {
+    if (mPacketSize - mOffset < length)
         return NULL;
-    Int8List* result = new Int8List;
-    for (uint32_t i = 0; i < count; i++) {
-        int8_t value;
-        if (!getInt8(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
-    return result;
+    const uint8_t* bytes = mBuffer + mOffset;
+    mOffset += length;
+    return bytes;
 }
 
-UInt8List* MtpDataPacket::getAUInt8() {
+// Reads a count-prefixed array in one pass: the count is checked against what's left of the
+// packet once, and the elements are converted wholesale instead of one getter call each.
+template <class T>
+std::vector<T>* MtpDataPacket::getArray() {
     uint32_t count;
     if (!getUInt32(count))
         return NULL;
-    UInt8List* result = new UInt8List;
-    for (uint32_t i = 0; i < count; i++) {
-        uint8_t value;
-        if (!getUInt8(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
+    if ((mPacketSize - mOffset) / sizeof(T) < count)
+        return NULL;
+    std::vector<T>* result = new std::vector<T>(count);
+    copyLittleEndian(result->data(), mBuffer + mOffset, count);
+    mOffset += count * sizeof(T);
     return result;
 }
 
+Int8List* MtpDataPacket::getAInt8() {
+    return getArray<int8_t>();
+}
+
+UInt8List* MtpDataPacket::getAUInt8() {
+    return getArray<uint8_t>();
+}
+
 Int16List* MtpDataPacket::getAInt16() {
-    uint32_t count;
-    if (!getUInt32(count))
-        return NULL;
-    Int16List* result = new Int16List;
-    for (uint32_t i = 0; i < count; i++) {
-        int16_t value;
-        if (!getInt16(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
-    return result;
+    return getArray<int16_t>();
 }
 
 UInt16List* MtpDataPacket::getAUInt16() {
-    uint32_t count;
-    if (!getUInt32(count))
-        return NULL;
-    UInt16List* result = new UInt16List;
-    for (uint32_t i = 0; i < count; i++) {
-        uint16_t value;
-        if (!getUInt16(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
-    return result;
+    return getArray<uint16_t>();
 }
 
 Int32List* MtpDataPacket::getAInt32() {
-    uint32_t count;
-    if (!getUInt32(count))
-        return NULL;
-    Int32List* result = new Int32List;
-    for (uint32_t i = 0; i < count; i++) {
-        int32_t value;
-        if (!getInt32(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
-    return result;
+    return getArray<int32_t>();
 }
 
 UInt32List* MtpDataPacket::getAUInt32() {
-    uint32_t count;
-    if (!getUInt32(count))
-        return NULL;
-    UInt32List* result = new UInt32List;
-    for (uint32_t i = 0; i < count; i++) {
-        uint32_t value;
-        if (!getUInt32(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
-    return result;
+    return getArray<uint32_t>();
 }
 
 Int64List* MtpDataPacket::getAInt64() {
-    uint32_t count;
-    if (!getUInt32(count))
-        return NULL;
-    Int64List* result = new Int64List;
-    for (uint32_t i = 0; i < count; i++) {
-        int64_t value;
-        if (!getInt64(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
-    return result;
+    return getArray<int64_t>();
 }
 
 UInt64List* MtpDataPacket::getAUInt64() {
-    uint32_t count;
-    if (!getUInt32(count))
-        return NULL;
-    UInt64List* result = new UInt64List;
-    for (uint32_t i = 0; i < count; i++) {
-        uint64_t value;
-        if (!getUInt64(value)) {
-            delete result;
-            return NULL;
-        }
-        result->push_back(value);
-    }
-    return result;
+    return getArray<uint64_t>();
 }
 
-void MtpDataPacket::putInt8(int8_t value) {
-    allocate(mOffset + 1);
-    mBuffer[mOffset++] = (uint8_t)value;
+void MtpDatasetWriter::putUInt128(const uint128_t& value) {
+    putUInt32(value[0]);
+    putUInt32(value[1]);
+    putUInt32(value[2]);
+    putUInt32(value[3]);
+}
+
+void MtpDatasetWriter::putString(std::string_view utf8) {
+    mCursor = MtpStringBuffer::encode(utf8, mCursor);
+}
+
+MtpDatasetWriter MtpDataPacket::beginDataset(size_t length) {
+    allocate(mOffset + length);
+    return MtpDatasetWriter(mBuffer + mOffset);
+}
+
+void MtpDataPacket::endDataset(const MtpDatasetWriter& writer) {
+    mOffset = writer.position() - mBuffer;
     if (mPacketSize < mOffset)
         mPacketSize = mOffset;
 }
 
+template <class T>
+void MtpDataPacket::putArray(const T* values, uint32_t count) {
+    MtpDatasetWriter writer = beginDataset(MtpDatasetWriter::arraySize<T>(count));
+    writer.putArray(values, count);
+    endDataset(writer);
+}
+
+void MtpDataPacket::putInt8(int8_t value) {
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putInt8(value);
+    endDataset(writer);
+}
+
 void MtpDataPacket::putUInt8(uint8_t value) {
-    allocate(mOffset + 1);
-    mBuffer[mOffset++] = (uint8_t)value;
-    if (mPacketSize < mOffset)
-        mPacketSize = mOffset;
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putUInt8(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putInt16(int16_t value) {
-    allocate(mOffset + 2);
-    mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-    if (mPacketSize < mOffset)
-        mPacketSize = mOffset;
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putInt16(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putUInt16(uint16_t value) {
-    allocate(mOffset + 2);
-    mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-    if (mPacketSize < mOffset)
-        mPacketSize = mOffset;
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putUInt16(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putInt32(int32_t value) {
-    allocate(mOffset + 4);
-    mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-    if (mPacketSize < mOffset)
-        mPacketSize = mOffset;
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putInt32(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putUInt32(uint32_t value) {
-    allocate(mOffset + 4);
-    mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-    if (mPacketSize < mOffset)
-        mPacketSize = mOffset;
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putUInt32(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putInt64(int64_t value) {
-    allocate(mOffset + 8);
-    mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 32) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 40) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 48) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 56) & 0xFF);
-    if (mPacketSize < mOffset)
-        mPacketSize = mOffset;
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putInt64(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putUInt64(uint64_t value) {
-    allocate(mOffset + 8);
-    mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 32) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 40) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 48) & 0xFF);
-    mBuffer[mOffset++] = (uint8_t)((value >> 56) & 0xFF);
-    if (mPacketSize < mOffset)
-        mPacketSize = mOffset;
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putUInt64(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putInt128(const int128_t& value) {
-    putInt32(value[0]);
-    putInt32(value[1]);
-    putInt32(value[2]);
-    putInt32(value[3]);
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putInt128(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putUInt128(const uint128_t& value) {
-    putUInt32(value[0]);
-    putUInt32(value[1]);
-    putUInt32(value[2]);
-    putUInt32(value[3]);
+    MtpDatasetWriter writer = beginDataset(sizeof(value));
+    writer.putUInt128(value);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putInt128(int64_t value) {
-    putInt64(value);
-    putInt64(value < 0 ? -1 : 0);
+    MtpDatasetWriter writer = beginDataset(16);
+    writer.putInt64(value);
+    writer.putInt64(value < 0 ? -1 : 0);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putUInt128(uint64_t value) {
-    putUInt64(value);
-    putUInt64(0);
+    MtpDatasetWriter writer = beginDataset(16);
+    writer.putUInt64(value);
+    writer.putUInt64(0);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putAInt8(const int8_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putInt8(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putAUInt8(const uint8_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putUInt8(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putAInt16(const int16_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putInt16(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putAUInt16(const uint16_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putUInt16(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putAUInt16(const UInt16List* values) {
-    size_t count = (values ? values->size() : 0);
-    putUInt32((int)count);
-    for (size_t i = 0; i < count; i++)
-        putUInt16((*values)[i]);
+    if (!values)
+        putEmptyArray();
+    else
+        putArray(values->data(), (uint32_t)values->size());
 }
 
 void MtpDataPacket::putAInt32(const int32_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putInt32(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putAUInt32(const uint32_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putUInt32(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putAUInt32(const UInt32List* list) {
-    if (!list) {
+    if (!list)
         putEmptyArray();
-    } else {
-        size_t size = list->size();
-        putUInt32((int)size);
-        for (size_t i = 0; i < size; i++)
-            putUInt32((*list)[i]);
-    }
+    else
+        putArray(list->data(), (uint32_t)list->size());
 }
 
 void MtpDataPacket::putAInt64(const int64_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putInt64(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putAUInt64(const uint64_t* values, int count) {
-    putUInt32(count);
-    for (int i = 0; i < count; i++)
-        putUInt64(*values++);
+    putArray(values, count);
 }
 
 void MtpDataPacket::putString(const MtpStringBuffer& string) {
@@ -422,8 +393,10 @@ void MtpDataPacket::putString(const MtpStringBuffer& string) {
 }
 
 void MtpDataPacket::putString(const char* s) {
-    MtpStringBuffer string(s);
-    string.writeToPacket(this);
+    const std::string_view string(s);
+    MtpDatasetWriter writer = beginDataset(MtpDatasetWriter::stringSize(string.length()));
+    writer.putString(string);
+    endDataset(writer);
 }
 
 void MtpDataPacket::putString(const uint16_t* string) {
@@ -434,29 +407,34 @@ void MtpDataPacket::putString(const uint16_t* string) {
         else
             break;
     }
-    putUInt8(count > 0 ? count + 1 : 0);
+    MtpDatasetWriter writer = beginDataset(1 + (count > 0 ? (count + 1) * 2 : 0));
+    writer.putUInt8(count > 0 ? count + 1 : 0);
     for (int i = 0; i < count; i++)
-        putUInt16(string[i]);
+        writer.putUInt16(string[i]);
     // only terminate with zero if string is not empty
     if (count > 0)
-        putUInt16(0);
+        writer.putUInt16(0);
+    endDataset(writer);
 }
 
 
 int MtpDataPacket::read(struct libusb_request *request) {
-    // first read the header
-    
+    // first read the header, along with as much payload as one transfer allows
+    const uint32_t transferSize = std::max(request->max_transfer_size, MTP_BUFFER_SIZE);
+    allocate(transferSize);
     request->buffer = mBuffer;
-    request->buffer_length = (int)mBufferSize;
+    request->buffer_length = (int)transferSize;
     int length = transfer(request);
     if (length >= MTP_CONTAINER_HEADER_SIZE) {
         // look at the length field to see if the data spans multiple packets
         uint32_t totalLength = MtpPacket::getUInt32(MTP_CONTAINER_LENGTH_OFFSET);
+        // allocate() keeps mPacketSize bytes when the buffer moves
+        mPacketSize = length;
         allocate(totalLength);
         while (totalLength > static_cast<uint32_t>(length)) {
             request->buffer = mBuffer + length;
-            request->buffer_length = totalLength - length;
-            int ret = transfer(request);
+            request->buffer_length = (int)std::min(totalLength - length, transferSize);
+            int ret = transfer(request, true);
             if (ret >= 0)
                 length += ret;
             else {
@@ -470,12 +448,56 @@ int MtpDataPacket::read(struct libusb_request *request) {
     return length;
 }
 
+int MtpDataPacket::readStart(struct libusb_request *request) {
+    const uint32_t transferSize = std::max(request->max_transfer_size, MTP_BUFFER_SIZE);
+    allocate(transferSize);
+    request->buffer = mBuffer;
+    request->buffer_length = (int)transferSize;
+    int length = transfer(request);
+    mPendingLength = 0;
+    if (length >= 0)
+        mPacketSize = length;
+    if (length >= MTP_CONTAINER_HEADER_SIZE) {
+        uint32_t totalLength = MtpPacket::getUInt32(MTP_CONTAINER_LENGTH_OFFSET);
+        if (totalLength > static_cast<uint32_t>(length))
+            mPendingLength = totalLength - length;
+    }
+    return length;
+}
+
+int MtpDataPacket::readContinue(struct libusb_request *request) {
+    if (mPendingLength == 0)
+        return 0;
+
+    // the header stays put so the container fields can still be read
+    const size_t unread = mOffset < mPacketSize ? mPacketSize - mOffset : 0;
+    if (mOffset > MTP_CONTAINER_HEADER_SIZE)
+        memmove(mBuffer + MTP_CONTAINER_HEADER_SIZE, mBuffer + mOffset, unread);
+    mPacketSize = MTP_CONTAINER_HEADER_SIZE + unread;
+    mOffset = MTP_CONTAINER_HEADER_SIZE;
+
+    const uint32_t transferSize = std::max(request->max_transfer_size, MTP_BUFFER_SIZE);
+    const uint32_t length = std::min(mPendingLength, transferSize);
+    allocate(mPacketSize + length);
+    request->buffer = mBuffer + mPacketSize;
+    request->buffer_length = (int)length;
+    int ret = transfer(request, true);
+    if (ret < 0)
+        return ret;
+    // nothing at all before the end means the device gave up on the container
+    if (ret == 0)
+        return LIBUSB_ERROR_IO;
+    mPacketSize += ret;
+    mPendingLength -= std::min(mPendingLength, (uint32_t)ret);
+    return ret;
+}
+
 int MtpDataPacket::readData(struct libusb_request *request, void* buffer, int length) {
     int read = 0;
     while (read < length) {
         request->buffer = (u_char *)buffer + read;
         request->buffer_length = length - read;
-        int ret = transfer(request);
+        int ret = transfer(request, read > 0);
         if (ret < 0) {
             return ret;
         }
@@ -484,33 +506,12 @@ int MtpDataPacket::readData(struct libusb_request *request, void* buffer, int le
     return read;
 }
 
-static void readDataAsync_Callback(libusb_transfer *transfer) {
-    auto req = (struct libusb_request *)transfer->user_data;
-    req->actual_length = transfer->actual_length;
-    while(!req->waiting){
-        struct timespec ts = {0, 80000000};
-        nanosleep(&ts, NULL);
-    }
-    pthread_cond_signal(&req->cond);
-}
-
 // Queue a read request.  Call readDataWait to wait for result
 int MtpDataPacket::readDataAsync(struct libusb_request *req)
 {
-    libusb_transfer transfer = {0};
-    int ret = 0;
-    
-    libusb_fill_bulk_transfer(&transfer,
-                              req->handle,
-                              req->endpoint,
-                              req->buffer,
-                              req->buffer_length,
-                              readDataAsync_Callback,
-                              req,
-                              5000);
-    
-    if ((ret = libusb_submit_transfer(&transfer)) != 0) {
-        fprintf(stderr, "libusb_endpoint_queue failed, errno: %d\n", errno);
+    int ret = libusb_request_submit(req);
+    if (ret != LIBUSB_SUCCESS) {
+        fprintf(stderr, "libusb_request_submit failed: %s\n", libusb_strerror(ret));
         return -1;
     }
     return 0;
@@ -518,9 +519,7 @@ int MtpDataPacket::readDataAsync(struct libusb_request *req)
 
 // Wait for result of readDataAsync
 int MtpDataPacket::readDataWait(struct libusb_request *req) {
-    req->waiting = true;
-    int ret = pthread_cond_wait(&req->cond, &req->mutex);
-    return (ret == 0 ? ret : -ret);
+    return libusb_request_wait(req);
 }
 
 int MtpDataPacket::readDataHeader(struct libusb_request *request) {
@@ -564,21 +563,22 @@ int64_t MtpDataPacket::write(struct libusb_request *request,
                          int fd,
                          size_t payloadSize) {
     // Obtain the greatest multiple of minimum packet size that is not greater than
-    // MTP_BUFFER_SIZE.
+    // the endpoint's negotiated transfer size.
     if (request->max_packet_size <= 0) {
         fprintf(stderr, "Cannot determine bulk transfer size due to illegal max packet size %d.\n",
               request->max_packet_size);
         return -1;
     }
+    const size_t transferSize = std::max(request->max_transfer_size, MTP_BUFFER_SIZE);
     const size_t maxBulkTransferSize =
-            MTP_BUFFER_SIZE - (MTP_BUFFER_SIZE % request->max_packet_size);
+            transferSize - (transferSize % request->max_packet_size);
     const size_t containerLength = payloadSize + MTP_CONTAINER_HEADER_SIZE;
     size_t processedBytes = 0;
     bool readError = false;
 
-    // Bind the packet with given request.
-    request->buffer = mBuffer;
+    // Bind the packet with given request. allocate() may move the buffer, so it goes first.
     allocate(maxBulkTransferSize);
+    request->buffer = mBuffer;
 
     while (processedBytes < containerLength) {
         size_t bulkTransferSize = 0;
@@ -618,7 +618,7 @@ int64_t MtpDataPacket::write(struct libusb_request *request,
         // Bulk transfer.
         mPacketSize = bulkTransferSize;
         request->buffer_length = (int)bulkTransferSize;
-        const int result = transfer(request);
+        const int result = transfer(request, headerSent);
         if (result != static_cast<ssize_t>(bulkTransferSize)) {
             // Cannot recover writing error.
             fprintf(stderr, "Found an error while write data to AndroidMtpDevice.\n");;
@@ -632,6 +632,99 @@ int64_t MtpDataPacket::write(struct libusb_request *request,
     return readError ? -1 : processedBytes;
 }
 
+int64_t MtpDataPacket::writeQueued(struct libusb_request *request,
+                                   UrbPacketDivisionMode divisionMode,
+                                   int fd,
+                                   size_t payloadSize,
+                                   int depth) {
+    if (request->max_packet_size <= 0) {
+        fprintf(stderr, "Cannot determine bulk transfer size due to illegal max packet size %d.\n",
+              request->max_packet_size);
+        return -1;
+    }
+    // pread() needs a seekable descriptor; anything else goes through the serial path.
+    const off_t startOffset = lseek(fd, 0, SEEK_CUR);
+    if (startOffset < 0 || depth <= 1)
+        return write(request, divisionMode, fd, payloadSize);
+
+    const size_t transferSize = std::max(request->max_transfer_size, MTP_BUFFER_SIZE);
+    const size_t maxBulkTransferSize =
+            transferSize - (transferSize % request->max_packet_size);
+    struct libusb_transfer_queue* queue =
+            libusb_transfer_queue_new(request, depth, (int)maxBulkTransferSize);
+    if (!queue) {
+        fprintf(stderr, "Failed to allocate the bulk-OUT queue.\n");
+        return -1;
+    }
+
+    const size_t containerLength = payloadSize + MTP_CONTAINER_HEADER_SIZE;
+    MtpPacket::putUInt32(MTP_CONTAINER_LENGTH_OFFSET,
+                         (uint32_t)std::min(containerLength, static_cast<size_t>(UINT32_MAX)));
+    MtpPacket::putUInt16(MTP_CONTAINER_TYPE_OFFSET, MTP_CONTAINER_TYPE_DATA);
+    adviseSequentialRead(fd, startOffset, payloadSize);
+
+    // Lengths of the transfers in flight, indexed the same way the queue's slots are.
+    std::vector<int> submitted(depth);
+    size_t submitCount = 0, reapCount = 0;
+    size_t processedBytes = 0, queuedBytes = 0;
+    bool readError = false, writeError = false;
+
+    while (!writeError && processedBytes < containerLength) {
+        // Fill and queue the next buffer while the device drains the ones already queued.
+        u_char* buffer = queuedBytes < containerLength ?
+                libusb_transfer_queue_next_buffer(queue) : nullptr;
+        if (buffer) {
+            size_t bulkTransferSize = 0;
+            const bool headerSent = queuedBytes != 0;
+            if (!headerSent) {
+                memcpy(buffer, mBuffer, MTP_CONTAINER_HEADER_SIZE);
+                bulkTransferSize += MTP_CONTAINER_HEADER_SIZE;
+            }
+            if (headerSent || divisionMode == FIRST_PACKET_HAS_PAYLOAD) {
+                const size_t processedPayloadBytes =
+                        headerSent ? queuedBytes - MTP_CONTAINER_HEADER_SIZE : 0;
+                const size_t bulkTransferPayloadSize =
+                        std::min(payloadSize - processedPayloadBytes,
+                                 maxBulkTransferSize - bulkTransferSize);
+                if (!readError &&
+                    preadExactBytes(fd, buffer + bulkTransferSize, bulkTransferPayloadSize,
+                                    startOffset + processedPayloadBytes) < 0) {
+                    fprintf(stderr, "Found an error while reading data from FD. Send 0 data instead.\n");
+                    readError = true;
+                }
+                if (readError) {
+                    memset(buffer + bulkTransferSize, 0, bulkTransferPayloadSize);
+                }
+                bulkTransferSize += bulkTransferPayloadSize;
+            }
+
+            const int ret = libusb_transfer_queue_submit(queue, nullptr, (int)bulkTransferSize);
+            if (ret != LIBUSB_SUCCESS) {
+                fprintf(stderr, "libusb_transfer_queue_submit failed: %s\n", libusb_strerror(ret));
+                writeError = true;
+                break;
+            }
+            submitted[submitCount++ % depth] = (int)bulkTransferSize;
+            queuedBytes += bulkTransferSize;
+            continue;
+        }
+
+        // Every buffer is in flight (or everything is queued), so wait for the oldest one.
+        const int result = libusb_transfer_queue_reap(queue, nullptr);
+        if (result != submitted[reapCount++ % depth]) {
+            // Cannot recover writing error.
+            fprintf(stderr, "Found an error while write data to AndroidMtpDevice.\n");
+            writeError = true;
+            break;
+        }
+        processedBytes += result;
+    }
+
+    libusb_transfer_queue_free(queue);
+    lseek(fd, startOffset + payloadSize, SEEK_SET);
+    return readError || writeError ? -1 : processedBytes;
+}
+
 void* MtpDataPacket::getData(int* outLength) const {
     int length = (int) (mPacketSize - MTP_CONTAINER_HEADER_SIZE);
     if (length > 0) {
@@ -18,24 +18,106 @@
 #define _MTP_DATA_PACKET_H
 
 #include "MtpPacket.h"
+#include "MtpStringBuffer.h"
 #include "mtp.h"
 
+#include <string.h>
+#include <string_view>
+#include <type_traits>
+
 struct libusb_device;
 struct libusb_request;
 
 namespace android {
 
 class IMtpHandle;
-class MtpStringBuffer;
+
+// Writes dataset fields straight into payload reserved up front by
+// MtpDataPacket::beginDataset(), so there are no per-field size checks or reallocations.
+// Callers add up the sizes of what they are about to write; for strings, stringSize()
+// gives a bound.
+class MtpDatasetWriter {
+private:
+    uint8_t*            mCursor;
+
+public:
+    explicit            MtpDatasetWriter(uint8_t* buffer) : mCursor(buffer) {}
+
+    inline void         putInt8(int8_t value) { putUInt8((uint8_t)value); }
+    inline void         putUInt8(uint8_t value) { *mCursor++ = value; }
+    inline void         putInt16(int16_t value) { store((uint16_t)value); }
+    inline void         putUInt16(uint16_t value) { store(value); }
+    inline void         putInt32(int32_t value) { store((uint32_t)value); }
+    inline void         putUInt32(uint32_t value) { store(value); }
+    inline void         putInt64(int64_t value) { store((uint64_t)value); }
+    inline void         putUInt64(uint64_t value) { store(value); }
+    inline void         putInt128(const int128_t& value) { putUInt128((const uint128_t&)value); }
+    void                putUInt128(const uint128_t& value);
+    void                putString(std::string_view utf8);
+    inline void         putEmptyString() { putUInt8(0); }
+    // bytes already in wire order
+    inline void         putBytes(const void* data, size_t length) {
+        if (length > 0)
+            memcpy(mCursor, data, length);
+        mCursor += length;
+    }
+
+    // count, then the elements
+    template <class T>
+    void                putArray(const T* values, uint32_t count);
+
+    inline uint8_t*     position() const { return mCursor; }
+
+    // most a string of |utf8Length| bytes can take: each byte makes at most one UTF-16 unit,
+    // there are no more than 254 of them, plus the count and the terminator
+    static constexpr size_t stringSize(size_t utf8Length) {
+        return 1 + 2 * (utf8Length < MTP_STRING_MAX_CHARACTER_NUMBER - 1
+                        ? utf8Length + 1 : MTP_STRING_MAX_CHARACTER_NUMBER);
+    }
+    template <class T>
+    static constexpr size_t arraySize(size_t count) { return sizeof(uint32_t) + count * sizeof(T); }
+
+private:
+    // unaligned little-endian store
+    template <class T>
+    inline void         store(T value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(mCursor, &value, sizeof(T));
+#else
+        for (size_t i = 0; i < sizeof(T); i++)
+            mCursor[i] = (uint8_t)(value >> (8 * i));
+#endif
+        mCursor += sizeof(T);
+    }
+};
+
+template <class T>
+void MtpDatasetWriter::putArray(const T* values, uint32_t count) {
+    putUInt32(count);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (count > 0)
+        memcpy(mCursor, values, count * sizeof(T));
+    mCursor += count * sizeof(T);
+#else
+    for (uint32_t i = 0; i < count; i++)
+        store((typename std::make_unsigned<T>::type)values[i]);
+#endif
+}
 
 class MtpDataPacket : public MtpPacket {
     
 private:
     // current offset for get/put methods
     size_t              mOffset;
+    // bytes of a readStart() data phase still to come off the wire
+    uint32_t            mPendingLength;
 
 public:
                         MtpDataPacket();
+    // Reads bytes [begin, end) of |source|'s buffer, offsets as getOffset() counts them,
+    // without copying. Only the get calls work, and |source| has to outlive it. Lets several
+    // threads decode parts of one packet.
+                        MtpDataPacket(const MtpDataPacket& source, size_t begin, size_t end);
     virtual             ~MtpDataPacket();
 
     virtual void        reset();
@@ -56,6 +138,9 @@ public:
     bool                getUInt128(uint128_t& value);
     inline bool         getInt128(int128_t& value) { return getUInt128((uint128_t&)value); }
     bool                getString(MtpStringBuffer& string);
+    // Returns the next |length| bytes of payload and skips past them, or NULL if the packet
+    // is shorter than that. For decoders that work straight off the packet buffer.
+    const uint8_t*      getBytes(size_t length);
 
     Int8List*           getAInt8();
     UInt8List*          getAUInt8();
@@ -95,7 +180,23 @@ public:
     inline void         putEmptyString() { putUInt8(0); }
     inline void         putEmptyArray() { putUInt32(0); }
 
+    // Reserves |length| bytes of payload at the current offset and returns a writer for
+    // them. endDataset() moves the offset past whatever the writer wrote, which mustn't be
+    // more than was reserved. No other put calls in between.
+    MtpDatasetWriter    beginDataset(size_t length);
+    void                endDataset(const MtpDatasetWriter& writer);
+
     int                 read(struct libusb_request *request);
+    // Windowed version of read(), for datasets that are parsed as they arrive. readStart()
+    // reads the first transfer; each readContinue() drops the payload before the current
+    // offset, keeping the header, and appends the next transfer, so the buffer only ever
+    // holds a transfer plus whatever record was cut off. Parsers step back to the start of
+    // a record that comes up short and try again once more is in.
+    int                 readStart(struct libusb_request *request);
+    int                 readContinue(struct libusb_request *request);
+    inline bool         isReadComplete() const { return mPendingLength == 0; }
+    inline size_t       getOffset() const { return mOffset; }
+    inline void         setOffset(size_t offset) { mOffset = offset; }
     int                 readData(struct libusb_request *request, void* buffer, int length);
     int                 readDataAsync(struct libusb_request *req);
     int                 readDataWait(struct libusb_request *req);
@@ -107,14 +208,26 @@ public:
     // Otherwise -1.
     int                 write(struct libusb_request *request, UrbPacketDivisionMode divisionMode);
     // Similar to previous write method but it reads the payload from |fd|. If |size| is larger than
-    // MTP_BUFFER_SIZE, the data will be sent by multiple bulk transfer requests.
+    // the request's max_transfer_size, the data will be sent by multiple bulk transfer requests.
     // Return type (int64_t) is used to handle the case that the size can be larger than 2GB.
     int64_t             write(struct libusb_request *request, UrbPacketDivisionMode divisionMode,
                               int fd, size_t size);
+    // Pipelined version of the above. Up to |depth| bulk-OUT transfers are kept in flight while
+    // the following chunks are read from |fd| with pread(). Falls back to the serial write when
+    // |fd| can't seek.
+    int64_t             writeQueued(struct libusb_request *request, UrbPacketDivisionMode divisionMode,
+                                    int fd, size_t size, int depth);
 
     inline bool         hasData() const { return mPacketSize > MTP_CONTAINER_HEADER_SIZE; }
+    inline size_t       getPacketSize() const { return mPacketSize; }
     inline uint32_t     getContainerLength() const { return MtpPacket::getUInt32(MTP_CONTAINER_LENGTH_OFFSET); }
     void*               getData(int* outLength) const;
+
+private:
+    template <class T>
+    std::vector<T>*     getArray();
+    template <class T>
+    void                putArray(const T* values, uint32_t count);
 };
 
 }; // namespace android
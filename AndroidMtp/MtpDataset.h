@@ -0,0 +1,90 @@
+//
+//  MtpDataset.h
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#ifndef _MTP_DATASET_H
+#define _MTP_DATASET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <type_traits>
+
+#include "MtpDataPacket.h"
+#include "mtp.h"
+
+namespace android {
+
+template <class Class, class Type>
+Type mtpMemberTypeOf(Type Class::*);
+
+// Type of the data member |Member| points to.
+template <auto Member>
+using MtpMemberType = decltype(mtpMemberTypeOf(Member));
+
+// Unaligned little-endian load of an integer field.
+template <class T>
+inline T mtpLoadLittleEndian(const uint8_t* src) {
+    static_assert(std::is_integral<T>::value, "dataset fields are integers");
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    T value;
+    memcpy(&value, src, sizeof(T));
+    return value;
+#else
+    typename std::make_unsigned<T>::type value = 0;
+    for (size_t i = 0; i < sizeof(T); i++)
+        value |= (typename std::make_unsigned<T>::type)src[i] << (8 * i);
+    return (T)value;
+#endif
+}
+
+// Bytes one element of the integer or integer array |type| takes, or 0 for other types.
+inline size_t mtpElementSize(MtpDataType type) {
+    static const size_t elementSize[] = { 1, 1, 2, 2, 4, 4, 8, 8, 16, 16 };
+    if ((type >= MTP_TYPE_INT8 && type <= MTP_TYPE_UINT128) ||
+        (type >= MTP_TYPE_AINT8 && type <= MTP_TYPE_AUINT128))
+        return elementSize[(type & 0xFF) - 1];
+    return 0;
+}
+
+// A run of fixed-size integer fields in a dataset, listed once as pointers to the members
+// they go into, in wire order. read() checks the length of the whole run once and then loads
+// every field without further checks; write() puts them back in the same order.
+//
+//     typedef MtpFixedFields<&Info::mSize, &Info::mFlags> InfoPrefix;
+//
+template <auto... Members>
+struct MtpFixedFields {
+    static constexpr size_t kSize = (sizeof(MtpMemberType<Members>) + ... + 0);
+
+    template <class Object>
+    static bool read(MtpDataPacket& packet, Object& object) {
+        const uint8_t* src = packet.getBytes(kSize);
+        if (!src)
+            return false;
+        // the fold runs left to right
+        ((object.*Members = mtpLoadLittleEndian<MtpMemberType<Members>>(src),
+          src += sizeof(MtpMemberType<Members>)), ...);
+        return true;
+    }
+
+    // |writer| needs kSize bytes of room
+    template <class Object>
+    static void write(MtpDatasetWriter& writer, const Object& object) {
+        (put(writer, object.*Members), ...);
+    }
+
+private:
+    static void put(MtpDatasetWriter& writer, uint8_t value) { writer.putUInt8(value); }
+    static void put(MtpDatasetWriter& writer, uint16_t value) { writer.putUInt16(value); }
+    static void put(MtpDatasetWriter& writer, uint32_t value) { writer.putUInt32(value); }
+    static void put(MtpDatasetWriter& writer, uint64_t value) { writer.putUInt64(value); }
+};
+
+}; // namespace android
+
+#endif // _MTP_DATASET_H
@@ -18,11 +18,23 @@
 
 #include "MtpDebug.h"
 #include "MtpDataPacket.h"
+#include "MtpDataset.h"
 #include "MtpDeviceInfo.h"
 #include "MtpStringBuffer.h"
 
 namespace android {
 
+namespace {
+
+// a DeviceInfo dataset up to the vendor extension description
+typedef MtpFixedFields<
+    &MtpDeviceInfo::mStandardVersion,
+    &MtpDeviceInfo::mVendorExtensionID,
+    &MtpDeviceInfo::mVendorExtensionVersion
+> DeviceInfoFields;
+
+} // namespace
+
 MtpDeviceInfo::MtpDeviceInfo()
     :   mStandardVersion(0),
         mVendorExtensionID(0),
@@ -63,9 +75,7 @@ bool MtpDeviceInfo::read(MtpDataPacket& packet) {
     MtpStringBuffer string;
 
     // read the device info
-    if (!packet.getUInt16(mStandardVersion)) return false;
-    if (!packet.getUInt32(mVendorExtensionID)) return false;
-    if (!packet.getUInt16(mVendorExtensionVersion)) return false;
+    if (!DeviceInfoFields::read(packet, *this)) return false;
 
     if (!packet.getString(string)) return false;
     mVendorExtensionDesc = strdup((const char *)string);
@@ -81,7 +91,7 @@ bool MtpDeviceInfo::read(MtpDataPacket& packet) {
     mCaptureFormats = packet.getAUInt16();
     if (!mCaptureFormats) return false;
     mPlaybackFormats = packet.getAUInt16();
-    if (!mCaptureFormats) return false;
+    if (!mPlaybackFormats) return false;
 
     if (!packet.getString(string)) return false;
     mManufacturer = strdup((const char *)string);
@@ -36,44 +36,24 @@ MtpEventPacket::~MtpEventPacket() {
 }
 
 
-static void interrupt_callback(libusb_transfer *transfer) {
-    auto req = (struct libusb_request *)transfer->user_data;
-    req->actual_length = transfer->actual_length;
-}
-
 int MtpEventPacket::sendRequest(struct libusb_request *request) {
-    libusb_transfer transfer = {0};
-    int ret = 0;
-    
     request->buffer = mBuffer;
     request->buffer_length = (int)mBufferSize;
     mPacketSize = 0;
-    libusb_fill_interrupt_transfer(&transfer,
-                                   request->handle,
-                                   request->endpoint,
-                                   request->buffer,
-                                   request->buffer_length,
-                                   interrupt_callback,
-                                   request,
-                                   5000);
-    
-    
-    if ((ret = libusb_submit_transfer(&transfer)) != 0) {
-        fprintf(stderr, "libusb_endpoint_queue failed, errno: %d\n", errno);
+
+    int ret = libusb_request_submit(request);
+    if (ret != LIBUSB_SUCCESS) {
+        fprintf(stderr, "libusb_request_submit failed: %s\n", libusb_strerror(ret));
         return -1;
     }
     return 0;
 }
 
 int MtpEventPacket::readResponse(struct libusb_request *req) {
-    req->waiting = true;
-    int ret = pthread_cond_wait(&req->cond, &req->mutex);
-    if (ret == 0) {
-        mPacketSize = req->actual_length;
-        return req->actual_length;
-    } else {
-        return -1;
-    }
+    int ret = libusb_request_wait(req);
+    if (ret >= 0)
+        mPacketSize = ret;
+    return ret;
 }
 
 }  // namespace android
@@ -35,6 +35,7 @@ public:
 
     // read our buffer with the given request
     int                 sendRequest(struct libusb_request *request);
+    // returns the number of bytes read, or a negative libusb error
     int                 readResponse(struct libusb_request *request);
 
     inline MtpEventCode     getEventCode() const { return getContainerCode(); }
@@ -18,12 +18,154 @@
 
 #include "MtpDebug.h"
 #include "MtpDataPacket.h"
+#include "MtpDataset.h"
 #include "MtpObjectInfo.h"
 #include "MtpStringBuffer.h"
+#include "MtpStringPool.h"
 #include "MtpUtils.h"
 
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 namespace android {
 
+namespace {
+
+// an ObjectInfo dataset up to the strings
+typedef MtpFixedFields<
+    &MtpObjectInfo::mStorageID,
+    &MtpObjectInfo::mFormat,
+    &MtpObjectInfo::mProtectionStatus,
+    &MtpObjectInfo::mCompressedSize,
+    &MtpObjectInfo::mThumbFormat,
+    &MtpObjectInfo::mThumbCompressedSize,
+    &MtpObjectInfo::mThumbPixWidth,
+    &MtpObjectInfo::mThumbPixHeight,
+    &MtpObjectInfo::mImagePixWidth,
+    &MtpObjectInfo::mImagePixHeight,
+    &MtpObjectInfo::mImagePixDepth,
+    &MtpObjectInfo::mParent,
+    &MtpObjectInfo::mAssociationType,
+    &MtpObjectInfo::mAssociationDesc,
+    &MtpObjectInfo::mSequenceNumber
+> ObjectInfoFields;
+
+static_assert(ObjectInfoFields::kSize == 52, "ObjectInfo has 52 bytes before the file name");
+
+// property lists shorter than this aren't worth starting threads for
+constexpr uint32_t kMinParallelProperties = 4096;
+constexpr unsigned kMaxDecodeThreads = 8;
+
+// each quadruple starts with the object handle, property code and data type
+constexpr size_t kPropertyHeaderSize = 8;
+
+// a run of whole objects in a property list, and what it decoded to
+struct PropertyRange {
+    size_t              begin;
+    size_t              end;
+    uint32_t            count;
+    MtpObjectInfoList   objects;
+    bool                ok;
+};
+
+// Bytes a value of |type| takes at |data|, or 0 when it runs past |end| or the type is unknown.
+size_t propertyValueSize(MtpDataType type, const uint8_t* data, const uint8_t* end) {
+    size_t size;
+    if (type >= MTP_TYPE_INT8 && type <= MTP_TYPE_UINT128) {
+        size = mtpElementSize(type);
+    } else if (type >= MTP_TYPE_AINT8 && type <= MTP_TYPE_AUINT128) {
+        if (end - data < 4)
+            return 0;
+        size = 4 + (size_t)mtpLoadLittleEndian<uint32_t>(data) * mtpElementSize(type);
+    } else if (type == MTP_TYPE_STR) {
+        if (end - data < 1)
+            return 0;
+        size = 1 + 2 * (size_t)data[0];
+    } else {
+        return 0;
+    }
+    return size <= (size_t)(end - data) ? size : 0;
+}
+
+// Walks |count| quadruples from the packet's offset without decoding them and cuts them into
+// about |parts| runs of whole objects. |ranges| stays empty if an object's properties are
+// spread out, since then they can only be gathered in one pass.
+bool splitPropertyList(const MtpDataPacket& packet, uint32_t count, unsigned parts,
+                       std::vector<PropertyRange>& ranges) {
+    const uint8_t* buffer = packet.getData() - MTP_CONTAINER_HEADER_SIZE;
+    const uint8_t* end = buffer + packet.getPacketSize();
+    size_t offset = packet.getOffset();
+    const size_t target = (packet.getPacketSize() - offset) / parts + 1;
+
+    std::unordered_set<MtpObjectHandle> seen;
+    PropertyRange range = { offset, offset, 0, {}, false };
+    MtpObjectHandle last = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((size_t)(end - buffer) - offset < kPropertyHeaderSize)
+            return false;
+        const MtpObjectHandle handle = mtpLoadLittleEndian<uint32_t>(buffer + offset);
+        const MtpDataType type = mtpLoadLittleEndian<uint16_t>(buffer + offset + 6);
+        if (i == 0 || handle != last) {
+            if (!seen.insert(handle).second) {
+                ranges.clear();
+                return true;
+            }
+            // a new object, so the range can end here
+            if (offset - range.begin >= target) {
+                range.end = offset;
+                ranges.push_back(range);
+                range = { offset, offset, 0, {}, false };
+            }
+            last = handle;
+        }
+        const size_t size = propertyValueSize(type, buffer + offset + kPropertyHeaderSize, end);
+        if (size == 0)
+            return false;
+        offset += kPropertyHeaderSize + size;
+        range.count++;
+    }
+    range.end = offset;
+    ranges.push_back(range);
+    return true;
+}
+
+// Decodes |count| quadruples into |objects|. With |contiguous| set, every object's properties
+// are known to come together, so there's no need to look handles up.
+bool readProperties(MtpDataPacket& packet, uint32_t count, MtpStringPool& strings,
+                    bool contiguous, MtpObjectInfoList& objects) {
+    std::unordered_map<MtpObjectHandle, MtpObjectInfo*> byHandle;
+    MtpObjectInfo* info = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        MtpObjectHandle handle;
+        uint16_t code, type;
+        if (!packet.getUInt32(handle) || !packet.getUInt16(code) || !packet.getUInt16(type))
+            return false;
+
+        if (info == NULL || info->mHandle != handle) {
+            MtpObjectInfo*& known = contiguous ? info : byHandle[handle];
+            if (contiguous || known == NULL) {
+                known = new MtpObjectInfo(handle);
+                objects.push_back(known);
+            }
+            info = known;
+        }
+        if (!info->readProperty(code, type, packet, strings))
+            return false;
+    }
+    return true;
+}
+
+void readPropertyRange(const MtpDataPacket& packet, PropertyRange& range, MtpStringPool& strings) {
+    MtpDataPacket view(packet, range.begin, range.end);
+    range.ok = readProperties(view, range.count, strings, true, range.objects);
+}
+
+} // namespace
+
 MtpObjectInfo::MtpObjectInfo(MtpObjectHandle handle)
     :   mHandle(handle),
         mStorageID(0),
@@ -41,10 +183,11 @@ MtpObjectInfo::MtpObjectInfo(MtpObjectHandle handle)
         mAssociationType(0),
         mAssociationDesc(0),
         mSequenceNumber(0),
-        mName(NULL),
+        mName(""),
         mDateCreated(0),
         mDateModified(0),
-        mKeywords(NULL)
+        mKeywords(""),
+        mObjectSize(0)
 {
 }
 
@@ -67,44 +210,27 @@ MtpObjectInfo::MtpObjectInfo(const MtpObjectInfo& info)
     mAssociationType = info.mAssociationType;
     mAssociationDesc = info.mAssociationDesc;
     mSequenceNumber = info.mSequenceNumber;
-    mName = strdup(info.mName);
+    mName = info.mName;
     mDateCreated = info.mDateCreated;
     mDateModified = info.mDateModified;
-    mKeywords = strdup(info.mKeywords);
+    mKeywords = info.mKeywords;
+    mObjectSize = info.mObjectSize;
 }
 
 MtpObjectInfo::~MtpObjectInfo() {
-    if (mName)
-        free(mName);
-    if (mKeywords)
-        free(mKeywords);
 }
 
 // we want to use std::string here, not (const char*)
 
-bool MtpObjectInfo::read(MtpDataPacket& packet) {
+bool MtpObjectInfo::read(MtpDataPacket& packet, MtpStringPool& strings) {
     MtpStringBuffer string;
     time_t time;
 
-    if (!packet.getUInt32(mStorageID)) return false;
-    if (!packet.getUInt16(mFormat)) return false;
-    if (!packet.getUInt16(mProtectionStatus)) return false;
-    if (!packet.getUInt32(mCompressedSize)) return false;
-    if (!packet.getUInt16(mThumbFormat)) return false;
-    if (!packet.getUInt32(mThumbCompressedSize)) return false;
-    if (!packet.getUInt32(mThumbPixWidth)) return false;
-    if (!packet.getUInt32(mThumbPixHeight)) return false;
-    if (!packet.getUInt32(mImagePixWidth)) return false;
-    if (!packet.getUInt32(mImagePixHeight)) return false;
-    if (!packet.getUInt32(mImagePixDepth)) return false;
-    if (!packet.getUInt32(mParent)) return false;
-    if (!packet.getUInt16(mAssociationType)) return false;
-    if (!packet.getUInt32(mAssociationDesc)) return false;
-    if (!packet.getUInt32(mSequenceNumber)) return false;
+    if (!ObjectInfoFields::read(packet, *this)) return false;
+    mObjectSize = mCompressedSize;
 
     if (!packet.getString(string)) return false;
-    mName = strdup((const char *)string);
-    if (!mName) return false;
+    mName = strings.intern(std::string_view((const char *)string, string.size()));
 
     if (!packet.getString(string)) return false;
     if (parseDateTime((const char*)string, time))
@@ -115,14 +241,195 @@ bool MtpObjectInfo::read(MtpDataPacket& packet) {
         mDateModified = time;
 
     if (!packet.getString(string)) return false;
-    mKeywords = strdup((const char *)string);
-    if (!mKeywords) return false;
+    mKeywords = strings.intern(std::string_view((const char *)string, string.size()));
+
+    return true;
+}
+
+void MtpObjectInfo::write(MtpDataPacket& packet) const {
+    char created[100], modified[100];
+    formatDateTime(mDateCreated, created, sizeof(created));
+    formatDateTime(mDateModified, modified, sizeof(modified));
+
+    MtpDatasetWriter writer = packet.beginDataset(ObjectInfoFields::kSize
+            + MtpDatasetWriter::stringSize(mName.length())
+            + MtpDatasetWriter::stringSize(strlen(created))
+            + MtpDatasetWriter::stringSize(strlen(modified))
+            + MtpDatasetWriter::stringSize(mKeywords.length()));
+    ObjectInfoFields::write(writer, *this);
+    writer.putString(mName);
+    writer.putString(created);
+    writer.putString(modified);
+    writer.putString(mKeywords);
+    packet.endDataset(writer);
+}
+
+MtpObjectInfoList* MtpObjectInfo::readPropertyList(MtpDataPacket& packet, MtpStringPool& strings,
+                                                   unsigned threads) {
+    uint32_t count;
+    if (!packet.getUInt32(count))
+        return NULL;
+
+    threads = std::min(threads, kMaxDecodeThreads);
+    std::vector<PropertyRange> ranges;
+    if (threads > 1 && count >= kMinParallelProperties &&
+            !splitPropertyList(packet, count, threads, ranges))
+        return NULL;
+
+    MtpObjectInfoList* list = new MtpObjectInfoList();
+    bool ok = true;
+    if (ranges.size() <= 1) {
+        ok = readProperties(packet, count, strings, false, *list);
+    } else {
+        // every range has a pool of its own, so the workers don't fight over |strings|. what
+        // they collected goes into it in one pass once they're done.
+        std::vector<std::unique_ptr<MtpStringPool>> staging;
+        for (size_t i = 0; i < ranges.size(); i++)
+            staging.emplace_back(new MtpStringPool());
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < ranges.size(); i++)
+            workers.emplace_back(readPropertyRange, std::cref(packet), std::ref(ranges[i]),
+                                 std::ref(*staging[i]));
+        readPropertyRange(packet, ranges[0], *staging[0]);
+        for (std::thread& worker : workers)
+            worker.join();
+
+        // the ranges are in dataset order, so the list comes out as a single pass makes it
+        size_t total = 0;
+        for (const PropertyRange& range : ranges) {
+            ok = ok && range.ok;
+            total += range.objects.size();
+        }
+        list->reserve(total);
+        for (const PropertyRange& range : ranges)
+            list->insert(list->end(), range.objects.begin(), range.objects.end());
+
+        if (ok) {
+            std::vector<std::string_view*> staged;
+            staged.reserve(2 * list->size());
+            for (MtpObjectInfo* info : *list) {
+                staged.push_back(&info->mName);
+                staged.push_back(&info->mKeywords);
+            }
+            strings.intern(staged);
+        }
+    }
+    if (!ok) {
+        for (MtpObjectInfo* info : *list)
+            delete info;
+        delete list;
+        return NULL;
+    }
+    return list;
+}
+
+bool MtpObjectInfo::readProperty(MtpObjectProperty code, MtpDataType type,
+                                 MtpDataPacket& packet, MtpStringPool& strings) {
+    MtpStringBuffer string;
+    uint64_t value = 0;
+    time_t time;
+
+    switch (type) {
+        case MTP_TYPE_INT8:
+        case MTP_TYPE_UINT8: {
+            uint8_t v;
+            if (!packet.getUInt8(v)) return false;
+            value = v;
+            break;
+        }
+        case MTP_TYPE_INT16:
+        case MTP_TYPE_UINT16: {
+            uint16_t v;
+            if (!packet.getUInt16(v)) return false;
+            value = v;
+            break;
+        }
+        case MTP_TYPE_INT32:
+        case MTP_TYPE_UINT32: {
+            uint32_t v;
+            if (!packet.getUInt32(v)) return false;
+            value = v;
+            break;
+        }
+        case MTP_TYPE_INT64:
+        case MTP_TYPE_UINT64:
+            if (!packet.getUInt64(value)) return false;
+            break;
+        case MTP_TYPE_INT128:
+        case MTP_TYPE_UINT128: {
+            uint128_t v;
+            if (!packet.getUInt128(v)) return false;
+            value = v[0];
+            break;
+        }
+        case MTP_TYPE_STR:
+            if (!packet.getString(string)) return false;
+            break;
+        case MTP_TYPE_AINT8:
+        case MTP_TYPE_AUINT8:
+        case MTP_TYPE_AINT16:
+        case MTP_TYPE_AUINT16:
+        case MTP_TYPE_AINT32:
+        case MTP_TYPE_AUINT32:
+        case MTP_TYPE_AINT64:
+        case MTP_TYPE_AUINT64:
+        case MTP_TYPE_AINT128:
+        case MTP_TYPE_AUINT128: {
+            // no ObjectInfo field is an array, step over it
+            uint32_t length;
+            if (!packet.getUInt32(length)) return false;
+            return packet.getBytes((size_t)length * mtpElementSize(type)) != NULL;
+        }
+        default:
+            fprintf(stderr, "unknown type %04X in MtpObjectInfo::readProperty\n", type);
+            return false;
+    }
 
+    switch (code) {
+        case MTP_PROPERTY_STORAGE_ID:
+            mStorageID = (MtpStorageID)value;
+            break;
+        case MTP_PROPERTY_OBJECT_FORMAT:
+            mFormat = (MtpObjectFormat)value;
+            break;
+        case MTP_PROPERTY_PROTECTION_STATUS:
+            mProtectionStatus = (uint16_t)value;
+            break;
+        case MTP_PROPERTY_OBJECT_SIZE:
+            mObjectSize = value;
+            mCompressedSize = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+            break;
+        case MTP_PROPERTY_ASSOCIATION_TYPE:
+            mAssociationType = (uint16_t)value;
+            break;
+        case MTP_PROPERTY_ASSOCIATION_DESC:
+            mAssociationDesc = (uint32_t)value;
+            break;
+        case MTP_PROPERTY_PARENT_OBJECT:
+            mParent = (MtpObjectHandle)value;
+            break;
+        case MTP_PROPERTY_OBJECT_FILE_NAME:
+            mName = strings.intern(std::string_view((const char *)string, string.size()));
+            break;
+        case MTP_PROPERTY_KEYWORDS:
+            mKeywords = strings.intern(std::string_view((const char *)string, string.size()));
+            break;
+        case MTP_PROPERTY_DATE_CREATED:
+            if (parseDateTime((const char*)string, time))
+                mDateCreated = time;
+            break;
+        case MTP_PROPERTY_DATE_MODIFIED:
+            if (parseDateTime((const char*)string, time))
+                mDateModified = time;
+            break;
+        default:
+            break;
+    }
     return true;
 }
 
 void MtpObjectInfo::print() {
-    fprintf(stdout, "MtpObject Info %08X: %s\n", mHandle, mName);
+    fprintf(stdout, "MtpObject Info %08X: %s\n", mHandle, mName.data());
     fprintf(stdout, "  mStorageID: %08X mFormat: %04X mProtectionStatus: %d\n",
             mStorageID, mFormat, mProtectionStatus);
     fprintf(stdout, "  mCompressedSize: %d mThumbFormat: %04X mThumbCompressedSize: %d\n",
@@ -133,7 +440,7 @@ void MtpObjectInfo::print() {
     fprintf(stdout, "  mParent: %08X mAssociationType: %04X mAssociationDesc: %04X\n",
             mParent, mAssociationType, mAssociationDesc);
     fprintf(stdout, "  mSequenceNumber: %d mDateCreated: %ld mDateModified: %ld mKeywords: %s\n",
-            mSequenceNumber, mDateCreated, mDateModified, mKeywords);
+            mSequenceNumber, mDateCreated, mDateModified, mKeywords.data());
 }
 
 }  // namespace android
@@ -19,9 +19,12 @@
 
 #include "MtpTypes.h"
 
+#include <string_view>
+
 namespace android {
 
 class MtpDataPacket;
+class MtpStringPool;
 
 class MtpObjectInfo {
 public:
@@ -41,17 +44,32 @@ public:
     uint16_t            mAssociationType;
     uint32_t            mAssociationDesc;
     uint32_t            mSequenceNumber;
-    char*               mName;
+    // the strings live in the MtpStringPool they were read with and are null terminated.
+    // copies of an object info share them.
+    std::string_view    mName;
     time_t              mDateCreated;
     time_t              mDateModified;
-    char*               mKeywords;
+    std::string_view    mKeywords;
+    // mCompressedSize saturates at 0xFFFFFFFF, this one holds the real size when known
+    uint64_t            mObjectSize;
 
 public:
     explicit            MtpObjectInfo(MtpObjectHandle handle);
                         MtpObjectInfo(const MtpObjectInfo& info);
     virtual             ~MtpObjectInfo();
 
-    bool                read(MtpDataPacket& packet);
+    bool                read(MtpDataPacket& packet, MtpStringPool& strings);
+    // the ObjectInfo dataset read() takes, as SendObjectInfo sends it
+    void                write(MtpDataPacket& packet) const;
+    // Reads one GetObjectPropList value of |type| and stores it in the matching field.
+    // Properties that aren't part of ObjectInfo are skipped.
+    bool                readProperty(MtpObjectProperty code, MtpDataType type,
+                                     MtpDataPacket& packet, MtpStringPool& strings);
+    // Decodes a whole GetObjectPropList dataset into one MtpObjectInfo per object, in the
+    // order they first appear. Long lists are cut at object boundaries and the pieces decoded
+    // on up to |threads| threads. Returns NULL if the dataset is malformed.
+    static MtpObjectInfoList* readPropertyList(MtpDataPacket& packet, MtpStringPool& strings,
+                                               unsigned threads);
 
     void                print();
 };
@@ -17,12 +17,14 @@
 #define LOG_TAG "MtpPacket"
 
 #include "MtpDebug.h"
+#include "MtpBufferPool.h"
 #include "MtpPacket.h"
 #include "mtp.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <algorithm>
 #include <iostream>
 
 #include "usbhost.h"
@@ -32,8 +34,11 @@ namespace android {
 MtpPacket::MtpPacket(int bufferSize)
     :   mBuffer(NULL),
         mBufferSize(bufferSize),
-        mAllocationIncrement(bufferSize),
-        mPacketSize(0)
+        mInitialSize(bufferSize),
+        mPacketSize(0),
+        mPool(NULL),
+        mDeviceBuffer(false),
+        mBorrowed(false)
 {
     mBuffer = (uint8_t *)malloc(bufferSize);
     if (!mBuffer) {
@@ -42,27 +47,87 @@ MtpPacket::MtpPacket(int bufferSize)
     }
 }
 
+MtpPacket::MtpPacket(const uint8_t* buffer, size_t length)
+    :   mBuffer(const_cast<uint8_t *>(buffer)),
+        mBufferSize(length),
+        mInitialSize(length),
+        mPacketSize(length),
+        mPool(NULL),
+        mDeviceBuffer(false),
+        mBorrowed(true)
+{
+}
+
 MtpPacket::~MtpPacket() {
-    if (mBuffer)
+    if (mBorrowed)
+        return;
+    if (mPool)
+        mPool->release(mBuffer, mBufferSize, mDeviceBuffer);
+    else if (mBuffer)
         free(mBuffer);
 }
 
 void MtpPacket::reset() {
-    allocate(MTP_CONTAINER_HEADER_SIZE);
+    if (mBufferSize > kMaxRetainedSize && mBufferSize > mInitialSize)
+        replaceBuffer(mInitialSize, 0);
     mPacketSize = MTP_CONTAINER_HEADER_SIZE;
-    memset(mBuffer, 0, mBufferSize);
+    // anything past the parameters gets written before it's read
+    memset(mBuffer, 0, std::min(mBufferSize, (size_t)MTP_CONTAINER_PARAMETER_OFFSET +
+                                             5 * sizeof(uint32_t)));
 }
 
 void MtpPacket::allocate(size_t length) {
     if (length > mBufferSize) {
-        int newLength = (int)(length + mAllocationIncrement);
-        mBuffer = (uint8_t *)realloc(mBuffer, newLength);
-        if (!mBuffer) {
+        // grow geometrically so a packet built a field at a time doesn't copy itself over and over
+        replaceBuffer(std::max(length, mBufferSize * 2), mPacketSize);
+    }
+}
+
+void MtpPacket::setBufferPool(MtpBufferPool* pool) {
+    if (pool == mPool)
+        return;
+    MtpBufferPool* old = mPool;
+    uint8_t* oldBuffer = mBuffer;
+    const size_t oldSize = mBufferSize;
+    const bool oldDeviceBuffer = mDeviceBuffer;
+
+    mPool = pool;
+    mBuffer = NULL;
+    mBufferSize = 0;
+    mDeviceBuffer = false;
+    replaceBuffer(oldSize, 0);
+    memcpy(mBuffer, oldBuffer, std::min(mPacketSize, oldSize));
+
+    if (old)
+        old->release(oldBuffer, oldSize, oldDeviceBuffer);
+    else
+        free(oldBuffer);
+}
+
+void MtpPacket::replaceBuffer(size_t length, size_t preserve) {
+    uint8_t* buffer;
+    size_t capacity = length;
+    bool deviceBuffer = false;
+    if (mPool) {
+        buffer = mPool->acquire(length, capacity, deviceBuffer);
+    } else {
+        buffer = (uint8_t *)malloc(length);
+        if (!buffer) {
             fprintf(stderr, "out of memory!\n");;
             abort();
         }
-        mBufferSize = newLength;
     }
+
+    if (mBuffer) {
+        memcpy(buffer, mBuffer, std::min(preserve, std::min(mBufferSize, capacity)));
+        if (mPool)
+            mPool->release(mBuffer, mBufferSize, mDeviceBuffer);
+        else
+            free(mBuffer);
+    }
+    mBuffer = buffer;
+    mBufferSize = capacity;
+    mDeviceBuffer = deviceBuffer;
 }
 
 void MtpPacket::dump() {
@@ -92,6 +157,15 @@ void MtpPacket::copyFrom(const MtpPacket& src) {
     memcpy(mBuffer, src.mBuffer, length);
 }
 
+void MtpPacket::swapBuffer(MtpPacket& other) {
+    std::swap(mBuffer, other.mBuffer);
+    std::swap(mBufferSize, other.mBufferSize);
+    std::swap(mPacketSize, other.mPacketSize);
+    // a buffer goes back where it came from
+    std::swap(mPool, other.mPool);
+    std::swap(mDeviceBuffer, other.mDeviceBuffer);
+}
+
 uint16_t MtpPacket::getUInt16(int offset) const {
     return ((uint16_t)mBuffer[offset + 1] << 8) | (uint16_t)mBuffer[offset];
 }
@@ -138,7 +212,11 @@ uint32_t MtpPacket::getParameter(int index) const {
         fprintf(stderr, "index %d out of range in MtpPacket::getParameter\n", index);
         return 0;
     }
-    return getUInt32(MTP_CONTAINER_PARAMETER_OFFSET + (index - 1) * sizeof(uint32_t));
+    const size_t offset = MTP_CONTAINER_PARAMETER_OFFSET + (index - 1) * sizeof(uint32_t);
+    // parameters the other side didn't send read as 0
+    if (offset + sizeof(uint32_t) > mPacketSize)
+        return 0;
+    return getUInt32((int)offset);
 }
 
 void MtpPacket::setParameter(int index, uint32_t value) {
@@ -152,19 +230,19 @@ void MtpPacket::setParameter(int index, uint32_t value) {
     putUInt32(offset, value);
 }
 
-int MtpPacket::transfer(struct libusb_request* request) {
+int MtpPacket::transfer(struct libusb_request* request, bool streaming) {
     int ret = libusb_bulk_transfer(request->handle,
                                       request->endpoint,
                                       request->buffer,
                                       request->buffer_length,
                                       &request->actual_length,
-                                      5000);
+                                      streaming ? request->stream_timeout : request->timeout);
     if (ret == 0)
         return request->actual_length;
     else {
         std::cerr << "libusb_bulk_transfer error: " << libusb_strerror(ret);
         std::cerr << std::endl;
-        return 0;
+        return ret;
     }
 }
 
@@ -26,27 +26,44 @@ struct libusb_request;
 
 namespace android {
 
+class MtpBufferPool;
+
 class MtpPacket {
 
 protected:
     uint8_t*            mBuffer;
     // current size of the buffer
     size_t              mBufferSize;
-    // number of bytes to add when resizing the buffer
-    size_t              mAllocationIncrement;
+    // size the buffer goes back to once a large packet is done with
+    size_t              mInitialSize;
     // size of the data in the packet
     size_t              mPacketSize;
+    // where mBuffer comes from; NULL for plain malloc()
+    MtpBufferPool*      mPool;
+    // mBuffer is libusb device memory and has to go back to mPool
+    bool                mDeviceBuffer;
+    // mBuffer belongs to someone else, see the read-only constructor
+    bool                mBorrowed;
 
 public:
     explicit            MtpPacket(int bufferSize);
+    // Reads the |length| bytes at |buffer| in place. They stay their owner's, so nothing
+    // may write to or grow the packet.
+                        MtpPacket(const uint8_t* buffer, size_t length);
     virtual             ~MtpPacket();
 
-    // sets packet size to the default container size and sets buffer to zero
+    // sets packet size to the default container size and zeroes the container header and
+    // parameters. a buffer grown past kMaxRetainedSize is given back.
     virtual void        reset();
 
+    // grows the buffer to hold at least |length| bytes, keeping the first mPacketSize
     void                allocate(size_t length);
+    // moves the buffer into |pool|, or back to malloc() when it's NULL
+    void                setBufferPool(MtpBufferPool* pool);
     void                dump();
     void                copyFrom(const MtpPacket& src);
+    // Trades buffers, contents included, with |other|. The pools go along with them.
+    void                swapBuffer(MtpPacket& other);
 
     uint16_t            getContainerCode() const;
     void                setContainerCode(uint16_t code);
@@ -59,9 +76,16 @@ public:
     uint32_t            getParameter(int index) const;
     void                setParameter(int index, uint32_t value);
 
-    int                 transfer(struct libusb_request* request);
+    // Returns the bytes moved or a negative libusb error. |streaming| transfers continue a data
+    // phase that's already flowing and use the request's shorter stream_timeout.
+    int                 transfer(struct libusb_request* request, bool streaming = false);
 
 protected:
+    // buffers above this are traded back for a fresh mInitialSize one on reset()
+    static constexpr size_t kMaxRetainedSize = 2 * 1024 * 1024;
+
+    void                replaceBuffer(size_t length, size_t preserve);
+
     uint16_t            getUInt16(int offset) const;
     uint32_t            getUInt32(int offset) const;
     void                putUInt16(int offset, uint16_t value);
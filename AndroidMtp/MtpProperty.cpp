@@ -35,10 +35,6 @@ MtpProperty::MtpProperty()
     :   mCode(0),
         mType(0),
         mWriteable(false),
-        mDefaultArrayLength(0),
-        mDefaultArrayValues(NULL),
-        mCurrentArrayLength(0),
-        mCurrentArrayValues(NULL),
         mGroupCode(0),
         mFormFlag(kFormNone),
         mEnumLength(0),
@@ -57,10 +53,6 @@ MtpProperty::MtpProperty(MtpPropertyCode propCode,
     :   mCode(propCode),
         mType(type),
         mWriteable(writeable),
-        mDefaultArrayLength(0),
-        mDefaultArrayValues(NULL),
-        mCurrentArrayLength(0),
-        mCurrentArrayValues(NULL),
         mGroupCode(0),
         mFormFlag(kFormNone),
         mEnumLength(0),
@@ -110,21 +102,11 @@ MtpProperty::~MtpProperty() {
         free(mCurrentValue.str);
         free(mMinimumValue.str);
         free(mMaximumValue.str);
-        if (mDefaultArrayValues) {
-            for (uint32_t i = 0; i < mDefaultArrayLength; i++)
-                free(mDefaultArrayValues[i].str);
-        }
-        if (mCurrentArrayValues) {
-            for (uint32_t i = 0; i < mCurrentArrayLength; i++)
-                free(mCurrentArrayValues[i].str);
-        }
         if (mEnumValues) {
             for (uint16_t i = 0; i < mEnumLength; i++)
                 free(mEnumValues[i].str);
         }
     }
-    delete[] mDefaultArrayValues;
-    delete[] mCurrentArrayValues;
     delete[] mEnumValues;
 }
 
@@ -147,11 +129,9 @@ bool MtpProperty::read(MtpDataPacket& packet) {
         case MTP_TYPE_AUINT64:
         case MTP_TYPE_AINT128:
         case MTP_TYPE_AUINT128:
-            mDefaultArrayValues = readArrayValues(packet, mDefaultArrayLength);
-            if (!mDefaultArrayValues) return false;
+            if (!readArrayValues(packet, mDefaultArray)) return false;
             if (deviceProp) {
-                mCurrentArrayValues = readArrayValues(packet, mCurrentArrayLength);
-                if (!mCurrentArrayValues) return false;
+                if (!readArrayValues(packet, mCurrentArray)) return false;
             }
             break;
         default:
@@ -183,9 +163,43 @@ bool MtpProperty::read(MtpDataPacket& packet) {
 void MtpProperty::write(MtpDataPacket& packet) {
     bool deviceProp = isDeviceProperty();
 
-    packet.putUInt16(mCode);
-    packet.putUInt16(mType);
-    packet.putUInt8(mWriteable ? 1 : 0);
+    // size the whole descriptor first so it goes in with a single reservation
+    size_t size = sizeof(mCode) + sizeof(mType) + 1;
+    switch (mType) {
+        case MTP_TYPE_AINT8:
+        case MTP_TYPE_AUINT8:
+        case MTP_TYPE_AINT16:
+        case MTP_TYPE_AUINT16:
+        case MTP_TYPE_AINT32:
+        case MTP_TYPE_AUINT32:
+        case MTP_TYPE_AINT64:
+        case MTP_TYPE_AUINT64:
+        case MTP_TYPE_AINT128:
+        case MTP_TYPE_AUINT128:
+            size += arrayValuesSize(mDefaultArray);
+            if (deviceProp)
+                size += arrayValuesSize(mCurrentArray);
+            break;
+        default:
+            size += valueSize(mDefaultValue);
+            if (deviceProp)
+                size += valueSize(mCurrentValue);
+    }
+    if (!deviceProp)
+        size += sizeof(mGroupCode);
+    size += sizeof(mFormFlag);
+    if (mFormFlag == kFormRange) {
+        size += valueSize(mMinimumValue) + valueSize(mMaximumValue) + valueSize(mStepSize);
+    } else if (mFormFlag == kFormEnum) {
+        size += sizeof(mEnumLength);
+        for (int i = 0; i < mEnumLength; i++)
+            size += valueSize(mEnumValues[i]);
+    }
+
+    MtpDatasetWriter writer = packet.beginDataset(size);
+    writer.putUInt16(mCode);
+    writer.putUInt16(mType);
+    writer.putUInt8(mWriteable ? 1 : 0);
 
     switch (mType) {
         case MTP_TYPE_AINT8:
@@ -198,27 +212,28 @@ void MtpProperty::write(MtpDataPacket& packet) {
         case MTP_TYPE_AUINT64:
         case MTP_TYPE_AINT128:
         case MTP_TYPE_AUINT128:
-            writeArrayValues(packet, mDefaultArrayValues, mDefaultArrayLength);
+            writeArrayValues(writer, mDefaultArray);
             if (deviceProp)
-                writeArrayValues(packet, mCurrentArrayValues, mCurrentArrayLength);
+                writeArrayValues(writer, mCurrentArray);
             break;
         default:
-            writeValue(packet, mDefaultValue);
+            writeValue(writer, mDefaultValue);
             if (deviceProp)
-                writeValue(packet, mCurrentValue);
+                writeValue(writer, mCurrentValue);
     }
     if (!deviceProp)
-        packet.putUInt32(mGroupCode);
-    packet.putUInt8(mFormFlag);
+        writer.putUInt32(mGroupCode);
+    writer.putUInt8(mFormFlag);
     if (mFormFlag == kFormRange) {
-            writeValue(packet, mMinimumValue);
-            writeValue(packet, mMaximumValue);
-            writeValue(packet, mStepSize);
+            writeValue(writer, mMinimumValue);
+            writeValue(writer, mMaximumValue);
+            writeValue(writer, mStepSize);
     } else if (mFormFlag == kFormEnum) {
-        packet.putUInt16(mEnumLength);
+        writer.putUInt16(mEnumLength);
         for (int i = 0; i < mEnumLength; i++)
-            writeValue(packet, mEnumValues[i]);
+            writeValue(writer, mEnumValues[i]);
     }
+    packet.endDataset(writer);
 }
 
 void MtpProperty::setDefaultValue(const uint16_t* string) {
@@ -252,6 +267,10 @@ void MtpProperty::setCurrentValue(const char* string) {
 }
 
 void MtpProperty::setCurrentValue(MtpDataPacket& packet) {
+    if (mType >= MTP_TYPE_AINT8 && mType <= MTP_TYPE_AUINT128) {
+        readArrayValues(packet, mCurrentArray);
+        return;
+    }
     free(mCurrentValue.str);
     mCurrentValue.str = NULL;
     readValue(packet, mCurrentValue);
@@ -501,85 +520,117 @@ bool MtpProperty::readValue(MtpDataPacket& packet, MtpPropertyValue& value) {
     return true;
 }
 
-void MtpProperty::writeValue(MtpDataPacket& packet, MtpPropertyValue& value) {
-    MtpStringBuffer stringBuffer;
+size_t MtpProperty::valueSize(const MtpPropertyValue& value) {
+    switch (mType) {
+        case MTP_TYPE_INT8:
+        case MTP_TYPE_AINT8:
+        case MTP_TYPE_UINT8:
+        case MTP_TYPE_AUINT8:
+            return 1;
+        case MTP_TYPE_INT16:
+        case MTP_TYPE_AINT16:
+        case MTP_TYPE_UINT16:
+        case MTP_TYPE_AUINT16:
+            return 2;
+        case MTP_TYPE_INT32:
+        case MTP_TYPE_AINT32:
+        case MTP_TYPE_UINT32:
+        case MTP_TYPE_AUINT32:
+            return 4;
+        case MTP_TYPE_INT64:
+        case MTP_TYPE_AINT64:
+        case MTP_TYPE_UINT64:
+        case MTP_TYPE_AUINT64:
+            return 8;
+        case MTP_TYPE_INT128:
+        case MTP_TYPE_AINT128:
+        case MTP_TYPE_UINT128:
+        case MTP_TYPE_AUINT128:
+            return 16;
+        case MTP_TYPE_STR:
+            return MtpDatasetWriter::stringSize(value.str ? strlen(value.str) : 0);
+        default:
+            return 0;
+    }
+}
 
+void MtpProperty::writeValue(MtpDatasetWriter& writer, MtpPropertyValue& value) {
     switch (mType) {
         case MTP_TYPE_INT8:
         case MTP_TYPE_AINT8:
-            packet.putInt8(value.u.i8);
+            writer.putInt8(value.u.i8);
             break;
         case MTP_TYPE_UINT8:
         case MTP_TYPE_AUINT8:
-            packet.putUInt8(value.u.u8);
+            writer.putUInt8(value.u.u8);
             break;
         case MTP_TYPE_INT16:
         case MTP_TYPE_AINT16:
-            packet.putInt16(value.u.i16);
+            writer.putInt16(value.u.i16);
             break;
         case MTP_TYPE_UINT16:
         case MTP_TYPE_AUINT16:
-            packet.putUInt16(value.u.u16);
+            writer.putUInt16(value.u.u16);
             break;
         case MTP_TYPE_INT32:
         case MTP_TYPE_AINT32:
-            packet.putInt32(value.u.i32);
+            writer.putInt32(value.u.i32);
             break;
         case MTP_TYPE_UINT32:
         case MTP_TYPE_AUINT32:
-            packet.putUInt32(value.u.u32);
+            writer.putUInt32(value.u.u32);
             break;
         case MTP_TYPE_INT64:
         case MTP_TYPE_AINT64:
-            packet.putInt64(value.u.i64);
+            writer.putInt64(value.u.i64);
             break;
         case MTP_TYPE_UINT64:
         case MTP_TYPE_AUINT64:
-            packet.putUInt64(value.u.u64);
+            writer.putUInt64(value.u.u64);
             break;
         case MTP_TYPE_INT128:
         case MTP_TYPE_AINT128:
-            packet.putInt128(value.u.i128);
+            writer.putInt128(value.u.i128);
             break;
         case MTP_TYPE_UINT128:
         case MTP_TYPE_AUINT128:
-            packet.putUInt128(value.u.u128);
+            writer.putUInt128(value.u.u128);
             break;
         case MTP_TYPE_STR:
             if (value.str)
-                packet.putString(value.str);
+                writer.putString(value.str);
             else
-                packet.putEmptyString();
+                writer.putEmptyString();
             break;
         default:
             fprintf(stderr, "unknown type %04X in MtpProperty::writeValue\n", mType);
     }
 }
 
-MtpPropertyValue* MtpProperty::readArrayValues(MtpDataPacket& packet, uint32_t& length) {
-    if (!packet.getUInt32(length)) return NULL;
+bool MtpProperty::readArrayValues(MtpDataPacket& packet, MtpPropertyArray& array) {
+    uint32_t length;
+    if (!packet.getUInt32(length)) return false;
+
+    // the elements are fixed size, so they come in as one block
+    MtpPropertyValue element = {};
+    const uint64_t size = (uint64_t)length * valueSize(element);
+    if (CC_UNLIKELY(size >= INT32_MAX))
+        return false;
+    const uint8_t* bytes = packet.getBytes((size_t)size);
+    if (!bytes)
+        return false;
+    array.length = length;
+    array.bytes.assign(bytes, bytes + size);
+    return true;
+}
 
-    // Fail if resulting array is over 2GB.  This is because the maximum array
-    // size may be less than SIZE_MAX on some platforms.
-    if ( CC_UNLIKELY(
-            length == 0 ||
-            length >= INT32_MAX / sizeof(MtpPropertyValue)) ) {
-        length = 0;
-        return NULL;
-    }
-    MtpPropertyValue* result = new MtpPropertyValue[length];
-    for (uint32_t i = 0; i < length; i++)
-        if (!readValue(packet, result[i])) {
-            delete [] result;
-            return NULL;
-        }
-    return result;
+size_t MtpProperty::arrayValuesSize(const MtpPropertyArray& array) {
+    return sizeof(array.length) + array.bytes.size();
 }
 
-void MtpProperty::writeArrayValues(MtpDataPacket& packet, MtpPropertyValue* values, uint32_t length) {
-    packet.putUInt32(length);
-    for (uint32_t i = 0; i < length; i++)
-        writeValue(packet, values[i]);
+void MtpProperty::writeArrayValues(MtpDatasetWriter& writer, const MtpPropertyArray& array) {
+    writer.putUInt32(array.length);
+    writer.putBytes(array.bytes.data(), array.bytes.size());
 }
 
 }  // namespace android
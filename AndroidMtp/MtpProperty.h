@@ -20,10 +20,12 @@
 #include "MtpTypes.h"
 
 #include <string>
+#include <vector>
 
 namespace android {
 
 class MtpDataPacket;
+class MtpDatasetWriter;
 
 struct MtpPropertyValue {
     union {
@@ -42,6 +44,13 @@ struct MtpPropertyValue {
     char*               str;
 };
 
+// An array value as it goes over the wire: |length| elements, packed little-endian. MTP arrays
+// only ever hold integers, so there's nothing else to keep.
+struct MtpPropertyArray {
+    uint32_t                length = 0;
+    std::vector<uint8_t>    bytes;
+};
+
 class MtpProperty {
 public:
     MtpPropertyCode     mCode;
@@ -51,10 +60,8 @@ public:
     MtpPropertyValue    mCurrentValue;
 
     // for array types
-    uint32_t            mDefaultArrayLength;
-    MtpPropertyValue*   mDefaultArrayValues;
-    uint32_t            mCurrentArrayLength;
-    MtpPropertyValue*   mCurrentArrayValues;
+    MtpPropertyArray    mDefaultArray;
+    MtpPropertyArray    mCurrentArray;
 
     enum {
         kFormNone = 0,
@@ -108,10 +115,12 @@ public:
 
 private:
     bool                readValue(MtpDataPacket& packet, MtpPropertyValue& value);
-    void                writeValue(MtpDataPacket& packet, MtpPropertyValue& value);
-    MtpPropertyValue*   readArrayValues(MtpDataPacket& packet, uint32_t& length);
-    void                writeArrayValues(MtpDataPacket& packet,
-                                            MtpPropertyValue* values, uint32_t length);
+    void                writeValue(MtpDatasetWriter& writer, MtpPropertyValue& value);
+    bool                readArrayValues(MtpDataPacket& packet, MtpPropertyArray& array);
+    void                writeArrayValues(MtpDatasetWriter& writer, const MtpPropertyArray& array);
+    // bytes writeValue() and writeArrayValues() will take
+    size_t              valueSize(const MtpPropertyValue& value);
+    size_t              arrayValuesSize(const MtpPropertyArray& array);
     void                print(MtpPropertyValue& value, std::string& buffer);
 };
 
@@ -0,0 +1,190 @@
+//
+//  MtpPropertyCache.cpp
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#define LOG_TAG "MtpPropertyCache"
+
+#include "MtpPropertyCache.h"
+#include "MtpDataPacket.h"
+#include "MtpDataset.h"
+#include "MtpStringBuffer.h"
+#include "MtpStringPool.h"
+#include "MtpUtils.h"
+#include "mtp.h"
+
+#include <stdio.h>
+
+namespace android {
+
+bool MtpPropertyCache::lookup(MtpObjectHandle handle, MtpObjectProperty code,
+                              Value& value) const {
+    std::lock_guard<std::mutex> lg(mMutex);
+    auto object = mObjects.find(handle);
+    if (object == mObjects.end())
+        return false;
+    for (const Entry& entry : object->second) {
+        if (entry.code == code) {
+            value = entry.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void MtpPropertyCache::store(MtpObjectHandle handle, MtpObjectProperty code,
+                             const Value& value) {
+    std::lock_guard<std::mutex> lg(mMutex);
+    std::vector<Entry>& entries = mObjects[handle];
+    for (Entry& entry : entries) {
+        if (entry.code == code) {
+            entry.value = value;
+            return;
+        }
+    }
+    entries.push_back({ code, value });
+}
+
+bool MtpPropertyCache::read(MtpObjectHandle handle, MtpObjectProperty code, MtpDataType type,
+                            MtpDataPacket& packet, MtpStringPool& strings) {
+    Value value;
+    value.type = type;
+    value.length = 0;
+    value.integer[0] = value.integer[1] = 0;
+
+    switch (type) {
+        case MTP_TYPE_INT8:
+        case MTP_TYPE_UINT8: {
+            uint8_t v;
+            if (!packet.getUInt8(v)) return false;
+            value.integer[0] = type == MTP_TYPE_INT8 ? (uint64_t)(int8_t)v : v;
+            break;
+        }
+        case MTP_TYPE_INT16:
+        case MTP_TYPE_UINT16: {
+            uint16_t v;
+            if (!packet.getUInt16(v)) return false;
+            value.integer[0] = type == MTP_TYPE_INT16 ? (uint64_t)(int16_t)v : v;
+            break;
+        }
+        case MTP_TYPE_INT32:
+        case MTP_TYPE_UINT32: {
+            uint32_t v;
+            if (!packet.getUInt32(v)) return false;
+            value.integer[0] = type == MTP_TYPE_INT32 ? (uint64_t)(int32_t)v : v;
+            break;
+        }
+        case MTP_TYPE_INT64:
+        case MTP_TYPE_UINT64:
+            if (!packet.getUInt64(value.integer[0])) return false;
+            break;
+        case MTP_TYPE_INT128:
+        case MTP_TYPE_UINT128: {
+            uint128_t v;
+            if (!packet.getUInt128(v)) return false;
+            value.integer[0] = ((uint64_t)v[1] << 32) | v[0];
+            value.integer[1] = ((uint64_t)v[3] << 32) | v[2];
+            break;
+        }
+        case MTP_TYPE_STR: {
+            MtpStringBuffer string;
+            if (!packet.getString(string)) return false;
+            if (isDate(code)) {
+                time_t seconds;
+                if (!parseDateTime((const char *)string, seconds))
+                    return true;
+                value.type = MTP_TYPE_INT64;
+                value.integer[0] = (uint64_t)(int64_t)seconds;
+                break;
+            }
+            // the pool never lets go of anything, so only names, which are shared with the
+            // object infos, go there
+            if (code != MTP_PROPERTY_OBJECT_FILE_NAME && code != MTP_PROPERTY_NAME)
+                return true;
+            std::string_view interned =
+                    strings.intern(std::string_view((const char *)string, string.size()));
+            value.string = interned.data();
+            value.length = (uint32_t)interned.size();
+            break;
+        }
+        case MTP_TYPE_AINT8:
+        case MTP_TYPE_AUINT8:
+        case MTP_TYPE_AINT16:
+        case MTP_TYPE_AUINT16:
+        case MTP_TYPE_AINT32:
+        case MTP_TYPE_AUINT32:
+        case MTP_TYPE_AINT64:
+        case MTP_TYPE_AUINT64:
+        case MTP_TYPE_AINT128:
+        case MTP_TYPE_AUINT128: {
+            uint32_t length;
+            if (!packet.getUInt32(length)) return false;
+            return packet.getBytes((size_t)length * mtpElementSize(type)) != NULL;
+        }
+        default:
+            fprintf(stderr, "unknown type %04X in MtpPropertyCache::read\n", type);
+            return false;
+    }
+    store(handle, code, value);
+    return true;
+}
+
+bool MtpPropertyCache::readPropertyList(MtpDataPacket& packet, MtpStringPool& strings) {
+    uint32_t count;
+    if (!packet.getUInt32(count))
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        MtpObjectHandle handle;
+        uint16_t code, type;
+        if (!packet.getUInt32(handle) || !packet.getUInt16(code) || !packet.getUInt16(type))
+            return false;
+        if (!read(handle, code, type, packet, strings))
+            return false;
+    }
+    return true;
+}
+
+void MtpPropertyCache::invalidate(MtpObjectHandle handle) {
+    std::lock_guard<std::mutex> lg(mMutex);
+    mObjects.erase(handle);
+}
+
+void MtpPropertyCache::clear() {
+    std::lock_guard<std::mutex> lg(mMutex);
+    mObjects.clear();
+}
+
+bool MtpPropertyCache::isDate(MtpObjectProperty code) {
+    return code == MTP_PROPERTY_DATE_CREATED || code == MTP_PROPERTY_DATE_MODIFIED ||
+            code == MTP_PROPERTY_DATE_ADDED;
+}
+
+MtpDataType MtpPropertyCache::standardType(MtpObjectProperty code) {
+    switch (code) {
+        case MTP_PROPERTY_STORAGE_ID:
+        case MTP_PROPERTY_ASSOCIATION_DESC:
+        case MTP_PROPERTY_PARENT_OBJECT:
+            return MTP_TYPE_UINT32;
+        case MTP_PROPERTY_OBJECT_FORMAT:
+        case MTP_PROPERTY_PROTECTION_STATUS:
+        case MTP_PROPERTY_ASSOCIATION_TYPE:
+            return MTP_TYPE_UINT16;
+        case MTP_PROPERTY_OBJECT_SIZE:
+            return MTP_TYPE_UINT64;
+        case MTP_PROPERTY_PERSISTENT_UID:
+            return MTP_TYPE_UINT128;
+        case MTP_PROPERTY_OBJECT_FILE_NAME:
+        case MTP_PROPERTY_DATE_CREATED:
+        case MTP_PROPERTY_DATE_MODIFIED:
+        case MTP_PROPERTY_KEYWORDS:
+        case MTP_PROPERTY_NAME:
+        case MTP_PROPERTY_DATE_ADDED:
+            return MTP_TYPE_STR;
+        default:
+            return MTP_TYPE_UNDEFINED;
+    }
+}
+
+}  // namespace android
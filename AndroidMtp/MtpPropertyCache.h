@@ -0,0 +1,77 @@
+//
+//  MtpPropertyCache.h
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#ifndef _MTP_PROPERTY_CACHE_H
+#define _MTP_PROPERTY_CACHE_H
+
+#include "MtpTypes.h"
+
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+
+class MtpDataPacket;
+class MtpStringPool;
+
+// Object property values by handle and property code, as the device last reported them.
+// Integers up to 128 bits are held inline and names in a string pool, so a value is a fixed
+// 24 bytes with nothing of its own to free. Dates are parsed into seconds since the epoch and
+// kept as MTP_TYPE_INT64, since nearly every one of them is different. Other strings and
+// arrays aren't kept.
+class MtpPropertyCache {
+public:
+    struct Value {
+        MtpDataType         type;
+        uint32_t            length;         // of the string
+        union {
+            uint64_t        integer[2];     // low half first
+            const char*     string;
+        };
+
+        inline uint64_t     getInteger() const { return integer[0]; }
+        inline std::string_view getString() const { return std::string_view(string, length); }
+    };
+
+private:
+    struct Entry {
+        MtpObjectProperty   code;
+        Value               value;
+    };
+
+    mutable std::mutex      mMutex;
+    // an object only has a handful of properties, so they're searched in a row
+    std::unordered_map<MtpObjectHandle, std::vector<Entry>> mObjects;
+
+public:
+    bool                    lookup(MtpObjectHandle handle, MtpObjectProperty code,
+                                   Value& value) const;
+    void                    store(MtpObjectHandle handle, MtpObjectProperty code,
+                                  const Value& value);
+    // Reads a value of |type| from |packet| and stores it, names going into |strings|,
+    // which has to outlive the entry. What isn't kept is stepped over.
+    bool                    read(MtpObjectHandle handle, MtpObjectProperty code, MtpDataType type,
+                                 MtpDataPacket& packet, MtpStringPool& strings);
+    // Stores every value of a GetObjectPropList dataset.
+    bool                    readPropertyList(MtpDataPacket& packet, MtpStringPool& strings);
+
+    // Forgets everything about |handle|.
+    void                    invalidate(MtpObjectHandle handle);
+    void                    clear();
+
+    // true for the date properties, which are stored as seconds
+    static bool             isDate(MtpObjectProperty code);
+    // Type of the standard object properties GetObjectPropValue leaves implicit, or
+    // MTP_TYPE_UNDEFINED when it depends on the device.
+    static MtpDataType      standardType(MtpObjectProperty code);
+};
+
+}; // namespace android
+
+#endif // _MTP_PROPERTY_CACHE_H
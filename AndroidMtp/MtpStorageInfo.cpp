@@ -20,11 +20,26 @@
 
 #include "MtpDebug.h"
 #include "MtpDataPacket.h"
+#include "MtpDataset.h"
 #include "MtpStorageInfo.h"
 #include "MtpStringBuffer.h"
 
 namespace android {
 
+namespace {
+
+// a StorageInfo dataset up to the strings
+typedef MtpFixedFields<
+    &MtpStorageInfo::mStorageType,
+    &MtpStorageInfo::mFileSystemType,
+    &MtpStorageInfo::mAccessCapability,
+    &MtpStorageInfo::mMaxCapacity,
+    &MtpStorageInfo::mFreeSpaceBytes,
+    &MtpStorageInfo::mFreeSpaceObjects
+> StorageInfoFields;
+
+} // namespace
+
 MtpStorageInfo::MtpStorageInfo(MtpStorageID id)
     :   mStorageID(id),
         mStorageType(0),
@@ -49,12 +64,7 @@ bool MtpStorageInfo::read(MtpDataPacket& packet) {
     MtpStringBuffer string;
 
     // read the device info
-    if (!packet.getUInt16(mStorageType)) return false;
-    if (!packet.getUInt16(mFileSystemType)) return false;
-    if (!packet.getUInt16(mAccessCapability)) return false;
-    if (!packet.getUInt64(mMaxCapacity)) return false;
-    if (!packet.getUInt64(mFreeSpaceBytes)) return false;
-    if (!packet.getUInt32(mFreeSpaceObjects)) return false;
+    if (!StorageInfoFields::read(packet, *this)) return false;
 
     if (!packet.getString(string)) return false;
     mStorageDescription = strdup((const char *)string);
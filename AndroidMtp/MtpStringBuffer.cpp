@@ -16,41 +16,161 @@
 
 #define LOG_TAG "MtpStringBuffer"
 
-#include <codecvt>
-#include <locale>
+#include <stdio.h>
+#include <string.h>
 #include <string>
-#include <vector>
 
 #include "MtpDataPacket.h"
 #include "MtpStringBuffer.h"
 
 namespace {
 
-const char * utf16_cerror = "__CONVERSION_ERROR__";
-const char16_t * utf8_cerror = u"__CONVERSION_ERROR__";
+const uint32_t kReplacementCharacter = 0xFFFD;
 
-std::wstring_convert<std::codecvt_utf8_utf16<char16_t>,char16_t> gConvert(utf16_cerror, utf8_cerror);
+// UTF-16 code units as they sit in a packet, little-endian whatever the host is
+struct PacketUnits {
+    const uint8_t* bytes;
+    uint16_t operator[](size_t i) const { return (uint16_t)(bytes[2 * i] | (bytes[2 * i + 1] << 8)); }
+};
 
-static std::string utf16ToUtf8(std::u16string input_str) {
-    std::string conversion = gConvert.to_bytes(input_str);
+// UTF-16 code units in host order
+struct HostUnits {
+    const uint16_t* units;
+    uint16_t operator[](size_t i) const { return units[i]; }
+};
 
-    if (conversion == utf16_cerror) {
-        fprintf(stderr, "Unable to convert UTF-16 string to UTF-8\n");;
-        return "";
-    } else {
-        return conversion;
+// Decodes |length| UTF-16 code units into |out|, reusing its storage. Unpaired surrogates
+// become U+FFFD rather than failing the whole string.
+template <class Units>
+void utf16ToUtf8(const Units& src, size_t length, std::string& out) {
+    // every unit is at most three bytes of UTF-8, a surrogate pair four for its two units
+    out.resize(length * 3);
+    char* start = &out[0];
+    char* dst = start;
+    size_t i = 0;
+
+    while (i < length) {
+        // most names are plain ASCII, take those eight units at a time. the fixed-width
+        // loops are what compilers vectorize.
+        while (i + 8 <= length) {
+            uint16_t bits = 0;
+            for (size_t j = 0; j < 8; j++)
+                bits |= src[i + j];
+            if (bits & 0xFF80)
+                break;
+            for (size_t j = 0; j < 8; j++)
+                dst[j] = (char)src[i + j];
+            dst += 8;
+            i += 8;
+        }
+        if (i == length)
+            break;
+
+        uint32_t c = src[i++];
+        if (c < 0x80) {
+            *dst++ = (char)c;
+            continue;
+        }
+        if (c < 0x800) {
+            *dst++ = (char)(0xC0 | (c >> 6));
+            *dst++ = (char)(0x80 | (c & 0x3F));
+            continue;
+        }
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            if (c <= 0xDBFF && i < length && (src[i] & 0xFC00) == 0xDC00) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (src[i++] - 0xDC00);
+                *dst++ = (char)(0xF0 | (c >> 18));
+                *dst++ = (char)(0x80 | ((c >> 12) & 0x3F));
+                *dst++ = (char)(0x80 | ((c >> 6) & 0x3F));
+                *dst++ = (char)(0x80 | (c & 0x3F));
+                continue;
+            }
+            c = kReplacementCharacter;
+        }
+        *dst++ = (char)(0xE0 | (c >> 12));
+        *dst++ = (char)(0x80 | ((c >> 6) & 0x3F));
+        *dst++ = (char)(0x80 | (c & 0x3F));
+    }
+    out.resize(dst - start);
+}
+
+// Decodes one UTF-8 sequence at |src|, advancing it. Overlong forms, surrogates and anything
+// truncated or past U+10FFFF come back as U+FFFD with a single byte consumed.
+uint32_t decodeUtf8(const uint8_t*& src, const uint8_t* end) {
+    const uint32_t lead = *src++;
+    size_t extra;
+    uint32_t c, min;
+    if (lead < 0x80)
+        return lead;
+    else if ((lead & 0xE0) == 0xC0)
+        extra = 1, c = lead & 0x1F, min = 0x80;
+    else if ((lead & 0xF0) == 0xE0)
+        extra = 2, c = lead & 0x0F, min = 0x800;
+    else if ((lead & 0xF8) == 0xF0)
+        extra = 3, c = lead & 0x07, min = 0x10000;
+    else
+        return kReplacementCharacter;
+
+    if ((size_t)(end - src) < extra)
+        return kReplacementCharacter;
+    for (size_t i = 0; i < extra; i++) {
+        if ((src[i] & 0xC0) != 0x80)
+            return kReplacementCharacter;
+        c = (c << 6) | (src[i] & 0x3F);
     }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return kReplacementCharacter;
+    src += extra;
+    return c;
+}
+
+inline void putUnit(uint8_t*& dst, uint32_t unit) {
+    *dst++ = (uint8_t)unit;
+    *dst++ = (uint8_t)(unit >> 8);
 }
 
-static std::u16string utf8ToUtf16(std::string input_str) {
-    std::u16string conversion = gConvert.from_bytes(input_str);
+// Encodes |length| bytes of UTF-8 as UTF-16LE at |dst|, stopping before a character that
+// wouldn't fit in |maxUnits| so a surrogate pair is never split. Returns the units written;
+// |truncated| says whether all of |src| made it.
+size_t utf8ToUtf16(const char* src, size_t length, uint8_t* dst, size_t maxUnits, bool& truncated) {
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* end = in + length;
+    uint8_t* const start = dst;
+    uint8_t* const limit = dst + 2 * maxUnits;
+
+    while (in < end) {
+        // ASCII, eight bytes at a time
+        while (end - in >= 8 && limit - dst >= 16) {
+            uint8_t bits = 0;
+            for (size_t j = 0; j < 8; j++)
+                bits |= in[j];
+            if (bits & 0x80)
+                break;
+            for (size_t j = 0; j < 8; j++) {
+                dst[2 * j] = in[j];
+                dst[2 * j + 1] = 0;
+            }
+            in += 8;
+            dst += 16;
+        }
+        if (in == end)
+            break;
 
-    if (conversion == utf8_cerror) {
-        fprintf(stderr, "Unable to convert UTF-8 string to UTF-16\n");;
-        return u"";
-    } else {
-        return conversion;
+        const uint8_t* next = in;
+        const uint32_t c = decodeUtf8(next, end);
+        const size_t units = c >= 0x10000 ? 2 : 1;
+        if ((size_t)(limit - dst) < 2 * units)
+            break;
+        if (units == 2) {
+            putUnit(dst, 0xD800 + ((c - 0x10000) >> 10));
+            putUnit(dst, 0xDC00 + ((c - 0x10000) & 0x3FF));
+        } else {
+            putUnit(dst, c);
+        }
+        in = next;
     }
+    truncated = in < end;
+    return (dst - start) / 2;
 }
 
 } // namespace
@@ -77,53 +197,60 @@ void MtpStringBuffer::set(const char* src) {
 }
 
 void MtpStringBuffer::set(const uint16_t* src) {
-    mString = utf16ToUtf8(std::u16string((const char16_t*)src));
+    size_t length = 0;
+    while (src[length])
+        length++;
+    utf16ToUtf8(HostUnits{ src }, length, mString);
 }
 
 bool MtpStringBuffer::readFromPacket(MtpDataPacket* packet) {
     uint8_t count;
     if (!packet->getUInt8(count))
         return false;
+    // a buffer gets reused across fields, so an empty one mustn't keep the last value
+    mString.clear();
     if (count == 0)
         return true;
 
-    std::vector<char16_t> buffer(count);
-    for (int i = 0; i < count; i++) {
-        uint16_t ch;
-        if (!packet->getUInt16(ch))
-            return false;
-        buffer[i] = ch;
-    }
-    if (buffer[count-1] != '\0') {
-        fprintf(stderr, "Mtp string not null terminated\n");;
+    const uint8_t* units = packet->getBytes(count * 2);
+    if (!units)
+        return false;
+    if (units[count * 2 - 2] || units[count * 2 - 1]) {
+        fprintf(stderr, "Mtp string not null terminated\n");
         return false;
     }
-    mString = utf16ToUtf8(std::u16string(buffer.data()));
+    utf16ToUtf8(PacketUnits{ units }, count - 1, mString);
+    // like any C string, it ends at the first null
+    const size_t nul = mString.find('\0');
+    if (nul != std::string::npos)
+        mString.resize(nul);
     return true;
 }
 
 void MtpStringBuffer::writeToPacket(MtpDataPacket* packet) const {
-    std::u16string src16 = utf8ToUtf16(mString);
-    int count = (int)src16.length();
+    MtpDatasetWriter writer = packet->beginDataset(MtpDatasetWriter::stringSize(mString.length()));
+    writer.putString(mString);
+    packet->endDataset(writer);
+}
 
+uint8_t* MtpStringBuffer::encode(std::string_view utf8, uint8_t* dst) {
+    // the count, then up to 254 characters and the terminator
+    bool truncated;
+    size_t count = utf8ToUtf16(utf8.data(), utf8.length(), dst + 1,
+                               MTP_STRING_MAX_CHARACTER_NUMBER - 1, truncated);
     if (count == 0) {
-        packet->putUInt8(0);
-        return;
+        dst[0] = 0;
+        return dst + 1;
     }
-    packet->putUInt8(std::min(count + 1, MTP_STRING_MAX_CHARACTER_NUMBER));
+    if (truncated)
+        fprintf(stdout, "Mtp truncating long string\n");
 
-    int i = 0;
-    for (char16_t &c : src16) {
-        if (i == MTP_STRING_MAX_CHARACTER_NUMBER - 1) {
-            // Leave a slot for null termination.
-            fprintf(stdout, "Mtp truncating long string\n");
-            break;
-        }
-        packet->putUInt16(c);
-        i++;
-    }
     // only terminate with zero if string is not empty
-    packet->putUInt16(0);
+    dst[1 + count * 2] = 0;
+    dst[2 + count * 2] = 0;
+    count++;
+    dst[0] = (uint8_t)count;
+    return dst + 1 + count * 2;
 }
 
 }  // namespace android
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <string_view>
 
 // Max Character number of a MTP String
 #define MTP_STRING_MAX_CHARACTER_NUMBER             255
@@ -50,6 +51,10 @@ public:
     bool            readFromPacket(MtpDataPacket* packet);
     void            writeToPacket(MtpDataPacket* packet) const;
 
+    // Writes |utf8| at |dst| the way it goes into a packet, which takes at most
+    // MtpDatasetWriter::stringSize() bytes. Returns the end of what was written.
+    static uint8_t* encode(std::string_view utf8, uint8_t* dst);
+
     inline bool     isEmpty() const { return mString.empty(); }
     inline int      size() const { return static_cast<int>(mString.length()); }
 
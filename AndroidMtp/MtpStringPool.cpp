@@ -0,0 +1,116 @@
+//
+//  MtpStringPool.cpp
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#define LOG_TAG "MtpStringPool"
+
+#include "MtpStringPool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <functional>
+
+namespace android {
+
+MtpStringPool::MtpStringPool()
+    :   mCursor(NULL),
+        mAvailable(0),
+        mSlots(kInitialSlots),
+        mCount(0),
+        mBytes(0)
+{
+}
+
+MtpStringPool::~MtpStringPool() {
+    for (char* chunk : mChunks)
+        free(chunk);
+}
+
+std::string_view MtpStringPool::intern(std::string_view string) {
+    std::lock_guard<std::mutex> lg(mMutex);
+    return internLocked(string);
+}
+
+void MtpStringPool::intern(const std::vector<std::string_view*>& strings) {
+    std::lock_guard<std::mutex> lg(mMutex);
+    for (std::string_view* string : strings)
+        *string = internLocked(*string);
+}
+
+std::string_view MtpStringPool::internLocked(std::string_view string) {
+    if (string.empty())
+        return std::string_view("", 0);
+
+    if ((mCount + 1) * 4 > mSlots.size() * 3)
+        grow();
+
+    const size_t mask = mSlots.size() - 1;
+    size_t slot = std::hash<std::string_view>()(string) & mask;
+    while (mSlots[slot].data() != NULL) {
+        if (mSlots[slot] == string)
+            return mSlots[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    char* copy = allocate(string.size() + 1);
+    memcpy(copy, string.data(), string.size());
+    copy[string.size()] = 0;
+    mSlots[slot] = std::string_view(copy, string.size());
+    mCount++;
+    mBytes += string.size() + 1;
+    return mSlots[slot];
+}
+
+size_t MtpStringPool::size() {
+    std::lock_guard<std::mutex> lg(mMutex);
+    return mBytes;
+}
+
+char* MtpStringPool::allocate(size_t length) {
+    char* chunk;
+    // something that would waste most of a chunk gets one of its own
+    if (length > kChunkSize / 4) {
+        chunk = (char *)malloc(length);
+        if (!chunk)
+            goto fail;
+        mChunks.push_back(chunk);
+        return chunk;
+    }
+    if (length > mAvailable) {
+        chunk = (char *)malloc(kChunkSize);
+        if (!chunk)
+            goto fail;
+        mChunks.push_back(chunk);
+        mCursor = chunk;
+        mAvailable = kChunkSize;
+    }
+    chunk = mCursor;
+    mCursor += length;
+    mAvailable -= length;
+    return chunk;
+
+fail:
+    fprintf(stderr, "out of memory!\n");
+    abort();
+}
+
+void MtpStringPool::grow() {
+    std::vector<std::string_view> slots(mSlots.size() * 2);
+    const size_t mask = slots.size() - 1;
+    for (const auto& string : mSlots) {
+        if (string.data() == NULL)
+            continue;
+        size_t slot = std::hash<std::string_view>()(string) & mask;
+        while (slots[slot].data() != NULL)
+            slot = (slot + 1) & mask;
+        slots[slot] = string;
+    }
+    mSlots.swap(slots);
+}
+
+}  // namespace android
@@ -0,0 +1,60 @@
+//
+//  MtpStringPool.h
+//  kfs_mtpAndroid
+//
+//  Copyright © 2022 FadingRed LLC. All rights reserved.
+//
+
+#ifndef _MTP_STRING_POOL_H
+#define _MTP_STRING_POOL_H
+
+#include <stddef.h>
+
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+namespace android {
+
+// Interned strings for object metadata. Each distinct string is stored once, null terminated,
+// in chunks that never move, so the views handed out stay valid until the pool goes away.
+// Parsing a listing costs a chunk now and then rather than an allocation per name.
+class MtpStringPool {
+public:
+    static constexpr size_t kChunkSize = 64 * 1024;
+    static constexpr size_t kInitialSlots = 1024;
+
+private:
+    std::mutex                      mMutex;
+    std::vector<char*>              mChunks;
+    char*                           mCursor;
+    size_t                          mAvailable;
+    // open addressing, kept under 3/4 full
+    std::vector<std::string_view>   mSlots;
+    size_t                          mCount;
+    size_t                          mBytes;
+
+public:
+                                    MtpStringPool();
+    virtual                         ~MtpStringPool();
+
+                                    MtpStringPool(const MtpStringPool&) = delete;
+    MtpStringPool&                  operator=(const MtpStringPool&) = delete;
+
+    // Returns the pooled copy of |string|, adding it the first time it's seen.
+    std::string_view                intern(std::string_view string);
+    // Points each of |strings| at its pooled copy, all under one lock.
+    void                            intern(const std::vector<std::string_view*>& strings);
+
+    // bytes of string data held
+    size_t                          size();
+
+private:
+    std::string_view                internLocked(std::string_view string);
+    char*                           allocate(size_t length);
+    void                            grow();
+};
+
+}; // namespace android
+
+#endif // _MTP_STRING_POOL_H
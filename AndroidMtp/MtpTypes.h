@@ -49,10 +49,12 @@ typedef uint32_t MtpObjectHandle;
 class MtpStorage;
 class AndroidMtpDevice;
 class MtpProperty;
+class MtpObjectInfo;
 
 typedef std::vector<MtpStorage *> MtpStorageList;
 typedef std::vector<AndroidMtpDevice*> MtpDeviceList;
 typedef std::vector<MtpProperty*> MtpPropertyList;
+typedef std::vector<MtpObjectInfo*> MtpObjectInfoList;
 
 typedef std::vector<uint8_t> UInt8List;
 typedef std::vector<uint16_t> UInt16List;
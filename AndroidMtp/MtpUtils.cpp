@@ -16,6 +16,7 @@
 
 #define LOG_TAG "MtpUtils"
 
+#include <algorithm>
 #include <iostream>
 #include <dirent.h>
 #include <fcntl.h>
@@ -24,6 +25,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -53,49 +55,219 @@ second (00-59). The ".s" is optional, and represents tenths of a second.
 This is followed by a UTC offset given as "[+-]zzzz" or the literal "Z", meaning UTC.
 */
 
+namespace {
+
+// Local time offsets only change at the zone's transitions. The span of instants sharing the
+// offset of a lookup is found once, by probing localtime_r() outwards and bisecting where it
+// changes, and kept here, so a listing doesn't go through mktime()/localtime_r() and their
+// timezone locking for every object. Transitions that cancel out within kMaxProbeStep go
+// unnoticed. The zone is assumed not to change while we run.
+struct OffsetSpan {
+    int64_t     start;      // first instant, UTC
+    int64_t     end;        // one past the last
+    long        offset;
+};
+
+constexpr size_t kOffsetSpans = 16;
+constexpr int64_t kMaxProbeStep = 7 * 86400;
+// how far either side of a lookup a span is followed
+constexpr int64_t kMaxSpan = 400 * 86400;
+
+struct OffsetCache {
+    OffsetSpan spans[kOffsetSpans];
+    size_t next;
+    OffsetCache() : next(0) {
+        for (auto& span : spans)
+            span = { 0, 0, 0 };
+    }
+};
+
+thread_local OffsetCache gOffsets;
+
+inline int64_t floorDiv(int64_t a, int64_t b) {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
+
+// days since 1970-01-01 in the proleptic Gregorian calendar, from Howard Hinnant's algorithms
+int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    const int64_t era = floorDiv(year, 400);
+    const unsigned yoe = (unsigned)(year - era * 400);
+    const unsigned doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+void civilFromDays(int64_t days, int64_t& year, unsigned& month, unsigned& day) {
+    days += 719468;
+    const int64_t era = floorDiv(days, 146097);
+    const unsigned doe = (unsigned)(days - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    day = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = (int64_t)yoe + era * 400 + (month <= 2);
+}
+
+// what timegm() gives for these fields, including its carrying of out of range values
+int64_t secondsFromFields(int year, int month, int day, int hour, int minute, int second) {
+    const int64_t months = (int64_t)month - 1;
+    const int64_t y = year + floorDiv(months, 12);
+    const unsigned m = (unsigned)(months - floorDiv(months, 12) * 12) + 1;
+    const int64_t days = daysFromCivil(y, m, 1) + day - 1;
+    return days * 86400 + (int64_t)hour * 3600 + minute * 60 + second;
+}
+
+// seconds to add to the instant |seconds| to get local time, as localtime_r() sees it
+long gmtOffsetAt(time_t seconds) {
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    return tm.tm_gmtoff;
+}
+
+// what mktime() makes of the wall clock time |local|, as an offset from it
+long mktimeOffsetAt(int64_t local) {
+    int64_t year;
+    unsigned month, day;
+    const int64_t days = floorDiv(local, 86400);
+    const int64_t secs = local - days * 86400;
+    civilFromDays(days, year, month, day);
+    struct tm tm = {};
+    tm.tm_sec = (int)(secs % 60);
+    tm.tm_min = (int)(secs / 60 % 60);
+    tm.tm_hour = (int)(secs / 3600);
+    tm.tm_mday = day;
+    tm.tm_mon = month - 1;
+    tm.tm_year = (int)(year - 1900);
+    tm.tm_isdst = -1;
+    return (long)(local - (int64_t)mktime(&tm));
+}
+
+// how far from |from|, going in |direction|, the offset stops being |offset|, or kMaxSpan
+int64_t offsetChange(int64_t from, long offset, int direction) {
+    int64_t same = 0, step = 3600;
+    for (;;) {
+        if (same + step > kMaxSpan)
+            return kMaxSpan;
+        if (gmtOffsetAt((time_t)(from + direction * (same + step))) != offset)
+            break;
+        same += step;
+        step = std::min(step * 2, kMaxProbeStep);
+    }
+    int64_t changed = same + step;
+    while (changed - same > 1) {
+        const int64_t middle = same + (changed - same) / 2;
+        if (gmtOffsetAt((time_t)(from + direction * middle)) == offset)
+            same = middle;
+        else
+            changed = middle;
+    }
+    return changed;
+}
+
+// the span holding the instant |seconds|
+const OffsetSpan& offsetSpan(int64_t seconds) {
+    for (const auto& span : gOffsets.spans) {
+        if (seconds >= span.start && seconds < span.end)
+            return span;
+    }
+    OffsetSpan& span = gOffsets.spans[gOffsets.next++ % kOffsetSpans];
+    span.offset = gmtOffsetAt((time_t)seconds);
+    span.start = seconds - offsetChange(seconds, span.offset, -1) + 1;
+    span.end = seconds + offsetChange(seconds, span.offset, 1);
+    return span;
+}
+
+// seconds between UTC and local time for a wall clock time of |local|, as mktime() sees it.
+// a span only answers when |local| is a few hours inside it. near a transition a wall clock
+// time can be skipped or happen twice, and what mktime() picks then is its own business.
+long localOffset(int64_t local) {
+    const int64_t kMargin = 3 * 3600;
+    for (const auto& span : gOffsets.spans) {
+        const int64_t instant = local - span.offset;
+        if (instant - kMargin >= span.start && instant + kMargin < span.end)
+            return span.offset;
+    }
+    const long offset = mktimeOffsetAt(local);
+    // for the next ones
+    offsetSpan(local - offset);
+    return offset;
+}
+
+// seconds to add to the instant |seconds| to get local time
+long utcOffset(time_t seconds) {
+    return offsetSpan(seconds).offset;
+}
+
+inline bool readDigits(const char* s, int count, int& value) {
+    value = 0;
+    for (int i = 0; i < count; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+        value = value * 10 + (s[i] - '0');
+    }
+    return true;
+}
+
+inline void writeDigits(char* s, int count, unsigned value) {
+    for (int i = count - 1; i >= 0; i--) {
+        s[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+} // namespace
+
 bool parseDateTime(const char* dateTime, time_t& outSeconds) {
     int year, month, day, hour, minute, second;
-    if (sscanf(dateTime, "%04d%02d%02dT%02d%02d%02d",
-               &year, &month, &day, &hour, &minute, &second) != 6)
+    if (!readDigits(dateTime, 4, year) || !readDigits(dateTime + 4, 2, month) ||
+        !readDigits(dateTime + 6, 2, day) || dateTime[8] != 'T' ||
+        !readDigits(dateTime + 9, 2, hour) || !readDigits(dateTime + 11, 2, minute) ||
+        !readDigits(dateTime + 13, 2, second))
         return false;
 
     // skip optional tenth of second
     const char* tail = dateTime + 15;
     if (tail[0] == '.' && tail[1]) tail += 2;
 
-    // FIXME: "Z" means UTC, but non-"Z" doesn't mean local time.
-    // It might be that you're in Asia/Seoul on vacation and your Android
-    // device has noticed this via the network, but your camera was set to
-    // America/Los_Angeles once when you bought it and doesn't know where
-    // it is right now, so the camera says "20160106T081700-0800" but we
-    // just ignore the "-0800" and assume local time which is actually "+0900".
-    // I think to support this (without switching to Java or using icu4c)
-    // you'd want to always use timegm(3) and then manually add/subtract
-    // the UTC offset parsed from the string (taking care of wrapping).
-    // mktime(3) ignores the tm_gmtoff field, so you can't let it do the work.
-    bool useUTC = (tail[0] == 'Z');
-
-    struct tm tm = {};
-    tm.tm_sec = second;
-    tm.tm_min = minute;
-    tm.tm_hour = hour;
-    tm.tm_mday = day;
-    tm.tm_mon = month - 1;  // mktime uses months in 0 - 11 range
-    tm.tm_year = year - 1900;
-    tm.tm_isdst = -1;
-    outSeconds = useUTC ? timegm(&tm) : mktime(&tm);
-
+    // "Z" is UTC and "[+-]hhmm" says how far ahead of it the clock that wrote this was. only
+    // without either is it our local time, which is what a camera that knows no better sends.
+    const int64_t fields = secondsFromFields(year, month, day, hour, minute, second);
+    int zoneHours, zoneMinutes;
+    if (tail[0] == 'Z') {
+        outSeconds = (time_t)fields;
+    } else if ((tail[0] == '+' || tail[0] == '-') &&
+               readDigits(tail + 1, 2, zoneHours) && readDigits(tail + 3, 2, zoneMinutes)) {
+        const int64_t offset = zoneHours * 3600 + zoneMinutes * 60;
+        outSeconds = (time_t)(tail[0] == '+' ? fields - offset : fields + offset);
+    } else {
+        outSeconds = (time_t)(fields - localOffset(fields));
+    }
     return true;
 }
 
 void formatDateTime(time_t seconds, char* buffer, int bufferLength) {
-    struct tm tm;
-
-    localtime_r(&seconds, &tm);
-    snprintf(buffer, bufferLength, "%04d%02d%02dT%02d%02d%02d",
-        tm.tm_year + 1900,
-        tm.tm_mon + 1, // localtime_r uses months in 0 - 11 range
-        tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    const int64_t local = (int64_t)seconds + utcOffset(seconds);
+    const int64_t days = floorDiv(local, 86400);
+    const unsigned secs = (unsigned)(local - days * 86400);
+    int64_t year;
+    unsigned month, day;
+    civilFromDays(days, year, month, day);
+
+    if (bufferLength < 16 || year < 0 || year > 9999) {
+        snprintf(buffer, bufferLength, "%04d%02d%02dT%02d%02d%02d",
+            (int)year, month, day, secs / 3600, secs / 60 % 60, secs % 60);
+        return;
+    }
+    writeDigits(buffer, 4, (unsigned)year);
+    writeDigits(buffer + 4, 2, month);
+    writeDigits(buffer + 6, 2, day);
+    buffer[8] = 'T';
+    writeDigits(buffer + 9, 2, secs / 3600);
+    writeDigits(buffer + 11, 2, secs / 60 % 60);
+    writeDigits(buffer + 13, 2, secs % 60);
+    buffer[15] = 0;
 }
 
 int makeFolder(const char *path) {
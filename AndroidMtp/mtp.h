@@ -39,6 +39,9 @@
 
 // Maximum buffer size for a MTP packet.
 #define MTP_BUFFER_SIZE 16384
+// Upper bound for a single bulk transfer during a data phase. The actual size is picked per
+// endpoint from its max packet size and burst, see libusb_request_new().
+#define MTP_MAX_BULK_TRANSFER_SIZE (1024 * 1024)
 
 // MTP Data Types
 #define MTP_TYPE_UNDEFINED      0x0000          // Undefined
@@ -28,7 +28,11 @@
 #include <vector>
 #include <string>
 #include <cstdlib>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <unordered_map>
 
 #include <unistd.h>
@@ -45,11 +49,15 @@
 #include <pthread.h>
 
 #include <libkern/OSByteOrder.h>
+#include "mtp.h"
 #include "usbhost.h"
 
 #define USB_FEATURE_HALT    0x00
+#define USB_BULK_TRANSFER_TIMEOUT_MS    5000
+#define USB_INTERRUPT_TRANSFER_TIMEOUT_MS   0   /* events can take forever */
 
 int gMtpUSBError = 0;
+libusb_context *gMtpUSBContext = nullptr;
 
 // in case multiple lookups are made, we'll be able to separate them by key(vid+pid) combo.
 static std::unordered_map<uint64_t, std::vector<libusb_device*>> deviceMatchingCache;
@@ -172,6 +180,32 @@ void libusb_free_devices_with_vid_pid(uint16_t vendor_id, uint16_t product_id)
         libusb_unref_device(device);
 }
 
+// Picks the bulk transfer size for an endpoint. usbfs capped URBs at 16K, libusb has no such
+// limit, so scale with the bus speed and keep transfers a whole number of bursts.
+static int usb_bulk_transfer_size(libusb_device *dev, int max_packet_size, int max_burst)
+{
+    const int burst_size = max_packet_size * (max_burst + 1);
+    int size;
+
+    if (burst_size <= 0)
+        return MTP_BUFFER_SIZE;
+
+    switch (libusb_get_device_speed(dev)) {
+        case LIBUSB_SPEED_SUPER_PLUS:
+        case LIBUSB_SPEED_SUPER:
+            size = MTP_MAX_BULK_TRANSFER_SIZE;
+            break;
+        case LIBUSB_SPEED_HIGH:
+            size = MTP_MAX_BULK_TRANSFER_SIZE / 4;
+            break;
+        default:
+            size = MTP_BUFFER_SIZE;
+            break;
+    }
+    size -= size % burst_size;
+    return size < burst_size ? burst_size : size;
+}
+
 struct libusb_request*
 libusb_request_new(struct libusb_device *dev, libusb_device_handle *devh,
                    const struct libusb_endpoint_descriptor *ep_desc)
@@ -192,17 +226,73 @@ libusb_request_new(struct libusb_device *dev, libusb_device_handle *devh,
     req->dev = dev;
     req->handle = devh;
     req->max_packet_size = OSSwapHostToLittleInt16(ep_desc->wMaxPacketSize);
+    req->max_burst = 0;
+    req->type = transferType;
+    req->timeout = transferType == LIBUSB_TRANSFER_TYPE_BULK ?
+            USB_BULK_TRANSFER_TIMEOUT_MS : USB_INTERRUPT_TRANSFER_TIMEOUT_MS;
+    req->stream_timeout = req->timeout;
+    req->queue = nullptr;
     req->private_data = (void*)ep_desc;
     req->endpoint = ep_desc->bEndpointAddress;
+
+    struct libusb_ss_endpoint_companion_descriptor *ss_desc = nullptr;
+    if (libusb_get_ss_endpoint_companion_descriptor(gMtpUSBContext, ep_desc, &ss_desc) == LIBUSB_SUCCESS) {
+        req->max_burst = ss_desc->bMaxBurst;
+        libusb_free_ss_endpoint_companion_descriptor(ss_desc);
+    }
+    if (transferType == LIBUSB_TRANSFER_TYPE_BULK)
+        req->max_transfer_size = usb_bulk_transfer_size(dev, req->max_packet_size, req->max_burst);
+    else
+        req->max_transfer_size = req->max_packet_size;
     return req;
 }
 
 void
 liusb_request_free(struct libusb_request* request)
 {
+    if (request == nullptr)
+        return;
+    libusb_transfer_queue_free(request->queue);
     delete request;
 }
 
+int
+libusb_request_submit(struct libusb_request *request)
+{
+    if (request->queue == nullptr) {
+        request->queue = libusb_transfer_queue_new(request, 1, 0);
+        if (request->queue == nullptr)
+            return LIBUSB_ERROR_NO_MEM;
+    }
+    return libusb_transfer_queue_submit(request->queue, request->buffer, request->buffer_length);
+}
+
+int
+libusb_request_wait(struct libusb_request *request)
+{
+    if (request->queue == nullptr)
+        return LIBUSB_ERROR_NOT_FOUND;
+    int ret = libusb_transfer_queue_reap(request->queue, nullptr);
+    request->actual_length = ret < 0 ? 0 : ret;
+    return ret;
+}
+
+void
+libusb_request_cancel(struct libusb_request *request)
+{
+    if (request->queue)
+        libusb_transfer_queue_cancel(request->queue);
+}
+
+static void transfer_queue_abort(struct libusb_transfer_queue *queue);
+
+void
+libusb_request_abort(struct libusb_request *request)
+{
+    if (request->queue)
+        transfer_queue_abort(request->queue);
+}
+
 
 
 static int usb_endpoint_status(libusb_request* req, uint16_t* status)
@@ -253,3 +343,445 @@ void libusb_clear_stall(libusb_request* input, libusb_request* output,
     /* TODO: do we need this for INTERRUPT (ptp_usb->intep) too? */
 }
 
+/*
+ * Event thread. While it runs it is the only thread handling libusb events; everybody else
+ * blocks on the completion queue of the transfers they're waiting for. Without it, waiters
+ * pump events themselves.
+ */
+static pthread_t event_thread;
+static std::atomic<bool> event_thread_running(false);
+static int event_thread_stop = 0;
+
+static void *event_thread_main(void *arg)
+{
+    libusb_context *ctx = (libusb_context *)arg;
+    while (!event_thread_stop) {
+        int ret = libusb_handle_events_completed(ctx, &event_thread_stop);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "libusb event thread: %s\n", libusb_strerror(ret));
+            break;
+        }
+    }
+    return nullptr;
+}
+
+int
+libusb_event_thread_start(libusb_context *ctx)
+{
+    if (event_thread_running)
+        return LIBUSB_SUCCESS;
+    event_thread_stop = 0;
+    if (pthread_create(&event_thread, nullptr, event_thread_main, ctx) != 0)
+        return LIBUSB_ERROR_NO_MEM;
+    event_thread_running = true;
+    return LIBUSB_SUCCESS;
+}
+
+void
+libusb_event_thread_stop(libusb_context *ctx)
+{
+    if (!event_thread_running)
+        return;
+    event_thread_stop = 1;
+    libusb_interrupt_event_handler(ctx);
+    pthread_join(event_thread, nullptr);
+    event_thread_running = false;
+}
+
+/*
+ * Completed transfers, in completion order. Only the thread handling events pushes, and only
+ * the owner of the transfer queue pops, so a single-producer ring with atomic indices is
+ * enough. The mutex is only taken to put a waiter to sleep and to wake it up.
+ */
+struct libusb_completion_queue {
+    std::vector<struct libusb_transfer *> ring; /* power of two sized */
+    std::atomic<size_t> head;                   /* next entry to pop */
+    std::atomic<size_t> tail;                   /* next entry to push */
+    std::atomic<int> sleepers;
+    std::mutex lock;
+    std::condition_variable wakeup;
+};
+
+static void completion_queue_init(struct libusb_completion_queue *completions, int capacity)
+{
+    size_t size = 1;
+    while (size < (size_t)capacity)
+        size <<= 1;
+    completions->ring.assign(size, nullptr);
+    completions->head = 0;
+    completions->tail = 0;
+    completions->sleepers = 0;
+}
+
+static void completion_queue_push(struct libusb_completion_queue *completions,
+                                  struct libusb_transfer *transfer)
+{
+    const size_t tail = completions->tail.load(std::memory_order_relaxed);
+    // holds every transfer of the queue at once, and abandoned ones never get here
+    if (tail - completions->head.load(std::memory_order_acquire) >= completions->ring.size()) {
+        fprintf(stderr, "completion_queue_push: more completions than transfers\n");
+        abort();
+    }
+    completions->ring[tail & (completions->ring.size() - 1)] = transfer;
+    completions->tail.store(tail + 1);
+    if (completions->sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lg(completions->lock);
+        completions->wakeup.notify_all();
+    }
+}
+
+static struct libusb_transfer *completion_queue_try_pop(struct libusb_completion_queue *completions)
+{
+    const size_t head = completions->head.load(std::memory_order_relaxed);
+    if (head == completions->tail.load(std::memory_order_acquire))
+        return nullptr;
+    struct libusb_transfer *transfer = completions->ring[head & (completions->ring.size() - 1)];
+    completions->head.store(head + 1, std::memory_order_release);
+    return transfer;
+}
+
+// Blocks until a transfer completes, or for |timeout_ms| if that isn't negative. Returns NULL
+// on timeout or if events couldn't be handled.
+static struct libusb_transfer *completion_queue_pop(struct libusb_completion_queue *completions,
+                                                    int timeout_ms)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (;;) {
+        struct libusb_transfer *transfer = completion_queue_try_pop(completions);
+        if (transfer)
+            return transfer;
+        if (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline)
+            return nullptr;
+
+        if (!event_thread_running) {
+            struct timeval tv = { 0, 100 * 1000 };
+            int ret = libusb_handle_events_timeout_completed(gMtpUSBContext, &tv, nullptr);
+            if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+                return nullptr;
+            continue;
+        }
+
+        completions->sleepers++;
+        {
+            std::unique_lock<std::mutex> lk(completions->lock);
+            auto ready = [completions] {
+                return completions->head.load() != completions->tail.load();
+            };
+            if (timeout_ms < 0)
+                completions->wakeup.wait(lk, ready);
+            else
+                completions->wakeup.wait_until(lk, deadline, ready);
+        }
+        completions->sleepers--;
+    }
+}
+
+/*
+ * What a transfer's callback needs, kept apart from the queue so a transfer that
+ * libusb_transfer_queue_cancel() gave up on can outlive it: the callback then frees the
+ * transfer, its context and its staging buffer instead of reporting the completion. Only
+ * transfers into staging buffers are ever given up on.
+ */
+struct libusb_transfer_context {
+    std::mutex lock;
+    struct libusb_transfer_queue *queue; /* NULL once abandoned */
+    u_char *buffer;     /* staging buffer */
+    int external;       /* submitted with the caller's buffer rather than the staging one */
+    int delivered;      /* the callback put it on the completion queue */
+    int completed;      /* the waiter took it off again */
+};
+
+struct libusb_transfer_slot {
+    struct libusb_transfer *transfer;
+    struct libusb_transfer_context *context;
+};
+
+struct libusb_transfer_queue {
+    struct libusb_request *request;
+    int depth;
+    int transfer_size;
+    int head;           /* oldest outstanding slot */
+    int count;          /* number of outstanding slots */
+    int dead;           /* a slot couldn't be replaced, nothing more can be submitted */
+    std::vector<libusb_transfer_slot> slots;
+    struct libusb_completion_queue completions;
+};
+
+// how long libusb_transfer_queue_cancel() waits for the cancellations to land
+#define USB_CANCEL_TIMEOUT_MS   1000
+
+// runs on whichever thread handles events, normally the event thread.
+static void transfer_queue_callback(struct libusb_transfer *transfer)
+{
+    auto context = (struct libusb_transfer_context *)transfer->user_data;
+    std::unique_lock<std::mutex> lk(context->lock);
+    if (context->queue == nullptr) {
+        lk.unlock();
+        free(context->buffer);
+        delete context;
+        libusb_free_transfer(transfer);
+        return;
+    }
+    context->delivered = 1;
+    completion_queue_push(&context->queue->completions, transfer);
+}
+
+// Waits for the transfer in |slot| to come off the completion queue, for |timeout_ms| if
+// that isn't negative. Returns LIBUSB_ERROR_TIMEOUT when the time ran out and
+// LIBUSB_ERROR_IO when events couldn't be handled.
+static int transfer_queue_wait(struct libusb_transfer_queue *queue,
+                               struct libusb_transfer_slot *slot, int timeout_ms)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    // completions arrive in submission order on one endpoint, but a cancelled transfer
+    // may overtake its elders, so keep popping until ours shows up.
+    while (!slot->context->completed) {
+        struct libusb_transfer *transfer = completion_queue_pop(&queue->completions, timeout_ms);
+        if (transfer == nullptr)
+            return timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline ?
+                    LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+        ((struct libusb_transfer_context *)transfer->user_data)->completed = 1;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+static struct libusb_transfer_context *transfer_context_new(struct libusb_transfer_queue *queue)
+{
+    auto context = new libusb_transfer_context;
+    context->queue = queue;
+    context->buffer = queue->transfer_size > 0 ? (u_char*)malloc(queue->transfer_size) : nullptr;
+    context->external = 0;
+    context->delivered = 0;
+    context->completed = 0;
+    if (queue->transfer_size > 0 && context->buffer == nullptr) {
+        delete context;
+        return nullptr;
+    }
+    return context;
+}
+
+static int transfer_status_to_error(enum libusb_transfer_status status)
+{
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return LIBUSB_SUCCESS;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+struct libusb_transfer_queue*
+libusb_transfer_queue_new(struct libusb_request *request, int depth, int transfer_size)
+{
+    if (request == nullptr || depth <= 0 || transfer_size < 0)
+        return nullptr;
+
+    libusb_transfer_queue *queue = new libusb_transfer_queue;
+    queue->request = request;
+    queue->depth = depth;
+    queue->transfer_size = transfer_size;
+    queue->head = 0;
+    queue->count = 0;
+    queue->dead = 0;
+    queue->slots.resize(depth, libusb_transfer_slot{ nullptr, nullptr });
+    // at most one completion per slot is waiting at a time
+    completion_queue_init(&queue->completions, depth);
+
+    for (auto &slot : queue->slots) {
+        slot.transfer = libusb_alloc_transfer(0);
+        slot.context = transfer_context_new(queue);
+        if (slot.transfer == nullptr || slot.context == nullptr) {
+            D("transfer queue allocation failed\n");
+            libusb_transfer_queue_free(queue);
+            return nullptr;
+        }
+    }
+    return queue;
+}
+
+// The waiter owns the queue's bookkeeping, so only poke the transfers themselves.
+// Cancelling one that isn't in flight just fails with LIBUSB_ERROR_NOT_FOUND.
+static void transfer_queue_abort(struct libusb_transfer_queue *queue)
+{
+    for (auto &slot : queue->slots) {
+        if (slot.transfer)
+            libusb_cancel_transfer(slot.transfer);
+    }
+}
+
+// Waits for a cancelled transfer into the caller's memory to land, however long it takes.
+// libusb calls back every cancelled transfer eventually, with LIBUSB_TRANSFER_NO_DEVICE if
+// the device went away; returning before that would leave it writing into memory the caller
+// has moved on from, so when events can't be handled there's nothing left but to stop.
+static void transfer_queue_reclaim(struct libusb_transfer_queue *queue,
+                                   struct libusb_transfer_slot *slot)
+{
+    for (;;) {
+        const int ret = transfer_queue_wait(queue, slot, USB_CANCEL_TIMEOUT_MS);
+        if (ret == LIBUSB_SUCCESS)
+            return;
+        if (ret != LIBUSB_ERROR_TIMEOUT) {
+            fprintf(stderr, "libusb_transfer_queue_cancel: a transfer into the caller's buffer "
+                    "can't be reclaimed\n");
+            abort();
+        }
+        fprintf(stderr, "libusb_transfer_queue_cancel: still waiting for a cancelled transfer\n");
+        libusb_cancel_transfer(slot->transfer);
+    }
+}
+
+// Cancels everything in flight and waits for the cancellations to land, leaving the queue
+// empty and ready for reuse. Transfers into staging buffers that don't land within
+// USB_CANCEL_TIMEOUT_MS are abandoned to free themselves; those into a caller's buffer are
+// waited for, see transfer_queue_reclaim(). A queue whose abandoned slot couldn't be
+// replaced is dead, and only good for libusb_transfer_queue_free().
+void
+libusb_transfer_queue_cancel(struct libusb_transfer_queue *queue)
+{
+    for (int i = 0; i < queue->count; i++)
+        libusb_cancel_transfer(queue->slots[(queue->head + i) % queue->depth].transfer);
+    for (int i = 0; i < queue->count; i++) {
+        auto &slot = queue->slots[(queue->head + i) % queue->depth];
+        if (slot.context->external) {
+            transfer_queue_reclaim(queue, &slot);
+            continue;
+        }
+        if (transfer_queue_wait(queue, &slot, USB_CANCEL_TIMEOUT_MS) == LIBUSB_SUCCESS)
+            continue;
+        {
+            std::lock_guard<std::mutex> lg(slot.context->lock);
+            // it landed after all, and is picked up below
+            if (slot.context->delivered)
+                continue;
+            slot.context->queue = nullptr;
+        }
+        fprintf(stderr, "libusb_transfer_queue_cancel: abandoning in-flight transfer\n");
+        slot.transfer = libusb_alloc_transfer(0);
+        slot.context = transfer_context_new(queue);
+        if (slot.transfer == nullptr || slot.context == nullptr) {
+            fprintf(stderr, "libusb_transfer_queue_cancel: out of memory replacing it\n");
+            queue->dead = 1;
+        }
+    }
+    // whatever is left belongs to transfers that are done
+    while (completion_queue_try_pop(&queue->completions) != nullptr)
+        ;
+    queue->head = 0;
+    queue->count = 0;
+}
+
+void
+libusb_transfer_queue_free(struct libusb_transfer_queue *queue)
+{
+    if (queue == nullptr)
+        return;
+
+    // the transfers still reference our buffers, so nothing can be released while in flight.
+    libusb_transfer_queue_cancel(queue);
+    for (auto &slot : queue->slots) {
+        if (slot.transfer)
+            libusb_free_transfer(slot.transfer);
+        if (slot.context) {
+            free(slot.context->buffer);
+            delete slot.context;
+        }
+    }
+    delete queue;
+}
+
+int
+libusb_transfer_queue_pending(struct libusb_transfer_queue *queue)
+{
+    return queue->count;
+}
+
+int
+libusb_transfer_queue_depth(struct libusb_transfer_queue *queue)
+{
+    return queue->depth;
+}
+
+// staging buffer of the slot the next submit will use, so it can be filled in place.
+u_char*
+libusb_transfer_queue_next_buffer(struct libusb_transfer_queue *queue)
+{
+    if (queue->dead || queue->count == queue->depth)
+        return nullptr;
+    return queue->slots[(queue->head + queue->count) % queue->depth].context->buffer;
+}
+
+// Queues a transfer of |length| bytes. A NULL |buffer| means the slot's staging buffer.
+int
+libusb_transfer_queue_submit(struct libusb_transfer_queue *queue, u_char *buffer, int length)
+{
+    if (queue->dead)
+        return LIBUSB_ERROR_NO_MEM;
+    if (queue->count == queue->depth)
+        return LIBUSB_ERROR_BUSY;
+    if (buffer == nullptr && length > queue->transfer_size)
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    auto &slot = queue->slots[(queue->head + queue->count) % queue->depth];
+    if (queue->request->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        libusb_fill_interrupt_transfer(slot.transfer,
+                                       queue->request->handle,
+                                       queue->request->endpoint,
+                                       buffer ? buffer : slot.context->buffer,
+                                       length,
+                                       transfer_queue_callback,
+                                       slot.context,
+                                       queue->request->timeout);
+    else
+        /* queued transfers are part of a flowing data phase. the clock starts at submission,
+           so leave room for the ones ahead of this one */
+        libusb_fill_bulk_transfer(slot.transfer,
+                                  queue->request->handle,
+                                  queue->request->endpoint,
+                                  buffer ? buffer : slot.context->buffer,
+                                  length,
+                                  transfer_queue_callback,
+                                  slot.context,
+                                  queue->request->stream_timeout * (queue->count + 1));
+    slot.context->external = buffer != nullptr && buffer != slot.context->buffer;
+    slot.context->delivered = 0;
+    slot.context->completed = 0;
+
+    int ret = libusb_submit_transfer(slot.transfer);
+    if (ret != LIBUSB_SUCCESS)
+        return ret;
+    queue->count++;
+    return LIBUSB_SUCCESS;
+}
+
+// Waits for the oldest outstanding transfer and returns the number of bytes it moved,
+// or a negative libusb error. |buffer| is pointed at the transfer's data.
+int
+libusb_transfer_queue_reap(struct libusb_transfer_queue *queue, u_char **buffer)
+{
+    if (queue->count == 0)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    auto &slot = queue->slots[queue->head];
+    int ret = transfer_queue_wait(queue, &slot, -1);
+    if (ret != LIBUSB_SUCCESS)
+        return ret; // still in flight; libusb_transfer_queue_free() cancels it
+    queue->head = (queue->head + 1) % queue->depth;
+    queue->count--;
+
+    ret = transfer_status_to_error(slot.transfer->status);
+    if (ret != LIBUSB_SUCCESS)
+        return ret;
+    if (buffer)
+        *buffer = slot.transfer->buffer;
+    return slot.transfer->actual_length;
+}
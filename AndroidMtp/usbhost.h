@@ -36,20 +36,33 @@ enum {
 };
 
 extern int gMtpUSBError;
+/* context the device was opened under, used when pumping libusb events. NULL is the default context */
+extern libusb_context *gMtpUSBContext;
+
+/*
+ * A fixed number of heap allocated bulk or interrupt transfers kept in flight on one endpoint.
+ * Transfers on an endpoint complete in the order they were submitted, so reaping always
+ * hands back the oldest outstanding transfer. A transfer_size of 0 creates a queue without
+ * staging buffers, for callers that always submit their own.
+ */
+struct libusb_transfer_queue;
 
 struct libusb_request
 {
     libusb_device *dev;
     libusb_device_handle *handle;
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_cond_t cond;
-    bool waiting = false;
     u_char* buffer;
     int buffer_length;
     int actual_length;
     int max_packet_size;
+    int max_burst;          /* bMaxBurst from the SuperSpeed companion descriptor, 0 otherwise */
+    int max_transfer_size;  /* preferred size of one bulk transfer, a multiple of max_packet_size */
     void *private_data; /* struct usbdevfs_urb* */
+    struct libusb_transfer_queue *queue; /* single transfer used by libusb_request_submit() */
+    unsigned int timeout;   /* milliseconds, 0 waits forever */
+    unsigned int stream_timeout; /* per transfer once a data phase is flowing, see MtpPacket::transfer() */
     char endpoint;
+    char type;              /* LIBUSB_TRANSFER_TYPE_BULK or LIBUSB_TRANSFER_TYPE_INTERRUPT */
     void *client_data;  /* free for use by client */
 };
 
@@ -63,10 +76,43 @@ struct libusb_request*
 libusb_request_new(struct libusb_device *dev, libusb_device_handle *devh, const struct libusb_endpoint_descriptor *ep_desc);
 void
 liusb_request_free(struct libusb_request*);
+/* asynchronous transfer of request->buffer; libusb_request_wait() returns its length or an error */
+int
+libusb_request_submit(struct libusb_request *request);
+int
+libusb_request_wait(struct libusb_request *request);
+void
+libusb_request_cancel(struct libusb_request *request);
+/* like libusb_request_cancel(), but doesn't wait; safe to call while another thread waits */
+void
+libusb_request_abort(struct libusb_request *request);
+
+/* runs libusb_handle_events() on its own thread so waiters only block on their completions */
+int
+libusb_event_thread_start(libusb_context *ctx);
+void
+libusb_event_thread_stop(libusb_context *ctx);
 void
 libusb_clear_stall(libusb_request* input, libusb_request* output,
                    __unused libusb_request *intr);
 
+struct libusb_transfer_queue*
+libusb_transfer_queue_new(struct libusb_request *request, int depth, int transfer_size);
+void
+libusb_transfer_queue_free(struct libusb_transfer_queue *queue);
+void
+libusb_transfer_queue_cancel(struct libusb_transfer_queue *queue);
+int
+libusb_transfer_queue_pending(struct libusb_transfer_queue *queue);
+int
+libusb_transfer_queue_depth(struct libusb_transfer_queue *queue);
+u_char*
+libusb_transfer_queue_next_buffer(struct libusb_transfer_queue *queue);
+int
+libusb_transfer_queue_submit(struct libusb_transfer_queue *queue, u_char *buffer, int length);
+int
+libusb_transfer_queue_reap(struct libusb_transfer_queue *queue, u_char **buffer);
+
 
 
 #ifdef __cplusplus
@@ -8,7 +8,12 @@
 
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <libgen.h>
+#include <fnmatch.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
 #include <vector>
 #include <sstream>
 #include "AndroidMtp/MtpTypes.h"
@@ -37,20 +42,6 @@ static std::string cutLastComponent(std::string path){
     return ret;
 }
 
-std::vector<std::string>
-androidfs::getPathComponents(std::string &path) {
-    std::vector<std::string> cnlist;
-    std::string componentName;
-    std::stringstream ss(path);
-    while (std::getline(ss, componentName, '/')) {
-        // the first loop will have an empty string
-        if (componentName.empty())
-            continue;
-        cnlist.push_back(componentName);
-    }
-    return cnlist;
-}
-
 // called in mount()
 void
 androidfs::setup_root()
@@ -59,49 +50,35 @@ androidfs::setup_root()
     // set root node to name of device
     std::stringstream name;
     name << m_deviceInfo->mManufacturer<<" "<<m_deviceInfo->mModel;
-    m_root = mnode_t(ROOT_FILE_HANDLE, (char*)name.str().c_str());
+    m_root = m_nodes.create();
+    m_root->mHandle = ROOT_FILE_HANDLE;
+    auto rootName = m_strings.intern(name.str());
+    m_root->mName = rootName.data();
+    m_root->mNameLength = (uint16_t)rootName.size();
     // set type to folder
-    m_root.mAssociationType = MTP_ASSOCIATION_TYPE_GENERIC_FOLDER;
-    m_root.mFormat = MTP_FORMAT_ASSOCIATION;
-    m_root.mParent = INVALID_FILE_HANDLE;
-    m_root.mThumbFormat = 0;
-    m_root.mProtectionStatus = 0;
-    m_root.mCompressedSize = 0;
-    m_root.mThumbCompressedSize = 0;
-    m_root.mThumbPixWidth = 0;
-    m_root.mThumbPixHeight = 0;
-    m_root.mImagePixWidth = 0;
-    m_root.mImagePixHeight = 0;
-    m_root.mImagePixDepth = 0;
-    m_root.mAssociationDesc = 0;
-    m_root.mSequenceNumber = 0;
-    m_root.mDateCreated = time(nullptr);
-    m_root.mDateModified = time(nullptr);
+    m_root->mFormat = MTP_FORMAT_ASSOCIATION;
+    m_root->mParent = INVALID_FILE_HANDLE;
+    m_root->mStorageID = ROOT_STORAGE_ID;
+    m_root->mDateCreated = (uint32_t)time(nullptr);
+    m_root->mDateModified = (uint32_t)time(nullptr);
+    m_root->mFetched = true; // this directory's files are custom made so it doesn't need to be fetched
     
     // setup device storage folders
     if(!mStorageDeviceFoldersInitialized){
         for (auto storage : m_storageInfo) {
-            auto node = mnode_t(STORAGE_DEVICE_FILE_HANDLE, storage->mStorageDescription);
+            auto node = m_nodes.create();
+            auto storageName = m_strings.intern(storage->mStorageDescription);
+            node->mHandle = STORAGE_DEVICE_FILE_HANDLE;
+            node->mName = storageName.data();
+            node->mNameLength = (uint16_t)storageName.size();
             // set type to folder
-            node.mAssociationType = MTP_ASSOCIATION_TYPE_GENERIC_FOLDER;
-            node.mFormat = MTP_FORMAT_ASSOCIATION;
-            node.mParent = INVALID_FILE_HANDLE;
-            node.mThumbFormat = 0;
-            node.mProtectionStatus = 0;
-            node.mCompressedSize = 0;
-            node.mThumbCompressedSize = 0;
-            node.mThumbPixWidth = 0;
-            node.mThumbPixHeight = 0;
-            node.mImagePixWidth = 0;
-            node.mImagePixHeight = 0;
-            node.mImagePixDepth = 0;
-            node.mAssociationDesc = 0;
-            node.mSequenceNumber = 0;
-            node.mDateCreated = time(nullptr);
-            node.mDateModified = time(nullptr);
-            node.mStorageID = storage->mStorageID; // set storageId for each storage device folder
-            // initialize a new cached node and insert it
-            m_root.push_back(node);
+            node->mFormat = MTP_FORMAT_ASSOCIATION;
+            node->mParent = INVALID_FILE_HANDLE;
+            node->mDateCreated = (uint32_t)time(nullptr);
+            node->mDateModified = (uint32_t)time(nullptr);
+            node->mStorageID = storage->mStorageID; // set storageId for each storage device folder
+            node->mFetched = false; // unlike the root, its contents come from the device
+            m_nodes.appendChild(m_root, node);
         }
         mStorageDeviceFoldersInitialized = true;
     }
@@ -110,15 +87,14 @@ androidfs::setup_root()
 
 mnode_t*
 androidfs::root(){
-    return &m_root;
+    return m_root;
 }
 
 
 int
 androidfs::lookup(std::string &path, mnode_t **mnodep, fscontext_t *ctx){
-    std::istringstream ss(path);
     mnode_t *currentNode = this->root();
-    auto components = getPathComponents(path);
+    std::string_view rest(path);
     
     // TODO: fastpath (sorta) for single storage device
     // if there's only one storage device, append its name
@@ -133,10 +109,22 @@ androidfs::lookup(std::string &path, mnode_t **mnodep, fscontext_t *ctx){
 //        raise(SIGTRAP);
 //    }
     
-    for (int i = 0; i < (int)components.size(); i++) {
-        bool found = false;
+    // the same paths come back over and over, e.g. while something scans the media
+    auto cached = m_paths.find(path);
+    if (cached != m_paths.end()) {
+        *mnodep = cached->second;
+        return 0;
+    }
+    
+    while (!rest.empty()) {
+        int ret;
         mnode_t *tmpNode = nullptr;
-        std::string &componentName = components[i];
+        const size_t slash = rest.find('/');
+        const std::string_view componentName = rest.substr(0, slash);
+        rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+        // the leading slash and doubled ones make empty components
+        if (componentName.empty())
+            continue;
         // if this component isn't the last component name
         // and it isn't a folder return ENOTDIR...
         // e.g. invalid input like "/fol/fol/fol/file/fol/fol"
@@ -144,63 +132,80 @@ androidfs::lookup(std::string &path, mnode_t **mnodep, fscontext_t *ctx){
 //            return -KFSERR_NOTDIR;
 //        }
                 
+        // the same few names get probed for in every directory, no need to match them again
+        if (rememberedMiss(currentNode, componentName))
+            return KFSERR_NOENT;
+        
         // check for a cached child node matching this dir or file name.
-        tmpNode = currentNode->getChild(componentName);
+        tmpNode = m_nodes.getChild(currentNode, componentName, m_nameMatching);
         
         // if the child isn't in our cache get its object
         // then initialize a new node with the object
         if (tmpNode == nullptr) {
             // if we didn't find the directory in the special root folder, return einval.
             // The network's probably looking for something that isn't a storage device folder
-            if (currentNode == &m_root){
+            if (currentNode == m_root){
+                rememberMiss(currentNode, componentName);
                 return KFSERR_NOENT;
             }
             
             // if the directory was fetched, then the file simply doesn't exist
-            if (currentNode->mFetched)
+            if (currentNode->mFetched) {
+                rememberMiss(currentNode, componentName);
                 return KFSERR_NOENT;
+            }
             
-            // get list of handles in this directory
-            auto objList = m_device->getObjectHandles(currentNode->storageId(), MTP_GOH_ALL_FORMATS, currentNode->fileId());
+            // Finder's own files aren't worth listing the directory for
+            if (isAbsentName(componentName))
+                return KFSERR_NOENT;
             
-            // loop through object handles and cache every handle we go over...
-            // until we find our matching file
-            for (int j = 0; j < (int)objList->size(); j++) {
-                // get object info for this handle
-                auto objInfo = m_device->getObjectInfo(j);
-                // if there was an error just continue to next handle
-                if (objInfo == nullptr)
-                    continue;
-                // initialize a new cached node and insert it
-                currentNode->push_back(mnode_t(objInfo));
-                
-                // if the node matches, just set tmpNode then let the caching finish
-                if (componentName == std::string(objInfo->mName)){
-                    found = true;
-                    tmpNode = currentNode->getChild(componentName);
-                }
-                
+            // cache the whole directory, then look again
+            ret = fetchChildren(currentNode);
+            if (ret != 0)
+                return ret;
+            tmpNode = m_nodes.getChild(currentNode, componentName, m_nameMatching);
+            if (tmpNode == nullptr) {
+                rememberMiss(currentNode, componentName);
+                return KFSERR_NOENT;
             }
-            
-            if (found != true && tmpNode == nullptr)
-                return -KFSERR_NOENT;
         }
         
         currentNode = tmpNode;
     }
 
+    if (m_paths.size() >= kMaxCachedPaths)
+        m_paths.clear();
+    m_paths.emplace(path, currentNode);
     *mnodep = currentNode;
     
     return 0;
 }
 
+void
+androidfs::printTransferStats(){
+    if (!m_device) return;
+    const auto upload = m_device->getUploadStats();
+    fprintf(stdout, "%s: uploaded %llu bytes in %u objects, %.1f KB/s\n",
+            m_device->getDeviceName(), (unsigned long long)upload.bytes, upload.transfers,
+            upload.bytesPerSecond() / 1024);
+}
+
 int
 androidfs::mount(fscontext_t *ctx, char *mountPoint){
     // Connect to MTP device
     m_device = android::AndroidMtpDevice::init(ctx->device);
     if (!m_device) return false;
+    m_device->setStringPool(&m_strings);
     // open session
     m_device->initialize();
+    if (m_transferOptions.readDepth >= 0)
+        m_device->setReadQueue(m_transferOptions.readDepth, m_transferOptions.readSize ?
+                               m_transferOptions.readSize : m_device->getBulkInTransferSize());
+    if (m_transferOptions.writeDepth >= 0)
+        m_device->setWriteQueue(m_transferOptions.writeDepth);
+    fprintf(stdout, "%s: using %u byte bulk-IN and %u byte bulk-OUT transfers\n",
+            m_device->getDeviceName(), m_device->getBulkInTransferSize(),
+            m_device->getBulkOutTransferSize());
 
     // get storage info
     auto stids = m_device->getStorageIDs();
@@ -210,9 +215,18 @@ androidfs::mount(fscontext_t *ctx, char *mountPoint){
     }
     
     m_deviceInfo = m_device->getDeviceInfo(); // get device info...
+    planOperations();
     setup_root(); // setup m_root
+
+    // keep the cache in sync with changes made on the device itself
+    m_device->startEventListener([](android::MtpEventCode code, const uint32_t (&params)[3],
+                                    void *fs) {
+        static_cast<androidfs*>(fs)->handleEvent(code, params);
+    }, this);
     
-    // TODO: get capabilities...?
+    if (m_indexOptions.enabled && !buildDirectoryTree())
+        fprintf(stderr, "%s: indexing gave up, directories will be listed on demand\n",
+                m_device->getDeviceName());
     
     kfsoptions_t opts = {mountPoint};
     
@@ -248,6 +262,12 @@ androidfs::mount(fscontext_t *ctx, char *mountPoint){
     return true;
 }
 
+// ObjectInfo caps sizes at 4GB - 1, the 64-bit size property has the real one
+static bool sizeIsCapped(const mnode_t &node)
+{
+    return node.mFormat != MTP_FORMAT_ASSOCIATION && node.mObjectSize == UINT32_MAX;
+}
+
 int androidfs::getattr(const char *cpath, kfsstat_t *result, int *error, fscontext_t *context)
 {
     fs_in();
@@ -276,6 +296,10 @@ int androidfs::getattr(const char *cpath, kfsstat_t *result, int *error, fsconte
         *error = KFSERR_NOENT;
         goto out;
     } else {
+        android::MtpPropertyCache::Value size;
+        if (sizeIsCapped(*node) && hasObjectProperty(node->mFormat, MTP_PROPERTY_OBJECT_SIZE) &&
+            m_device->getObjectPropValue(node->fileId(), MTP_PROPERTY_OBJECT_SIZE, size))
+            node->mObjectSize = size.getInteger();
         result->type = KFS_REG;
         result->size = node->fileSize();
         result->mode = static_cast<kfsmode_t>(result->mode | 0644);
@@ -295,7 +319,8 @@ int androidfs::mkdir(const char *cpath, int *error, fscontext_t *context)
 {
     fs_in();
     int ret = 0, newObjectId;
-    mnode_t *parentNode, newChildNode;
+    mnode_t *parentNode;
+    android::MtpObjectInfo newObjectInfo(0); // create object
     std::string lookupPath = cutLastComponent(cpath); // cut last component
     
     raise(SIGTRAP);
@@ -307,18 +332,20 @@ int androidfs::mkdir(const char *cpath, int *error, fscontext_t *context)
     }
     
     // cannot create directory in root node!!!
-    if (parentNode == &m_root)
-        return EINVAL;
+    if (parentNode == m_root) {
+        ret = EINVAL;
+        goto out;
+    }
         
     // create associated ObjectInfo
-    newChildNode.mCompressedSize = 0;
-    newChildNode.mFormat = MTP_FORMAT_ASSOCIATION;
-    newChildNode.mProtectionStatus = 0;
-    newChildNode.mAssociationType = MTP_ASSOCIATION_TYPE_GENERIC_FOLDER;
-    newChildNode.mParent = parentNode->fileId();
-    newChildNode.mStorageID = parentNode->storageId();
-    newObjectId = m_device->sendObjectInfo(&newChildNode);
-    newChildNode.mHandle = newObjectId;
+    newObjectInfo.mCompressedSize = 0;
+    newObjectInfo.mFormat = MTP_FORMAT_ASSOCIATION;
+    newObjectInfo.mProtectionStatus = 0;
+    newObjectInfo.mAssociationType = MTP_ASSOCIATION_TYPE_GENERIC_FOLDER;
+    newObjectInfo.mParent = parentNode->fileId();
+    newObjectInfo.mStorageID = parentNode->storageId();
+    newObjectId = m_device->sendObjectInfo(&newObjectInfo);
+    newObjectInfo.mHandle = newObjectId;
     // TODO: create mnode...
     
 out:
@@ -346,10 +373,12 @@ int androidfs::unlink(const char *cpath, int *error, fscontext_t *context)
     // stuff in it, fail the delete.
     
     // delete object
-    if (m_device->deleteObject(node->fileId())){
+    if (!m_device->deleteObject(node->fileId())){
         *error = EINVAL;
         goto out;
     }
+    // drop it from the tree now rather than when the event comes in
+    removeNode(node);
 out:
     fs_out();
     return ret;
@@ -368,8 +397,9 @@ int androidfs::rename(const char *cpath, const char *newpath, int *error, fscont
 {
     fs_in();
     int ret = 0;
-    std::string path(cpath);
-    mnode_t *existingNode, newNode;
+    std::string path(cpath), fromDir(cutLastComponent(cpath)), toDir(cutLastComponent(newpath));
+    mnode_t *existingNode, *from, *to;
+    android::MtpObjectHandle handle;
     
     raise(SIGTRAP);
     
@@ -383,6 +413,7 @@ int androidfs::rename(const char *cpath, const char *newpath, int *error, fscont
         *error = ret;
         goto out;
     }
+    handle = existingNode->fileId();
     
     // check if it's modified
     if (existingNode->isModified()){
@@ -390,11 +421,30 @@ int androidfs::rename(const char *cpath, const char *newpath, int *error, fscont
         // change the modification time too.
     }
     
+    // going to another directory takes a move first
+    if (fromDir != toDir) {
+        if ((ret = lookup(fromDir, &from, context)) != 0 ||
+            (ret = lookup(toDir, &to, context)) != 0 ||
+            (ret = moveChild(from, to, handle)) != 0) {
+            *error = ret;
+            goto out;
+        }
+    }
+    
     // set the object property (the filename) then send
-    objectProp.setCurrentValue(basename((char*)newpath));
-    if (!m_device->setObjectPropValue(existingNode->fileId(), &objectProp)){
-        *error = KFSERR_IO;
-        goto out;
+    if (strcmp(basename((char*)cpath), basename((char*)newpath)) != 0) {
+        objectProp.setCurrentValue(basename((char*)newpath));
+        if (!m_device->setObjectPropValue(handle, &objectProp)){
+            *error = KFSERR_IO;
+            goto out;
+        }
+        // the node keeps the old name until the device's event comes in, but the new one
+        // mustn't be a remembered miss meanwhile
+        if (mnode_t *node = findNode(handle)) {
+            forgetPaths(node);
+            if (mnode_t *dir = parentOf(node))
+                forgetMisses(dir);
+        }
     }
     
 out:
@@ -431,7 +481,7 @@ int androidfs::create(const char *cpath, int *error, fscontext_t *context)
 {
     fs_in();
     int ret = 0, newObjectId;
-    mnode_t *parentNode, newChildNode;
+    mnode_t *parentNode;
     android::MtpObjectInfo *newObjectInfo; // create object
     std::string lookupPath = cutLastComponent(cpath); // cut last component
     
@@ -455,7 +505,7 @@ int androidfs::create(const char *cpath, int *error, fscontext_t *context)
     newObjectId = m_device->sendObjectInfo(newObjectInfo);
     newObjectInfo->mHandle = newObjectId;
     // TODO: create mnode...
-    newChildNode = mnode_t(newObjectInfo);
+    delete newObjectInfo;
 out:
     fs_out();
     return ret;
@@ -470,7 +520,9 @@ int androidfs::fsync(const char *path, int *error, fscontext_t *context)
     raise(SIGTRAP);
     
     for (auto &node : m_modifiedNodes) {
-        m_device->sendObjectInfo(node);
+        android::MtpObjectInfo info(0);
+        node->getObjectInfo(info);
+        m_device->sendObjectInfo(&info);
     }
     
     raise(SIGTRAP);
@@ -488,9 +540,19 @@ int androidfs::open(const char *cpath, int flags)
     return 0;
 }
 
-static bool read_cb(void* data, uint32_t offset, uint32_t length, void* clientBuffer)
+struct ReadWindow {
+    char   *buffer;
+    size_t  offset;
+    size_t  length;
+};
+
+static bool copyReadWindow(void *data, uint32_t offset, uint32_t length, void *clientData)
 {
-    memcpy(clientBuffer, data, length);
+    auto window = static_cast<ReadWindow*>(clientData);
+    const size_t begin = std::max<size_t>(offset, window->offset);
+    const size_t end = std::min<size_t>((size_t)offset + length, window->offset + window->length);
+    if (begin < end)
+        memcpy(window->buffer + (begin - window->offset), (char*)data + (begin - offset), end - begin);
     return true;
 }
 
@@ -508,16 +570,33 @@ int androidfs::read(const char *cpath, char *buf, size_t offset, size_t length,
         goto out;
     }
     
-    // resize our vector
-    node->mData.resize(length);
-    
-    // TODO: fix
-    if (hasPartialObjectSupport()) {
-        m_device->readPartialObject(node->mHandle, (unsigned)offset,
-                                    (unsigned)length, &size, read_cb, buf);
-    }
-    else {
-        raise(SIGTRAP);
+    switch (m_plan.read) {
+        case OperationPlan::READ_PARTIAL_32:
+            // the device writes straight into kfs' buffer. the 32 bit request can't reach past 4GB.
+            if ((uint64_t)offset + length > UINT32_MAX ||
+                !m_device->readPartialObject(node->mHandle, (uint32_t)offset, (uint32_t)length,
+                                             &size, buf)) {
+                *error = KFSERR_IO;
+                ret = -1;
+            }
+            break;
+        case OperationPlan::READ_PARTIAL_64:
+            if (!m_device->readPartialObject64(node->mHandle, offset, (unsigned)length, &size, buf)) {
+                *error = KFSERR_IO;
+                ret = -1;
+            }
+            break;
+        case OperationPlan::READ_WHOLE_OBJECT: {
+            // no ranged reads at all, so the whole object streams past and the window is kept
+            ReadWindow window = { buf, offset, length };
+            if (node->fileSize() >= UINT32_MAX ||
+                !m_device->readObject(node->mHandle, copyReadWindow, (uint32_t)node->fileSize(),
+                                      &window)) {
+                *error = KFSERR_IO;
+                ret = -1;
+            }
+            break;
+        }
     }
     
 out:
@@ -574,30 +653,16 @@ int androidfs::readdir(const char *cpath, kfscontents_t *contents, int *error, f
     
     // if the directory node is empty
     // fetch nodes from device and append them. The root node will always be populated.
-    if (node->mChildren.size() == 0 && !node->mFetched && !node->mModified){
-        // get list of handles in this directory
-        auto objList = m_device->getObjectHandles(node->storageId(), MTP_FORMAT_UNDEFINED, node->fileId());
-        
-        if (objList == nullptr){
+    if (node->childCount() == 0 && !node->mFetched && !node->mModified){
+        if (fetchChildren(node) != 0){
+            fs_out();
             return EIO;
         }
-        
-        // loop through object handles and cache every handle we go over...
-        for (int j = 0; j < (int)objList->size(); j++) {
-            // get object info for this handle
-            auto objInfo = m_device->getObjectInfo(j);
-            // if there was an error just continue to next handle
-            if (objInfo == nullptr)
-                continue;
-            // initialize a new cached node and insert it
-            node->push_back(mnode_t(objInfo));
-            // append node name
-            kfscontents_append(contents, objInfo->mName);
-        }
-        node->mFetched = true;
-    } else for (auto child : node->mChildren) {
+    }
+    
+    for (auto child : m_nodes.children(node)) {
         // append cached node names
-        kfscontents_append(contents, child.mName);
+        kfscontents_append(contents, child->mName);
     }
     
     fs_out();
@@ -612,10 +677,662 @@ int androidfs::truncate(const char *path, off_t new_size)
     return 0;
 }
 
-bool androidfs::hasPartialObjectSupport() {
-    for (auto op : *m_deviceInfo->mOperations) {
-        if (op == MTP_OPERATION_GET_PARTIAL_OBJECT_64)
+// what fetchChildren() gathers while a directory's prop list streams in
+struct ChildListing {
+    androidfs *fs;
+    mnode_t *dir;
+    std::vector<android::MtpObjectHandle> unnamed; // need a GetObjectInfo once it's in
+};
+
+bool
+androidfs::addListedChild(android::MtpObjectInfo *info, void *clientData)
+{
+    auto listing = static_cast<ChildListing *>(clientData);
+    if (info->mStorageID != 0 && (int)info->mStorageID != listing->dir->storageId()) {
+        delete info;
+        return true;
+    }
+    // the device didn't send the name. the device is busy until the listing is done,
+    // so the whole ObjectInfo has to wait until then.
+    if (info->mName.empty()) {
+        listing->unnamed.push_back(info->mHandle);
+        delete info;
+        return true;
+    }
+    listing->fs->addNode(listing->dir, info);
+    return true;
+}
+
+// Caches the children of |dir|. GetObjectPropList brings the whole directory back in one
+// transaction, and the nodes are made while it's still arriving; without it every child
+// costs a GetObjectInfo round trip.
+int
+androidfs::fetchChildren(mnode_t *dir)
+{
+    android::MtpObjectHandle parent = dir->fileId();
+    android::MtpObjectInfoList *infos = nullptr;
+    
+    if (m_plan.listing == OperationPlan::LIST_PROP_LIST) {
+        // the prop list calls the storage root 0 and takes no storage id, so a root
+        // listing covers every storage and gets filtered
+        const android::MtpObjectHandle handle = parent == MTP_PARENT_ROOT ? 0 : parent;
+        const size_t before = dir->childCount();
+        ChildListing listing = { this, dir, {} };
+        if (m_device->getObjectPropList(handle, MTP_GOH_ALL_FORMATS, MTP_GOPL_ALL_PROPERTIES, 1,
+                                        addListedChild, &listing)) {
+            for (auto unnamed : listing.unnamed) {
+                if (auto info = m_device->getObjectInfo(unnamed))
+                    addNode(dir, info);
+            }
+            dir->mFetched = true;
+            return 0;
+        }
+        // throw away what came in, it may be partial. devices that don't keep an object's
+        // properties together still work buffered.
+        // one scan of m_paths per node adds up, starting over is cheaper
+        m_paths.clear();
+        while (dir->childCount() > before)
+            removeNode(m_nodes.children(dir).back(), false);
+        infos = m_device->getObjectPropList(handle, MTP_GOH_ALL_FORMATS, MTP_GOPL_ALL_PROPERTIES, 1);
+    }
+    
+    if (infos != nullptr) {
+        m_nodes.reserveChildren(dir, infos->size());
+        for (auto info : *infos) {
+            if (info->mStorageID != 0 && (int)info->mStorageID != dir->storageId()) {
+                delete info;
+                continue;
+            }
+            // the device didn't send the name, so ask for the whole ObjectInfo
+            if (info->mName.empty()) {
+                auto full = m_device->getObjectInfo(info->mHandle);
+                delete info;
+                if (full == nullptr)
+                    continue;
+                info = full;
+            }
+            addNode(dir, info);
+        }
+        delete infos;
+    } else {
+        // get list of handles in this directory
+        auto objList = m_device->getObjectHandles(dir->storageId(), MTP_GOH_ALL_FORMATS, parent);
+        if (objList == nullptr)
+            return KFSERR_IO;
+        
+        m_nodes.reserveChildren(dir, objList->size());
+        for (auto handle : *objList) {
+            auto info = m_device->getObjectInfo(handle);
+            // if there was an error just continue to next handle
+            if (info == nullptr)
+                continue;
+            addNode(dir, info);
+        }
+        delete objList;
+        
+        // fetch the real sizes of files over 4GB in one go, getattr() finds them cached
+        std::vector<android::MtpObjectHandle> capped;
+        for (auto child : m_nodes.children(dir)) {
+            if (sizeIsCapped(*child) && hasObjectProperty(child->mFormat, MTP_PROPERTY_OBJECT_SIZE))
+                capped.push_back(child->mHandle);
+        }
+        if (!capped.empty())
+            m_device->getChildPropValues(parent == MTP_PARENT_ROOT ? 0 : parent, capped.data(),
+                                         capped.size(), MTP_PROPERTY_OBJECT_SIZE);
+    }
+    
+    dir->mFetched = true;
+    return 0;
+}
+
+// rough cost of caching |info| as a node: the record, its handle and its place in the
+// parent's children, and the name
+static size_t nodeFootprint(const android::MtpObjectInfo *info)
+{
+    return sizeof(mnode_t) + 4 * sizeof(mnodeid_t)
+        + info->mName.size() + 1;
+}
+
+// what buildDirectoryTree() gathers while the whole-device prop list streams in
+struct TreeListing {
+    android::MtpObjectInfoList infos;
+    size_t footprint;
+    const androidfs::IndexOptions *options;
+    std::chrono::steady_clock::time_point deadline;
+    bool stopped; // ran out of time or memory, the device cancelled the rest
+};
+
+static bool addListedObject(android::MtpObjectInfo *info, void *clientData)
+{
+    auto listing = static_cast<TreeListing *>(clientData);
+    listing->footprint += nodeFootprint(info);
+    // past either limit nothing gets indexed, so there's no point reading the rest
+    if (listing->footprint > listing->options->memoryLimit ||
+        std::chrono::steady_clock::now() >= listing->deadline) {
+        listing->stopped = true;
+        delete info;
+        return false;
+    }
+    listing->infos.push_back(info);
+    if (listing->options->progress && (listing->infos.size() & 0xFF) == 0)
+        listing->options->progress(listing->infos.size(), 0, listing->options->clientData);
+    return true;
+}
+
+bool
+androidfs::buildDirectoryTree()
+{
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+    const auto deadline = start + std::chrono::seconds(m_indexOptions.timeLimit);
+    std::vector<android::MtpStorageID> indexed; // storages whose listing is complete
+    android::MtpObjectInfoList *infos = nullptr;
+    size_t footprint = 0;
+    bool complete = true;
+    
+    auto progress = [this](size_t done, size_t total) {
+        if (m_indexOptions.progress)
+            m_indexOptions.progress(done, total, m_indexOptions.clientData);
+    };
+    
+    if (m_plan.listing == OperationPlan::LIST_PROP_LIST) {
+        // the whole device in one data phase, decoded as it comes in. devices that don't do
+        // arbitrary depth may still take "every object" as handle 0xFFFFFFFF at depth 0.
+        static const android::MtpObjectHandle everything[][2] = { { 0, 0xFFFFFFFF }, { 0xFFFFFFFF, 0 } };
+        TreeListing listing = { {}, 0, &m_indexOptions, deadline, false };
+        for (auto &request : everything) {
+            if (m_device->getObjectPropList(request[0], MTP_GOH_ALL_FORMATS, MTP_GOPL_ALL_PROPERTIES,
+                                            request[1], addListedObject, &listing)) {
+                infos = new android::MtpObjectInfoList(std::move(listing.infos));
+                break;
+            }
+            if (listing.stopped) {
+                // asking again, buffered or one by one, would only take longer
+                infos = new android::MtpObjectInfoList(std::move(listing.infos));
+                complete = false;
+                break;
+            }
+            // may be partial. devices that don't keep an object's properties together
+            // still work buffered.
+            for (auto info : listing.infos)
+                delete info;
+            listing.infos.clear();
+            listing.footprint = 0;
+            infos = m_device->getObjectPropList(request[0], MTP_GOH_ALL_FORMATS, MTP_GOPL_ALL_PROPERTIES,
+                                                request[1]);
+            if (infos != nullptr)
+                break;
+        }
+        if (infos != nullptr) {
+            for (auto &info : *infos) {
+                // the device didn't send the name, so ask for the whole ObjectInfo
+                if (info->mName.empty()) {
+                    if (clock::now() >= deadline)
+                        complete = false;
+                    auto full = complete ? m_device->getObjectInfo(info->mHandle) : nullptr;
+                    delete info;
+                    info = full;
+                    if (info == nullptr)
+                        continue;
+                }
+                footprint += nodeFootprint(info);
+            }
+            // counts what was dropped for going over the limit as well
+            footprint = std::max(footprint, listing.footprint);
+            if (complete) {
+                for (auto storage : m_storageInfo)
+                    indexed.push_back(storage->mStorageID);
+            }
+            progress(infos->size(), infos->size());
+        }
+    }
+    
+    if (infos == nullptr) {
+        // GetObjectHandles with parent 0 lists a whole storage, but the infos come one by one
+        infos = new android::MtpObjectInfoList();
+        for (auto storage : m_storageInfo) {
+            auto handles = m_device->getObjectHandles(storage->mStorageID, MTP_GOH_ALL_FORMATS, 0);
+            if (handles == nullptr) {
+                complete = false;
+                continue;
+            }
+            for (size_t i = 0; i < handles->size() && complete; i++) {
+                if (clock::now() >= deadline || footprint > m_indexOptions.memoryLimit) {
+                    complete = false;
+                    break;
+                }
+                auto info = m_device->getObjectInfo(handles->at(i));
+                // if there was an error just continue to next handle
+                if (info == nullptr)
+                    continue;
+                footprint += nodeFootprint(info);
+                infos->push_back(info);
+                if ((i & 0xFF) == 0)
+                    progress(i, handles->size());
+            }
+            if (complete) {
+                indexed.push_back(storage->mStorageID);
+                progress(handles->size(), handles->size());
+            }
+            delete handles;
+            if (!complete)
+                break;
+        }
+    }
+    
+    if (footprint > m_indexOptions.memoryLimit) {
+        fprintf(stderr, "index would take %zu bytes, over the %zu byte limit\n",
+                footprint, m_indexOptions.memoryLimit);
+        indexed.clear();
+        complete = false;
+    }
+    
+    // group objects under their parents. storage roots are reported as either 0 or 0xFFFFFFFF,
+    // any other handle is unique across storages.
+    std::unordered_map<android::MtpObjectHandle, std::vector<android::MtpObjectInfo*>> children;
+    for (auto info : *infos) {
+        if (info != nullptr)
+            children[info->mParent == MTP_PARENT_ROOT ? 0 : info->mParent].push_back(info);
+    }
+    delete infos;
+    
+    size_t linked = 0;
+    std::vector<mnode_t*> pending;
+    pthread_mutex_lock(&m_treeLock);
+    for (auto storage : m_nodes.children(m_root)) {
+        if (storage->mFetched ||
+            std::find(indexed.begin(), indexed.end(),
+                      (android::MtpStorageID)storage->storageId()) == indexed.end())
+            continue;
+        pending.push_back(storage);
+        while (!pending.empty()) {
+            mnode_t *dir = pending.back();
+            pending.pop_back();
+            const bool atRoot = dir == storage;
+            auto it = children.find(atRoot ? 0 : dir->fileId());
+            if (it != children.end()) {
+                m_nodes.reserveChildren(dir, it->second.size());
+                for (auto &info : it->second) {
+                    if (info == nullptr || (atRoot && (int)info->mStorageID != storage->storageId()))
+                        continue;
+                    addNode(dir, info);
+                    info = nullptr;
+                    linked++;
+                }
+            }
+            dir->mFetched = true;
+            for (auto child : m_nodes.children(dir)) {
+                if (child->isFolder() && !child->mFetched)
+                    pending.push_back(child);
+            }
+        }
+    }
+    pthread_mutex_unlock(&m_treeLock);
+    
+    // whatever is left had no reachable parent, or belongs to a storage we didn't finish
+    for (auto &entry : children) {
+        for (auto info : entry.second)
+            delete info;
+    }
+    
+    fprintf(stdout, "%s: indexed %zu objects in %lld ms\n", m_device->getDeviceName(), linked,
+            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start).count());
+    return complete;
+}
+
+mnode_t*
+androidfs::addNode(mnode_t *dir, android::MtpObjectInfo *info)
+{
+    // prop lists may leave the storage out
+    const android::MtpStorageID storageID = info->mStorageID ? info->mStorageID : dir->storageId();
+    mnode_t *node = m_nodes.find(info->mHandle);
+    if (node) {
+        // an event got here first, or it moved or was renamed
+        mnode_t *parent = parentOf(node);
+        if (parent != dir) {
+            forgetPaths(node);
+            if (parent)
+                m_nodes.removeChild(parent, node);
+            node->update(*info);
+            m_nodes.appendChild(dir, node);
+            forgetMisses(dir);
+        } else {
+            if (node->name() != info->mName) {
+                forgetPaths(node);
+                m_nodes.dropChildIndex(dir);
+                forgetMisses(dir);
+            }
+            node->update(*info);
+        }
+    } else {
+        node = m_nodes.create();
+        node->mHandle = info->mHandle;
+        node->update(*info);
+        m_nodes.index(node);
+        m_nodes.appendChild(dir, node);
+        forgetMisses(dir);
+    }
+    node->mStorageID = storageID;
+    delete info;
+    return node;
+}
+
+void
+androidfs::removeNode(mnode_t *node, bool forget)
+{
+    if (forget)
+        forgetPaths(node);
+    if (mnode_t *parent = parentOf(node))
+        m_nodes.removeChild(parent, node);
+    
+    std::vector<mnode_t*> doomed = { node };
+    while (!doomed.empty()) {
+        mnode_t *dead = doomed.back();
+        doomed.pop_back();
+        for (auto child : m_nodes.children(dead))
+            doomed.push_back(child);
+        m_modifiedNodes.erase(std::remove(m_modifiedNodes.begin(), m_modifiedNodes.end(), dead),
+                              m_modifiedNodes.end());
+        forgetMisses(dead); // the record gets reused
+        m_nodes.destroy(dead);
+    }
+}
+
+mnode_t*
+androidfs::findNode(android::MtpObjectHandle handle)
+{
+    // handles are unique across storages
+    return m_nodes.find(handle);
+}
+
+// the node objects with |parent| on |storageID| get listed under
+mnode_t*
+androidfs::findParentNode(android::MtpStorageID storageID, android::MtpObjectHandle parent)
+{
+    if (parent == 0 || parent == STORAGE_DEVICE_FILE_HANDLE) {
+        if (m_root == nullptr)
+            return nullptr;
+        for (auto storage : m_nodes.children(m_root)) {
+            if (storage->mStorageID == storageID)
+                return storage;
+        }
+        return nullptr;
+    }
+    mnode_t *node = m_nodes.find(parent);
+    return node && node->mStorageID == storageID ? node : nullptr;
+}
+
+void
+androidfs::forgetPaths(mnode_t *node)
+{
+    if (m_paths.empty())
+        return;
+    // a path is cached for the node it ends at, so collect the whole subtree
+    std::unordered_set<mnode_t*> gone;
+    std::vector<mnode_t*> pending = { node };
+    while (!pending.empty()) {
+        mnode_t *next = pending.back();
+        pending.pop_back();
+        gone.insert(next);
+        for (auto child : m_nodes.children(next))
+            pending.push_back(child);
+    }
+    for (auto it = m_paths.begin(); it != m_paths.end(); ) {
+        if (gone.count(it->second))
+            it = m_paths.erase(it);
+        else
+            ++it;
+    }
+}
+
+bool
+androidfs::isAbsentName(std::string_view name)
+{
+    const std::string string(name);
+    const int flags = m_nameMatching.caseFold ? FNM_CASEFOLD : 0;
+    for (auto &pattern : m_missOptions.absentPatterns) {
+        if (fnmatch(pattern.c_str(), string.c_str(), flags) == 0)
             return true;
     }
     return false;
 }
+
+// seconds since the first call, plenty for a ttl
+static uint32_t missClock()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+bool
+androidfs::rememberedMiss(mnode_t *dir, std::string_view name)
+{
+    auto misses = m_misses.find(dir);
+    if (misses == m_misses.end())
+        return false;
+    std::string buffer;
+    const uint32_t hash = mnodestore_t::nameHash(matchingKey(name, m_nameMatching, buffer));
+    const uint32_t now = missClock();
+    for (auto &miss : misses->second) {
+        if (miss.hash == hash && miss.expires > now)
+            return true;
+    }
+    return false;
+}
+
+void
+androidfs::rememberMiss(mnode_t *dir, std::string_view name)
+{
+    if (m_missOptions.ttl == 0)
+        return;
+    std::string buffer;
+    const uint32_t hash = mnodestore_t::nameHash(matchingKey(name, m_nameMatching, buffer));
+    // only the hash is kept, so it mustn't stand for a child that's there as well
+    if (m_nodes.hasChildHash(dir, hash, m_nameMatching))
+        return;
+    if (m_misses.size() >= kMaxMissDirectories && m_misses.find(dir) == m_misses.end())
+        m_misses.clear();
+    
+    auto &misses = m_misses[dir];
+    const uint32_t now = missClock();
+    const Miss miss = { hash, now + m_missOptions.ttl };
+    // in place of the name's last entry or one that ran out
+    for (auto &old : misses) {
+        if (old.hash == hash || old.expires <= now) {
+            old = miss;
+            return;
+        }
+    }
+    if (misses.size() < kMaxMissesPerDirectory) {
+        misses.push_back(miss);
+        return;
+    }
+    // they all live as long, so the one to go first is the oldest
+    *std::min_element(misses.begin(), misses.end(), [](const Miss &a, const Miss &b) {
+        return a.expires < b.expires;
+    }) = miss;
+}
+
+void
+androidfs::handleEvent(android::MtpEventCode code, const uint32_t (&params)[3])
+{
+    const android::MtpObjectHandle handle = params[0];
+
+    switch (code) {
+        case MTP_EVENT_OBJECT_ADDED: {
+            auto info = m_device->getObjectInfo(handle);
+            if (info == nullptr)
+                return;
+            pthread_mutex_lock(&m_treeLock);
+            mnode_t *parent = findParentNode(info->mStorageID, info->mParent);
+            // unfetched directories pick it up when they are first listed
+            if (parent && parent->mFetched)
+                addNode(parent, info);
+            else
+                delete info;
+            pthread_mutex_unlock(&m_treeLock);
+            break;
+        }
+        case MTP_EVENT_OBJECT_REMOVED: {
+            pthread_mutex_lock(&m_treeLock);
+            if (mnode_t *node = findNode(handle))
+                removeNode(node);
+            pthread_mutex_unlock(&m_treeLock);
+            break;
+        }
+        case MTP_EVENT_OBJECT_INFO_CHANGED: {
+            auto info = m_device->getObjectInfo(handle);
+            if (info == nullptr)
+                return;
+            pthread_mutex_lock(&m_treeLock);
+            // refreshed in place, moved along with what's below it, or dropped if it went
+            // somewhere that isn't cached. nodes are kept per storage, so a move to another
+            // one starts over.
+            mnode_t *node = findNode(handle);
+            if (node && node->storageId() != (int)info->mStorageID)
+                removeNode(node);
+            mnode_t *parent = findParentNode(info->mStorageID, info->mParent);
+            if (parent && parent->mFetched) {
+                addNode(parent, info);
+            } else {
+                if ((node = findNode(handle)) != nullptr)
+                    removeNode(node);
+                delete info;
+            }
+            pthread_mutex_unlock(&m_treeLock);
+            break;
+        }
+        case MTP_EVENT_STORE_FULL:
+        case MTP_EVENT_STORAGE_INFO_CHANGED: {
+            auto info = m_device->getStorageInfo(handle);
+            if (info == nullptr)
+                return;
+            pthread_mutex_lock(&m_treeLock);
+            for (auto &storage : m_storageInfo) {
+                if (storage->mStorageID == info->mStorageID) {
+                    std::swap(storage, info);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&m_treeLock);
+            delete info;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// takes what the device supports once and picks a strategy for each fs operation from it
+void
+androidfs::planOperations()
+{
+    m_capabilities = m_device->getCapabilities();
+    // objects of formats left out here get the benefit of the doubt, see hasObjectProperty()
+    if (m_capabilities.hasOperation(MTP_OPERATION_GET_OBJECT_PROPS_SUPPORTED) &&
+        m_deviceInfo && m_deviceInfo->mPlaybackFormats) {
+        for (auto format : *m_deviceInfo->mPlaybackFormats) {
+            if (auto properties = m_device->getObjectPropsSupported(format)) {
+                m_capabilities.setObjectProperties(format, *properties);
+                delete properties;
+            }
+        }
+    }
+    
+    const auto &caps = m_capabilities;
+    m_plan = OperationPlan();
+    if (caps.hasOperation(MTP_OPERATION_GET_OBJECT_PROP_LIST))
+        m_plan.listing = OperationPlan::LIST_PROP_LIST;
+    
+    if (caps.hasOperation(MTP_OPERATION_GET_PARTIAL_OBJECT_64))
+        m_plan.read = OperationPlan::READ_PARTIAL_64;
+    else if (caps.hasOperation(MTP_OPERATION_GET_PARTIAL_OBJECT))
+        m_plan.read = OperationPlan::READ_PARTIAL_32;
+    
+    // editing in place takes all four, without them a changed file is sent again whole
+    if (caps.hasOperation(MTP_OPERATION_BEGIN_EDIT_OBJECT) &&
+        caps.hasOperation(MTP_OPERATION_SEND_PARTIAL_OBJECT) &&
+        caps.hasOperation(MTP_OPERATION_TRUNCATE_OBJECT) &&
+        caps.hasOperation(MTP_OPERATION_END_EDIT_OBJECT))
+        m_plan.write = OperationPlan::WRITE_EDIT;
+    
+    if (caps.hasOperation(MTP_OPERATION_MOVE_OBJECT))
+        m_plan.move = OperationPlan::MOVE_OBJECT;
+    else if (caps.hasOperation(MTP_OPERATION_COPY_OBJECT) &&
+             caps.hasOperation(MTP_OPERATION_DELETE_OBJECT))
+        m_plan.move = OperationPlan::MOVE_COPY_DELETE;
+    
+    static const char *listings[] = { "object infos", "prop lists" };
+    static const char *reads[] = { "whole objects", "32 bit partial reads", "64 bit partial reads" };
+    static const char *writes[] = { "re-uploads", "edit ops" };
+    static const char *moves[] = { "nothing", "copy and delete", "MoveObject" };
+    fprintf(stdout, "%s: listing with %s, reading with %s, writing with %s, moving with %s\n",
+            m_device->getDeviceName(), listings[m_plan.listing], reads[m_plan.read],
+            writes[m_plan.write], moves[m_plan.move]);
+}
+
+// moves the |handle| child of |from| into |to| the way the plan says, the cached node along
+// with it. |handle| is the object's handle afterwards, which a copy changes.
+int
+androidfs::moveChild(mnode_t *from, mnode_t *to, android::MtpObjectHandle &handle)
+{
+    // the storage folders are made up, nothing can go next to them
+    if (to == m_root)
+        return KFSERR_PERM;
+    const android::MtpObjectHandle old = handle;
+    const android::MtpStorageID storageID = to->storageId();
+    // MoveObject and CopyObject call the storage root 0
+    const android::MtpObjectHandle parent = to->fileId() == STORAGE_DEVICE_FILE_HANDLE ? 0 : to->fileId();
+    
+    switch (m_plan.move) {
+        case OperationPlan::MOVE_OBJECT:
+            if (!m_device->moveObject(handle, storageID, parent))
+                return KFSERR_IO;
+            break;
+        case OperationPlan::MOVE_COPY_DELETE: {
+            const android::MtpObjectHandle copy = m_device->copyObject(handle, storageID, parent);
+            if (copy == 0)
+                return KFSERR_IO;
+            if (!m_device->deleteObject(handle)) {
+                m_device->deleteObject(copy);
+                return KFSERR_IO;
+            }
+            handle = copy;
+            break;
+        }
+        case OperationPlan::MOVE_UNSUPPORTED:
+            return KFSERR_PERM;
+    }
+    
+    mnode_t *node = findNode(old);
+    if (node == nullptr)
+        return 0;
+    if (handle == old && (android::MtpStorageID)node->storageId() == storageID) {
+        // refile it along with everything below it
+        forgetPaths(node);
+        m_nodes.removeChild(from, node);
+        node->mParent = parent;
+        m_nodes.appendChild(to, node);
+        forgetMisses(to);
+    } else {
+        // a copy has new handles all the way down, and nodes are kept per storage, so it's
+        // listed afresh
+        removeNode(node);
+        if (to->mFetched) {
+            if (auto info = m_device->getObjectInfo(handle))
+                addNode(to, info);
+        }
+    }
+    return 0;
+}
+
+// whether objects of |format| can be asked for |property|. formats the device wasn't
+// asked about are assumed to have it, the request just fails if they don't.
+bool
+androidfs::hasObjectProperty(android::MtpObjectFormat format, android::MtpObjectProperty property)
+{
+    if (!m_capabilities.knowsObjectProperties(format))
+        return true;
+    return m_capabilities.hasObjectProperty(format, property);
+}
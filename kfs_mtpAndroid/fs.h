@@ -11,12 +11,15 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <cstdlib>
 #include <sys/syslimits.h>
 #include "AndroidMtp/AndroidMtpDevice.h"
+#include "AndroidMtp/MtpCapabilities.h"
 #include "AndroidMtp/MtpDeviceInfo.h"
 #include "AndroidMtp/MtpObjectInfo.h"
+#include "AndroidMtp/MtpStringPool.h"
 
 extern "C" {
 #  include <KFS/KFS.h>
@@ -35,6 +38,8 @@ enum {
 
 // forgot what this exactly means, but i got it from libmtp
 enum { MTP_GOH_ALL_FORMATS = 0 };
+// GetObjectPropList property code asking for every property of the object
+enum : uint32_t { MTP_GOPL_ALL_PROPERTIES = 0xFFFFFFFF };
 
 // types of modification
 enum {
@@ -45,48 +50,171 @@ enum {
 
 typedef android::MtpStorageInfo *MtpStorageInfo_t;
 
-class mnode_t : public android::MtpObjectInfo {
-private:
-//    long                      m_usecount;        /* reference count of users */
-public:
-    std::vector<char>         mData;            /* data for fs read/write */
-    bool                      mFetched = false;
-    bool                      mModified = false;
-    time_t                    mDateAccessed = time(NULL);
-    std::vector<mnode_t>      mChildren;
-public:
-    mnode_t(void); // empty constructor
-    mnode_t(const mnode_t& objInfo); // copy constructor
-    mnode_t(android::MtpObjectInfo* objInfo); // copy superclass constructor
-    mnode_t(android::MtpObjectHandle handle); // superclass-like constructor
-    mnode_t(android::MtpObjectHandle handle, char *name); // custom constructor
+// how path components are matched against the names on the device. the default is byte for
+// byte; macOS expects lookups to see through normalization, and usually case too.
+struct NameMatching {
+    enum Normalization { NORMALIZE_NONE, NORMALIZE_NFC, NORMALIZE_NFD };
+
+    Normalization             normalization = NORMALIZE_NONE;
+    bool                      caseFold = false;
+
+    bool                      exact() const { return normalization == NORMALIZE_NONE && !caseFold; }
+    bool                      operator ==(const NameMatching &other) const {
+        return normalization == other.normalization && caseFold == other.caseFold;
+    }
+};
+
+// |name| in the form names are compared in under |matching|: the name itself if that
+// changes nothing, otherwise the normalized and folded name in |buffer|.
+std::string_view matchingKey(std::string_view name, const NameMatching &matching, std::string &buffer);
+
+// index of a node in an mnodestore_t
+typedef uint32_t mnodeid_t;
+enum : mnodeid_t { NO_NODE = ~0u };
+
+// What's cached of an object, 48 bytes whatever the object. The rest of its ObjectInfo stays
+// on the device: folders are the association format and always generic folders, and MTP has
+// no access time, so the modification time stands in for it.
+struct mnode_t {
+    const char               *mName;          // null terminated, in androidfs' string pool
+    uint64_t                  mObjectSize;
+    uint32_t                  mDateCreated;
+    uint32_t                  mDateModified;
+    android::MtpObjectHandle  mHandle;
+    android::MtpObjectHandle  mParent;
+    android::MtpStorageID     mStorageID;
+    uint32_t                  mFirstChild;    // the children are a range of the store's child list,
+    uint32_t                  mChildCount : 25;   // with room for (1 << mChildSpace) / 2 of them
+    uint32_t                  mChildSpace : 5;
+    uint32_t                  mFetched : 1;
+    uint32_t                  mModified : 1;
+    uint16_t                  mNameLength;
+    android::MtpObjectFormat  mFormat;
 
 public:
-    void                  push_back(mnode_t node);
-    mnode_t*              getChild(const std::string &childName);
+    void                  update(const android::MtpObjectInfo& info); // refresh from the device's copy
+    // the ObjectInfo dataset for sending the node back to the device
+    void                  getObjectInfo(android::MtpObjectInfo& info) const;
     
 public:
-    const std::string     name()         { return mName; }
-    int                   nodeType()     { return mAssociationType; }
+    std::string_view      name()         { return std::string_view(mName, mNameLength); }
+    int                   nodeType()     { return isFolder() ? MTP_ASSOCIATION_TYPE_GENERIC_FOLDER : 0; }
     int                   fileId()       { return mHandle; }
-    int                   fileSize()     { return mCompressedSize; }
+    uint64_t              fileSize()     { return mObjectSize; }
     int                   storageId()    { return mStorageID; }
-    time_t                dateAccessed() { return mDateAccessed; }
+    time_t                dateAccessed() { return mDateModified; }
     time_t                dateModified() { return mDateModified; }
     time_t                dateCreated()  { return mDateCreated; }
     bool                  isModified()   { return mModified; }
+    size_t                childCount()   { return mChildCount; }
     
 public:
     bool                  isFolder(){ return mFormat == MTP_FORMAT_ASSOCIATION; }
 
 public:
-    void                  setmtime(time_t tm) { mDateModified = tm; }
-    void                  setatime(time_t tm) { mDateAccessed = tm; }
-    
+    void                  setmtime(time_t tm) { mDateModified = (uint32_t)tm; }
+    void                  setatime(time_t) { }    // mtp has no access time
+};
+static_assert(sizeof(mnode_t) == 48, "mnode_t is meant to stay small, there's one per object");
+
+// Every cached node. The records are allocated in chunks that never move, so a node keeps its
+// index and address for as long as it's cached and nothing is ever copied as the tree grows.
+// A directory's children are a run of indices in one shared list, and nodes are found by handle
+// through an open addressing table of indices, so a file costs its record and about 16 bytes.
+class mnodestore_t {
 public:
-    mnode_t&              operator [](int i)       { return mChildren[i]; }
-    mnode_t               operator [](int i) const { return mChildren[i]; }
+    // the children of a directory, in the order they were added
+    class children_t {
+        mnodestore_t         *mStore;
+        const mnode_t        *mDir;
+    public:
+        class iterator {
+            mnodestore_t     *mStore;
+            uint32_t          mPosition;  // in the child list, so the list can grow meanwhile
+        public:
+            iterator(mnodestore_t *store, uint32_t position) : mStore(store), mPosition(position) {}
+            mnode_t*          operator *() const { return mStore->node(mStore->mChildList[mPosition]); }
+            iterator&         operator ++() { mPosition++; return *this; }
+            bool              operator !=(const iterator &other) const { return mPosition != other.mPosition; }
+        };
+        children_t(mnodestore_t *store, const mnode_t *dir) : mStore(store), mDir(dir) {}
+        iterator              begin() const { return iterator(mStore, mDir->mFirstChild); }
+        iterator              end() const { return iterator(mStore, mDir->mFirstChild + mDir->mChildCount); }
+        size_t                size() const { return mDir->mChildCount; }
+        mnode_t*              operator [](size_t i) const { return mStore->node(mStore->mChildList[mDir->mFirstChild + i]); }
+        mnode_t*              back() const { return (*this)[size() - 1]; }
+    };
 
+private:
+    enum { kChunkShift = 12, kChunkMask = (1 << kChunkShift) - 1 };
+    enum { kMinChildSpace = 3 };        // room for 4, the least a directory gets
+    // directories with fewer children are searched in a row
+    enum { kChildIndexThreshold = 64 };
+    
+    std::vector<mnode_t*>     mChunks;
+    std::vector<std::pair<const mnode_t*, uint32_t>> mChunkOrder; // chunk by address, for id()
+    uint32_t                  mUsed = 0;      // records handed out from the chunks, free or not
+    std::vector<mnodeid_t>    mFreeNodes;
+    size_t                    mCount = 0;
+    
+    std::vector<mnodeid_t>    mChildList;
+    std::vector<uint32_t>     mFreeRanges[32];    // by mChildSpace
+    
+    // open addressing by handle, kept under 3/4 full. the node holds the key.
+    std::vector<mnodeid_t>    mHandles;
+    size_t                    mHandleCount = 0;
+    
+    // where each child of a big directory is by the hash of its matching key, built by getChild().
+    // appendChild() keeps it current; anything else that renames children has to drop it.
+    struct ChildIndex {
+        NameMatching          matching;
+        std::vector<uint64_t> slots;          // hash << 32 | position + 1, 0 when empty
+        uint32_t              count = 0;
+    };
+    std::unordered_map<mnodeid_t, ChildIndex> mChildIndexes;
+    
+public:
+    mnodestore_t() = default;
+    ~mnodestore_t();
+    mnodestore_t(const mnodestore_t&) = delete;
+    mnodestore_t& operator =(const mnodestore_t&) = delete;
+    
+    mnode_t*              node(mnodeid_t id) { return &mChunks[id >> kChunkShift][id & kChunkMask]; }
+    mnodeid_t             id(const mnode_t *node) const;
+    // a zeroed node, which the store owns until destroy()
+    mnode_t*              create();
+    // frees |node|, its handle and its run of children. the children themselves are left alone.
+    void                  destroy(mnode_t *node);
+    size_t                size() const { return mCount; }
+    // bytes held, not counting names
+    size_t                footprint() const;
+    
+    // by handle, once index() has been called for it
+    mnode_t*              find(android::MtpObjectHandle handle);
+    void                  index(mnode_t *node);
+    
+    children_t            children(const mnode_t *dir) { return children_t(this, dir); }
+    // makes room for |count| more children of |dir| ahead of a listing
+    void                  reserveChildren(mnode_t *dir, size_t count);
+    void                  appendChild(mnode_t *dir, mnode_t *child);
+    // listings are undone from the back, so it's searched from there
+    bool                  removeChild(mnode_t *dir, mnode_t *child);
+    mnode_t*              getChild(mnode_t *dir, std::string_view childName,
+                                   const NameMatching &matching = NameMatching());
+    void                  dropChildIndex(mnode_t *dir) { mChildIndexes.erase(id(dir)); }
+    // whether a child's matching key has |hash|, which getChild() finding nothing doesn't rule out
+    bool                  hasChildHash(mnode_t *dir, uint32_t hash, const NameMatching &matching);
+    static uint32_t       nameHash(std::string_view key) { return (uint32_t)std::hash<std::string_view>()(key); }
+    
+private:
+    void                  unindex(mnode_t *node);
+    size_t                handleSlot(android::MtpObjectHandle handle) const;
+    void                  growHandles();
+    uint32_t              allocateRange(unsigned space);
+    void                  freeRange(uint32_t first, unsigned space);
+    void                  moveChildren(mnode_t *dir, unsigned space);
+    void                  buildChildIndex(mnode_t *dir, ChildIndex &index);
+    static void           insertChildIndex(ChildIndex &index, uint32_t hash, uint32_t position);
 };
 
 struct fscontext_t {
@@ -95,17 +223,69 @@ struct fscontext_t {
 };
 
 class androidfs {
+public:
+    // called while indexing with the number of objects handled so far and the total, if known.
+    typedef void (*IndexProgressCallback)(size_t indexed, size_t total, void *clientData);
+
+    struct IndexOptions {
+        bool                  enabled = false;
+        unsigned              timeLimit = 120;            // seconds
+        size_t                memoryLimit = 256 << 20;    // bytes of cached nodes
+        IndexProgressCallback progress = nullptr;
+        void                 *clientData = nullptr;
+    };
+
+    // how each fs operation is carried out, the fastest way the device supports.
+    // picked once at mount by planOperations().
+    struct OperationPlan {
+        enum Listing     { LIST_OBJECT_INFO, LIST_PROP_LIST };         // GetObjectInfo per child or one prop list
+        enum Read        { READ_WHOLE_OBJECT, READ_PARTIAL_32, READ_PARTIAL_64 };
+        enum Write       { WRITE_REUPLOAD, WRITE_EDIT };               // SendObject again or Android edit ops
+        enum Move        { MOVE_UNSUPPORTED, MOVE_COPY_DELETE, MOVE_OBJECT };
+
+        Listing               listing = LIST_OBJECT_INFO;
+        Read                  read = READ_WHOLE_OBJECT;
+        Write                 write = WRITE_REUPLOAD;
+        Move                  move = MOVE_UNSUPPORTED;
+    };
+
+    // how lookups of names that aren't there are answered
+    struct MissOptions {
+        unsigned              ttl = 30;   // seconds a directory remembers a missing name, 0 to not
+        // fnmatch(3) patterns of what macOS looks for everywhere and Android never has. a directory
+        // that isn't listed yet answers them without being listed.
+        std::vector<std::string> absentPatterns = {
+            ".DS_Store", "._*", ".hidden", "Icon\r", ".localized", ".Spotlight-V100", ".Trashes",
+            ".fseventsd", ".TemporaryItems", ".VolumeIcon.icns", ".metadata_never_index",
+            ".com.apple.timemachine.donotpresent",
+        };
+    };
+
+    // how the device moves object data, -1 leaves the device's default
+    struct TransferOptions {
+        int                   readDepth = -1;   // bulk-IN transfers queued, 0 double buffers
+        uint32_t              readSize = 0;     // bytes per bulk-IN transfer, 0 for the negotiated size
+        int                   writeDepth = -1;  // bulk-OUT transfers in flight, 0 sends serially
+    };
+
 public:
     androidfs() = default;
    ~androidfs() = default;
 public:
-    std::vector<std::string> getPathComponents(std::string &path);
     bool inside_fs() { return in_fs; }
     void fs_wait() { pthread_cond_wait(&control_cv, &control_mtx); }
 public:
     int mount(fscontext_t *ctx, char *mountPoint);
     void setup_root();
-    void buildDirectoryTree();
+    // Caches every storage's whole tree up front, so lookups never go to the device.
+    // Returns false when it gave up; unindexed directories are then fetched on demand.
+    bool buildDirectoryTree();
+    void setIndexOptions(const IndexOptions &options) { m_indexOptions = options; }
+    void setNameMatching(const NameMatching &matching) { m_nameMatching = matching; }
+    void setMissOptions(const MissOptions &options) { m_missOptions = options; }
+    void setTransferOptions(const TransferOptions &options) { m_transferOptions = options; }
+    // prints what was uploaded so far and how fast
+    void printTransferStats();
     mnode_t* root();
     int lookup(std::string &path, mnode_t **mnode, fscontext_t *ctx);
 
@@ -129,16 +309,42 @@ public:
     int open(const char *path, int flags);
     int truncate(const char *path, off_t new_size);
 
+    // applies a device event to the cached tree. called on the device's event listener thread.
+    void handleEvent(android::MtpEventCode code, const uint32_t (&params)[3]);
+
 private:
-    bool hasPartialObjectSupport();
+    void planOperations();
+    int moveChild(mnode_t *from, mnode_t *to, android::MtpObjectHandle &handle);
+    bool hasObjectProperty(android::MtpObjectFormat format, android::MtpObjectProperty property);
+    int fetchChildren(mnode_t *dir);
+    static bool addListedChild(android::MtpObjectInfo *info, void *clientData);
+    // files |info| under |dir| and deletes it. an object seen before is refreshed instead.
+    mnode_t* addNode(mnode_t *dir, android::MtpObjectInfo *info);
+    // drops |node| and everything below it; pointers to them are dead afterwards. |forget|
+    // is false when the caller has dropped m_paths already.
+    void removeNode(mnode_t *node, bool forget = true);
+    mnode_t* findNode(android::MtpObjectHandle handle);
+    mnode_t* findParentNode(android::MtpStorageID storageID, android::MtpObjectHandle parent);
+    mnode_t* parentOf(mnode_t *node) { return findParentNode(node->storageId(), node->mParent); }
+    // forgets the cached paths leading to |node| or anything below it
+    void forgetPaths(mnode_t *node);
+    bool isAbsentName(std::string_view name);
+    bool rememberedMiss(mnode_t *dir, std::string_view name);
+    // only for directories that are listed, whose children are all known
+    void rememberMiss(mnode_t *dir, std::string_view name);
+    // called whenever |dir| gains a child or one is renamed
+    void forgetMisses(mnode_t *dir) { m_misses.erase(dir); }
     
+    // the tree is shared with the event listener, so hold m_treeLock while inside the fs.
     void fs_in(){
+        pthread_mutex_lock(&m_treeLock);
         in_fs = 1;
         pthread_cond_signal(&control_cv);
     }
 
     void fs_out(){
         in_fs = 0;
+        pthread_mutex_unlock(&m_treeLock);
     }
 
     
@@ -148,13 +354,36 @@ private:
     fscontext_t m_kfs_context;
     android::AndroidMtpDevice *m_device = nullptr; // androidmtp handles synchronization
     android::MtpDeviceInfo *m_deviceInfo = nullptr;
+    android::MtpCapabilities m_capabilities; // taken at mount, with every playback format's properties
+    OperationPlan m_plan;
     bool mStorageDeviceFoldersInitialized = false;
-    std::vector<mnode_t*> m_modifiedNodes;
+    IndexOptions m_indexOptions;
+    NameMatching m_nameMatching;
+    std::vector<mnode_t*> m_modifiedNodes; // removeNode() takes them out again
     std::vector<MtpStorageInfo_t> m_storageInfo;
     pthread_mutex_t control_mtx = PTHREAD_MUTEX_INITIALIZER;
     pthread_cond_t control_cv = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t m_treeLock = PTHREAD_MUTEX_INITIALIZER;
     int in_fs = 0;
-    mnode_t m_root;
+    android::MtpStringPool m_strings; // names of every node, outlives m_nodes
+    // every node. device objects are indexed by handle; the root and the storage folders under
+    // it are made up and aren't.
+    mnodestore_t m_nodes;
+    mnode_t *m_root = nullptr;
+    // full path to node for lookup(), see forgetPaths()
+    enum { kMaxCachedPaths = 1 << 16 };
+    std::unordered_map<std::string, mnode_t*> m_paths;
+    // names lately found missing, per directory, by the hash of their matching key. a directory
+    // that gains a child forgets them all, and they run out after m_missOptions.ttl anyway in
+    // case the device didn't say.
+    struct Miss {
+        uint32_t hash;
+        uint32_t expires;       // seconds, see missClock()
+    };
+    enum { kMaxMissesPerDirectory = 32, kMaxMissDirectories = 1 << 12 };
+    std::unordered_map<mnode_t*, std::vector<Miss>> m_misses;
+    MissOptions m_missOptions;
+    TransferOptions m_transferOptions;
     /*
      The root node will contain the root folders for each storage device (e.g. if the phone has internal and sdcard, there will 2 folders, 1 for each).
      If there's only one storage device (usually internal storage), there will be only one folder for it.
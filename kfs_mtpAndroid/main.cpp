@@ -9,11 +9,15 @@
 #include <iostream>
 #include <sstream>
 #include <libgen.h>
+#include <string.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <wordexp.h>
 #include "discovery.hpp"
 #include "fs.h"
+#include "AndroidMtp/usbhost.h"
 
 static int verbose_flag = 0;
 static struct option long_options[] = {
@@ -25,6 +29,13 @@ static struct option long_options[] = {
     {"version",  no_argument,       0, 'V'},
     {"list",     no_argument,       0, 'l'},
     {"device",   required_argument, 0, 'd'},
+    {"index",    no_argument,       0, 'i'},
+    {"normalize", required_argument, 0, 'n'},
+    {"ignore-case", no_argument,    0, 'c'},
+    {"absent",   required_argument, 0, 'x'},
+    {"miss-ttl", required_argument, 0, 't'},
+    {"read-queue", required_argument, 0, 'q'},
+    {"write-queue", required_argument, 0, 'w'},
     {0, 0, 0, 0}
 };
 
@@ -39,10 +50,40 @@ static void printHelp(char* progname) {
         << "    -v   --verbose         verbose output, implies -f\n"
         << "    -l   --list            print available devices. Supports <source> option\n"
         << "    -d   --device          select a device number to mount\n"
+        << "    -i   --index           cache the whole device tree at mount\n"
+        << "    -n   --normalize       nfc or nfd, match names whatever their normalization\n"
+        << "    -c   --ignore-case     match names regardless of case\n"
+        << "    -x   --absent          pattern of names that are never on the device, may be repeated\n"
+        << "    -t   --miss-ttl        seconds a missing name is remembered, 0 to not (default 30)\n"
+        << "    -q   --read-queue      depth[,bytes] of downloads queued, 0 to double buffer (default 4)\n"
+        << "    -w   --write-queue     uploads kept in flight, 0 to send serially (default 3)\n"
 /*        << "    -o enable-move         enable the move operations\n\n";*/
         << "\nThis is an experimental program.\n";
 }
 
+static void printIndexProgress(size_t indexed, size_t total, void *){
+    fprintf(stderr, "\rindexing: %zu/%zu objects%s", indexed, total, indexed == total ? "\n" : "");
+}
+
+// ^T prints the transfer stats, or kill -USR1 where there's no SIGINFO
+#ifdef SIGINFO
+#define STATS_SIGNAL SIGINFO
+#else
+#define STATS_SIGNAL SIGUSR1
+#endif
+
+static void* statsThread(void *fs){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, STATS_SIGNAL);
+    for (;;){
+        int sig;
+        if (sigwait(&set, &sig) == 0)
+            static_cast<androidfs*>(fs)->printTransferStats();
+    }
+    return nullptr;
+}
+
 static void listMtpDevices(libusb_context *context){
     std::vector<mtp_libusb_device_t> devices;
     auto libusb_list = GetConnectedMtpDevices(devices, context);
@@ -58,7 +99,10 @@ static void listMtpDevices(libusb_context *context){
 int main(int argc, char* argv[])
 {
     char c;
-    bool list = false, printVersion = false;
+    bool list = false, printVersion = false, index = false;
+    NameMatching matching;
+    androidfs::MissOptions missOptions;
+    androidfs::TransferOptions transferOptions;
     int deviceArg = -1, ret;
     int option_index = 0; /* getopt_long stores the option index here. */
     std::string path;
@@ -70,7 +114,7 @@ int main(int argc, char* argv[])
         printHelp(argv[0]);
         return 0;
     } else do {
-        c = getopt_long(argc, (char**)argv, "hVvld:", long_options, &option_index);
+        c = getopt_long(argc, (char**)argv, "hVvld:in:cx:t:q:w:", long_options, &option_index);
         /* Detect the end of the options. */
         if (c == -1)
             break;
@@ -85,6 +129,38 @@ int main(int argc, char* argv[])
             case 'd':
                 deviceArg = atoi(optarg);
                 break;
+            case 'i':
+                index = true;
+                break;
+            case 'n':
+                if (strcmp(optarg, "nfc") == 0)
+                    matching.normalization = NameMatching::NORMALIZE_NFC;
+                else if (strcmp(optarg, "nfd") == 0)
+                    matching.normalization = NameMatching::NORMALIZE_NFD;
+                else {
+                    printHelp(argv[0]);
+                    return 0;
+                }
+                break;
+            case 'c':
+                matching.caseFold = true;
+                break;
+            case 'x':
+                missOptions.absentPatterns.push_back(optarg);
+                break;
+            case 't':
+                missOptions.ttl = atoi(optarg);
+                break;
+            case 'q': {
+                char *size = nullptr;
+                transferOptions.readDepth = (int)strtol(optarg, &size, 10);
+                if (*size == ',')
+                    transferOptions.readSize = (uint32_t)strtoul(size + 1, nullptr, 10);
+                break;
+            }
+            case 'w':
+                transferOptions.writeDepth = atoi(optarg);
+                break;
             case 'h': /* FALLTHROUGH */
             case '?':
                 printHelp(argv[0]);
@@ -95,11 +171,19 @@ int main(int argc, char* argv[])
         }
     } while(1);
 
+    // block the stats signal before any thread starts, so only statsThread takes it
+    sigset_t statsSignal;
+    sigemptyset(&statsSignal);
+    sigaddset(&statsSignal, STATS_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &statsSignal, nullptr);
+
     // init libusb
     ret = libusb_init(&context);
     if (ret != 0){
         std::cout << "Libusb error: " << libusb_strerror(ret) << std::endl;
     }
+    gMtpUSBContext = context; // async transfers complete on this context
+    libusb_event_thread_start(context);
     
     if (printVersion){
         printf("Version 1.0\n");
@@ -137,7 +221,17 @@ int main(int argc, char* argv[])
     } else for (size_t i = 0; i < devices.size(); i++) {
         if (deviceArg == (int)i) {
             fscontext_t ctx = { devices[i].dev, &fs };
+            androidfs::IndexOptions indexOptions;
+            indexOptions.enabled = index;
+            indexOptions.progress = printIndexProgress;
+            fs.setIndexOptions(indexOptions);
+            fs.setNameMatching(matching);
+            fs.setMissOptions(missOptions);
+            fs.setTransferOptions(transferOptions);
             if(fs.mount(&ctx, (char*)path.c_str())){
+                pthread_t stats;
+                pthread_create(&stats, nullptr, statsThread, &fs);
+                pthread_detach(stats);
                 for (;;){
                     if(fs.inside_fs()){
                         // if the fs code is executing continue looping.
@@ -164,6 +258,7 @@ int main(int argc, char* argv[])
     
 out:
     libusb_free_device_list(libusb_list, (int)devices.size()); // free list
+    libusb_event_thread_stop(context);
     libusb_exit(context); // exit context
     return 0;
 }
@@ -7,6 +7,12 @@
 //
 
 #include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <CoreFoundation/CoreFoundation.h>
 #include "AndroidMtp/mtp.h"
 #include "AndroidMtp/MtpObjectInfo.h"
 #include "fs.h"
@@ -76,136 +82,354 @@
 //{}
 
 
-mnode_t::mnode_t(void)
-:android::MtpObjectInfo::MtpObjectInfo(0)
-{
-    mHandle = 0;
-    mStorageID = 0;
-    mFormat = 0;
-    mProtectionStatus = 0;
-    mCompressedSize = 0;
-    mThumbFormat = 0;
-    mThumbCompressedSize = 0;
-    mThumbPixWidth = 0;
-    mThumbPixHeight = 0;
-    mImagePixWidth = 0;
-    mImagePixHeight = 0;
-    mImagePixDepth = 0;
-    mParent = 0;
-    mAssociationType = 0;
-    mAssociationDesc = 0;
-    mSequenceNumber = 0;
-    mName = nullptr;
-    mDateCreated = 0;
-    mDateModified = 0;
-    mKeywords = nullptr;
-}
-
-mnode_t::mnode_t(android::MtpObjectHandle handle)
-:android::MtpObjectInfo::MtpObjectInfo(handle)
-{
-    mStorageID = 0;
-    mFormat = 0;
-    mProtectionStatus = 0;
-    mCompressedSize = 0;
-    mThumbFormat = 0;
-    mThumbCompressedSize = 0;
-    mThumbPixWidth = 0;
-    mThumbPixHeight = 0;
-    mImagePixWidth = 0;
-    mImagePixHeight = 0;
-    mImagePixDepth = 0;
-    mParent = 0;
-    mAssociationType = 0;
-    mAssociationDesc = 0;
-    mSequenceNumber = 0;
-    mName = nullptr;
-    mDateCreated = 0;
-    mDateModified = 0;
-    mKeywords = nullptr;
-}
-
-mnode_t::mnode_t(const mnode_t& objInfo):
-MtpObjectInfo::MtpObjectInfo(objInfo.mHandle)
-{
-    if (objInfo.mName == nullptr || objInfo.mKeywords == nullptr)
-        throw "BUG: object strings are null!???";
+// the name has to outlive the node, so info has to have been read with androidfs' string pool
+void mnode_t::update(const android::MtpObjectInfo& info)
+{
+    mName = info.mName.data();
+    mNameLength = (uint16_t)info.mName.size();
+    mStorageID = info.mStorageID;
+    mFormat = info.mFormat;
+    mParent = info.mParent;
+    mDateCreated = (uint32_t)info.mDateCreated;
+    mDateModified = (uint32_t)info.mDateModified;
+    mObjectSize = info.mObjectSize;
+}
+
+void mnode_t::getObjectInfo(android::MtpObjectInfo& info) const
+{
+    info.mHandle = mHandle;
+    info.mStorageID = mStorageID;
+    info.mFormat = mFormat;
+    info.mCompressedSize = mObjectSize > UINT32_MAX ? UINT32_MAX : (uint32_t)mObjectSize;
+    info.mParent = mParent;
+    info.mAssociationType = mFormat == MTP_FORMAT_ASSOCIATION ? MTP_ASSOCIATION_TYPE_GENERIC_FOLDER : 0;
+    info.mName = std::string_view(mName, mNameLength);
+    info.mDateCreated = mDateCreated;
+    info.mDateModified = mDateModified;
+    info.mObjectSize = mObjectSize;
+}
+
+std::string_view matchingKey(std::string_view name, const NameMatching &matching, std::string &buffer)
+{
+    if (matching.exact())
+        return name;
+    
+    // nearly every name is ASCII, which normalizing leaves alone and folding just lowercases
+    if (std::all_of(name.begin(), name.end(), [](char c) { return (unsigned char)c < 0x80; })) {
+        if (!matching.caseFold)
+            return name;
+        buffer.assign(name);
+        for (auto &c : buffer)
+            c = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        return buffer;
+    }
     
-    mHandle = objInfo.mHandle;
-    mStorageID = objInfo.mStorageID;
-    mFormat = objInfo.mFormat;
-    mProtectionStatus = objInfo.mProtectionStatus;
-    mCompressedSize = objInfo.mCompressedSize;
-    mThumbFormat = objInfo.mThumbFormat;
-    mThumbCompressedSize = objInfo.mThumbCompressedSize;
-    mThumbPixWidth = objInfo.mThumbPixWidth;
-    mThumbPixHeight = objInfo.mThumbPixHeight;
-    mImagePixWidth = objInfo.mImagePixWidth;
-    mImagePixHeight = objInfo.mImagePixHeight;
-    mImagePixDepth = objInfo.mImagePixDepth;
-    mParent = objInfo.mParent;
-    mAssociationType = objInfo.mAssociationType;
-    mAssociationDesc = objInfo.mAssociationDesc;
-    mSequenceNumber = objInfo.mSequenceNumber;
-    mName = strdup(objInfo.mName);
-    mDateCreated = objInfo.mDateCreated;
-    mDateModified = objInfo.mDateModified;
-    mKeywords = strdup(objInfo.mKeywords);
-}
-
-// we won't strdup string here because objInfo is dynamically allocated
-mnode_t::mnode_t(android::MtpObjectInfo* objInfo):
-MtpObjectInfo::MtpObjectInfo(objInfo->mHandle)
-{
-    mHandle = objInfo->mHandle;
-    mStorageID = objInfo->mStorageID;
-    mFormat = objInfo->mFormat;
-    mProtectionStatus = objInfo->mProtectionStatus;
-    mCompressedSize = objInfo->mCompressedSize;
-    mThumbFormat = objInfo->mThumbFormat;
-    mThumbCompressedSize = objInfo->mThumbCompressedSize;
-    mThumbPixWidth = objInfo->mThumbPixWidth;
-    mThumbPixHeight = objInfo->mThumbPixHeight;
-    mImagePixWidth = objInfo->mImagePixWidth;
-    mImagePixHeight = objInfo->mImagePixHeight;
-    mImagePixDepth = objInfo->mImagePixDepth;
-    mParent = objInfo->mParent;
-    mAssociationType = objInfo->mAssociationType;
-    mAssociationDesc = objInfo->mAssociationDesc;
-    mSequenceNumber = objInfo->mSequenceNumber;
-    mName = objInfo->mName;
-    mDateCreated = objInfo->mDateCreated;
-    mDateModified = objInfo->mDateModified;
-    mKeywords = objInfo->mKeywords;
-    // our class
-}
-
-// caller is responsible for what happens to name...
-mnode_t::mnode_t(android::MtpObjectHandle handle, char *name):
-android::MtpObjectInfo::MtpObjectInfo(handle)
-{
-    // never free memory you didn't malloc.
-    // ~MtpObjectHandle() frees mName, and if 'name' is a hardcoded string, we'll probably crash.
-    // so we always duplicate, because ~MtpObjectHandle() will always free.
-    mName = strdup(name);
-     // we don't have a keyword with his constructor, so to prevent a null free, we just duplicate name into mKeywords.
-    mKeywords = strdup(name);
-    mFetched = true; // this directory's files are custom made so it doesn't need to be fetched
-}
-
-mnode_t* mnode_t::getChild(const std::string &childName)
+    CFStringRef string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)name.data(),
+                                                 name.size(), kCFStringEncodingUTF8, false);
+    if (string == nullptr)
+        return name; // not UTF-8, only matches itself
+    CFMutableStringRef key = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, string);
+    CFRelease(string);
+    if (matching.normalization != NameMatching::NORMALIZE_NONE)
+        CFStringNormalize(key, matching.normalization == NameMatching::NORMALIZE_NFC ?
+                          kCFStringNormalizationFormC : kCFStringNormalizationFormD);
+    if (matching.caseFold)
+        CFStringFold(key, kCFCompareCaseInsensitive, nullptr);
+    
+    const CFRange range = CFRangeMake(0, CFStringGetLength(key));
+    CFIndex used = 0;
+    buffer.resize(CFStringGetMaximumSizeForEncoding(range.length, kCFStringEncodingUTF8));
+    CFStringGetBytes(key, range, kCFStringEncodingUTF8, 0, false, (UInt8 *)&buffer[0],
+                     buffer.size(), &used);
+    buffer.resize(used);
+    CFRelease(key);
+    return buffer;
+}
+
+mnodestore_t::~mnodestore_t()
 {
-    // search for child in cache and return
-    for(auto &child : mChildren){
-        if (child.name() == childName)
-            return &child;
+    for (auto chunk : mChunks)
+        free(chunk);
+}
+
+mnodeid_t mnodestore_t::id(const mnode_t *node) const
+{
+    // the last chunk starting at or below it
+    auto it = std::upper_bound(mChunkOrder.begin(), mChunkOrder.end(), node,
+                               [](const mnode_t *n, const std::pair<const mnode_t*, uint32_t> &chunk) {
+        return std::less<const mnode_t*>()(n, chunk.first);
+    });
+    --it;
+    return (it->second << kChunkShift) | (mnodeid_t)(node - it->first);
+}
+
+mnode_t* mnodestore_t::create()
+{
+    mnodeid_t id;
+    if (!mFreeNodes.empty()) {
+        id = mFreeNodes.back();
+        mFreeNodes.pop_back();
+    } else {
+        if ((mUsed & kChunkMask) == 0) {
+            auto chunk = (mnode_t*)malloc(sizeof(mnode_t) << kChunkShift);
+            if (chunk == nullptr)
+                throw std::bad_alloc();
+            std::pair<const mnode_t*, uint32_t> entry(chunk, (uint32_t)mChunks.size());
+            mChunkOrder.insert(std::upper_bound(mChunkOrder.begin(), mChunkOrder.end(), entry), entry);
+            mChunks.push_back(chunk);
+        }
+        id = mUsed++;
+    }
+    mnode_t *node = this->node(id);
+    memset(node, 0, sizeof(mnode_t));
+    node->mName = "";
+    mCount++;
+    return node;
+}
+
+void mnodestore_t::destroy(mnode_t *node)
+{
+    const mnodeid_t id = this->id(node);
+    unindex(node);
+    if (node->mChildSpace != 0)
+        freeRange(node->mFirstChild, node->mChildSpace);
+    mChildIndexes.erase(id);
+    node->mHandle = 0;
+    node->mChildSpace = node->mChildCount = 0;
+    mFreeNodes.push_back(id);
+    mCount--;
+}
+
+size_t mnodestore_t::footprint() const
+{
+    return (mChunks.size() * sizeof(mnode_t) << kChunkShift) +
+        mFreeNodes.capacity() * sizeof(mnodeid_t) +
+        mChildList.capacity() * sizeof(mnodeid_t) +
+        mHandles.capacity() * sizeof(mnodeid_t);
+}
+
+// handles are mostly handed out in sequence, which the multiply spreads over the table
+size_t mnodestore_t::handleSlot(android::MtpObjectHandle handle) const
+{
+    return (size_t)((handle * 0x9E3779B1u) & (mHandles.size() - 1));
+}
+
+mnode_t* mnodestore_t::find(android::MtpObjectHandle handle)
+{
+    if (mHandleCount == 0)
+        return nullptr;
+    for (size_t i = handleSlot(handle); mHandles[i] != NO_NODE; i = (i + 1) & (mHandles.size() - 1)) {
+        mnode_t *node = this->node(mHandles[i]);
+        if (node->mHandle == handle)
+            return node;
     }
-    // if it doesn't exist, return null so that
     return nullptr;
 }
 
+void mnodestore_t::index(mnode_t *node)
+{
+    if ((mHandleCount + 1) * 4 > mHandles.size() * 3)
+        growHandles();
+    size_t i = handleSlot(node->mHandle);
+    while (mHandles[i] != NO_NODE) {
+        if (this->node(mHandles[i])->mHandle == node->mHandle) {
+            mHandles[i] = id(node);
+            return;
+        }
+        i = (i + 1) & (mHandles.size() - 1);
+    }
+    mHandles[i] = id(node);
+    mHandleCount++;
+}
+
+void mnodestore_t::unindex(mnode_t *node)
+{
+    if (mHandleCount == 0)
+        return;
+    const size_t mask = mHandles.size() - 1;
+    const mnodeid_t id = this->id(node);
+    size_t i = handleSlot(node->mHandle);
+    while (mHandles[i] != id) {
+        if (mHandles[i] == NO_NODE)
+            return;
+        i = (i + 1) & mask;
+    }
+    // shift back whatever followed it and could have been here, so no probe stops short
+    for (size_t j = (i + 1) & mask; mHandles[j] != NO_NODE; j = (j + 1) & mask) {
+        const size_t home = handleSlot(this->node(mHandles[j])->mHandle);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            mHandles[i] = mHandles[j];
+            i = j;
+        }
+    }
+    mHandles[i] = NO_NODE;
+    mHandleCount--;
+}
+
+void mnodestore_t::growHandles()
+{
+    std::vector<mnodeid_t> old(std::max<size_t>(mHandles.size() * 2, 1024), NO_NODE);
+    old.swap(mHandles);
+    const size_t mask = mHandles.size() - 1;
+    for (auto id : old) {
+        if (id == NO_NODE)
+            continue;
+        size_t i = handleSlot(node(id)->mHandle);
+        while (mHandles[i] != NO_NODE)
+            i = (i + 1) & mask;
+        mHandles[i] = id;
+    }
+}
+
+uint32_t mnodestore_t::allocateRange(unsigned space)
+{
+    auto &free = mFreeRanges[space];
+    if (!free.empty()) {
+        const uint32_t first = free.back();
+        free.pop_back();
+        return first;
+    }
+    const uint32_t first = (uint32_t)mChildList.size();
+    mChildList.resize(mChildList.size() + ((size_t)1 << space) / 2, NO_NODE);
+    return first;
+}
+
+void mnodestore_t::freeRange(uint32_t first, unsigned space)
+{
+    mFreeRanges[space].push_back(first);
+}
+
+// gives |dir| a run with room for (1 << space) / 2 children
+void mnodestore_t::moveChildren(mnode_t *dir, unsigned space)
+{
+    const uint32_t first = allocateRange(space);
+    std::copy(mChildList.begin() + dir->mFirstChild,
+              mChildList.begin() + dir->mFirstChild + dir->mChildCount, mChildList.begin() + first);
+    if (dir->mChildSpace != 0)
+        freeRange(dir->mFirstChild, dir->mChildSpace);
+    dir->mFirstChild = first;
+    dir->mChildSpace = space;
+}
+
+void mnodestore_t::reserveChildren(mnode_t *dir, size_t count)
+{
+    const size_t wanted = dir->mChildCount + count;
+    unsigned space = kMinChildSpace;
+    while (((size_t)1 << space) / 2 < wanted)
+        space++;
+    if (space > dir->mChildSpace)
+        moveChildren(dir, space);
+}
 
-void mnode_t::push_back(mnode_t mnode)
+void mnodestore_t::appendChild(mnode_t *dir, mnode_t *child)
 {
-    this->mChildren.push_back(mnode);
+    if (dir->mChildSpace == 0 || dir->mChildCount == ((size_t)1 << dir->mChildSpace) / 2)
+        moveChildren(dir, std::max<unsigned>(dir->mChildSpace + 1, kMinChildSpace));
+    const uint32_t position = dir->mChildCount++;
+    mChildList[dir->mFirstChild + position] = id(child);
+    
+    auto index = mChildIndexes.find(id(dir));
+    if (index != mChildIndexes.end() && (index->second.count + 1) * 2 > index->second.slots.size()) {
+        mChildIndexes.erase(index); // getChild() makes a bigger one
+    } else if (index != mChildIndexes.end()) {
+        std::string buffer;
+        const auto key = matchingKey(child->name(), index->second.matching, buffer);
+        insertChildIndex(index->second, nameHash(key), position);
+    }
+}
+
+bool mnodestore_t::removeChild(mnode_t *dir, mnode_t *child)
+{
+    const mnodeid_t childID = id(child);
+    auto first = mChildList.begin() + dir->mFirstChild, last = first + dir->mChildCount;
+    auto it = std::find(std::make_reverse_iterator(last), std::make_reverse_iterator(first), childID);
+    if (it == std::make_reverse_iterator(first))
+        return false;
+    // keep the rest in order, readdir() lists them that way
+    std::copy(it.base(), last, std::prev(it.base()));
+    if (--dir->mChildCount == 0) {
+        freeRange(dir->mFirstChild, dir->mChildSpace);
+        dir->mFirstChild = 0;
+        dir->mChildSpace = 0;
+    }
+    dropChildIndex(dir);
+    return true;
+}
+
+void mnodestore_t::insertChildIndex(ChildIndex &index, uint32_t hash, uint32_t position)
+{
+    const size_t mask = index.slots.size() - 1;
+    size_t i = hash & mask;
+    while (index.slots[i] != 0)
+        i = (i + 1) & mask;
+    index.slots[i] = (uint64_t)hash << 32 | (position + 1);
+    index.count++;
+}
+
+void mnodestore_t::buildChildIndex(mnode_t *dir, ChildIndex &index)
+{
+    std::string buffer;
+    // at most half full, with room for the directory to double before it's built again
+    size_t size = 16;
+    while (size < (size_t)dir->mChildCount * 4)
+        size <<= 1;
+    index.slots.assign(size, 0);
+    index.count = 0;
+    for (uint32_t i = 0; i < dir->mChildCount; i++) {
+        const auto key = matchingKey(children(dir)[i]->name(), index.matching, buffer);
+        insertChildIndex(index, nameHash(key), i);
+    }
+}
+
+bool mnodestore_t::hasChildHash(mnode_t *dir, uint32_t hash, const NameMatching &matching)
+{
+    auto index = mChildIndexes.find(id(dir));
+    if (index != mChildIndexes.end() && index->second.matching == matching) {
+        const auto &slots = index->second.slots;
+        const size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; slots[i] != 0; i = (i + 1) & mask) {
+            if ((uint32_t)(slots[i] >> 32) == hash)
+                return true;
+        }
+        return false;
+    }
+    std::string buffer;
+    for (auto child : children(dir)) {
+        if (nameHash(matchingKey(child->name(), matching, buffer)) == hash)
+            return true;
+    }
+    return false;
+}
+
+mnode_t* mnodestore_t::getChild(mnode_t *dir, std::string_view childName, const NameMatching &matching)
+{
+    std::string keyBuffer, buffer;
+    const std::string_view key = matchingKey(childName, matching, keyBuffer);
+    const auto siblings = children(dir);
+    
+    if (dir->mChildCount >= kChildIndexThreshold) {
+        auto &index = mChildIndexes[id(dir)];
+        if (index.slots.empty() || !(index.matching == matching)) {
+            index.matching = matching;
+            buildChildIndex(dir, index);
+        }
+        const uint32_t hash = nameHash(key);
+        const size_t mask = index.slots.size() - 1;
+        for (size_t i = hash & mask; index.slots[i] != 0; i = (i + 1) & mask) {
+            if ((uint32_t)(index.slots[i] >> 32) != hash)
+                continue;
+            auto child = siblings[(uint32_t)index.slots[i] - 1];
+            if (matchingKey(child->name(), matching, buffer) == key)
+                return child;
+        }
+        return nullptr;
+    }
+    
+    // search for child in cache and return
+    for (auto child : siblings) {
+        if (matchingKey(child->name(), matching, buffer) == key)
+            return child;
+    }
+    // if it doesn't exist, return null so that
+    return nullptr;
 }